@@ -0,0 +1,88 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+namespace arena {
+
+// bump allocator for memory that lives no longer than a step: allocating is
+// an atomic add, deallocating does nothing and reset() takes everything back
+// at once. Requests past the end of the buffer go upstream; the next reset
+// grows the buffer to hold them, so that once it fits a step the arena makes
+// no upstream allocation at all. Allocating is safe from many threads at
+// once, reset() is not. A copy starts empty, on the same upstream
+class FrameArena : public std::pmr::memory_resource {
+ private:
+  struct Block {
+    void* p;
+    std::size_t bytes;
+    std::size_t alignment;
+  };
+
+  std::pmr::memory_resource* upstream_;
+  std::byte* buffer_{nullptr};
+  std::size_t capacity_{0};
+  std::atomic<std::size_t> used_{0};  // bytes of the buffer handed out
+
+  std::mutex overflow_mutex_;
+  std::vector<Block> overflow_;  // handed out from upstream
+  std::atomic<std::size_t> overflow_bytes_{0};
+  std::atomic<std::size_t> upstream_allocations_{0};
+
+  void release();
+
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+  void do_deallocate(void* p, std::size_t bytes,
+                     std::size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+
+ public:
+  explicit FrameArena(
+      std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+  FrameArena(const FrameArena& other);
+  FrameArena& operator=(const FrameArena& other);
+  ~FrameArena() override;
+
+  void reset();
+
+  // bytes handed out since the last reset
+  std::size_t getUsed() const;
+
+  // upstream allocations since the last reset, that of the reset included
+  std::size_t getUpstreamAllocations() const;
+
+  std::size_t getCapacity() const;
+};
+
+// passes every request on to `upstream`, counting them
+class CountingResource : public std::pmr::memory_resource {
+ private:
+  std::pmr::memory_resource* upstream_;
+  std::atomic<std::size_t> allocations_{0};
+  std::atomic<std::size_t> bytes_{0};
+
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+  void do_deallocate(void* p, std::size_t bytes,
+                     std::size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+
+ public:
+  explicit CountingResource(
+      std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
+  // allocations since construction
+  std::size_t getAllocations() const;
+
+  // bytes allocated and not yet deallocated
+  std::size_t getBytes() const;
+};
+
+}  // namespace arena
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef BOID_HPP
 #define BOID_HPP
 
+#include <array>
+#include <cstddef>
 #include <memory>
 #include <vector>
 
@@ -8,6 +10,80 @@
 
 namespace boid {
 
+// positions of up to `capacity` predators, one array per coordinate, stored
+// inline; the unused lanes up to the next multiple of `width` hold NaN, which
+// fails every distance test, so kernels can run over whole groups of lanes
+struct PredatorLanes {
+  static constexpr std::size_t capacity = 100;
+  static constexpr std::size_t width = 4;
+
+  std::array<double, capacity> x;
+  std::array<double, capacity> y;
+  std::size_t size{0};
+
+  PredatorLanes();
+
+  std::size_t padded() const;
+  void clear();
+  void push(const point::Point& position);
+};
+
+class Boid;
+
+// positions and velocities of a list of neighbours: read in place from
+// arrays that outlive the list, or gathered from a list of boids
+class Neighbors {
+ private:
+  std::vector<point::Point> gathered_;  // positions, then velocities
+  const point::Point* positions_;
+  const point::Point* velocities_;
+  std::size_t size_;
+
+ public:
+  Neighbors(const point::Point* positions, const point::Point* velocities,
+            std::size_t size);
+  Neighbors(const std::vector<std::shared_ptr<Boid>>& list);
+  // the pointers may point into gathered_
+  Neighbors(const Neighbors&) = delete;
+  Neighbors& operator=(const Neighbors&) = delete;
+
+  const point::Point& position(std::size_t k) const { return positions_[k]; }
+  const point::Point& velocity(std::size_t k) const { return velocities_[k]; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+};
+
+// the rules, for a boid at `position` moving at `velocity`: Boid, Prey and
+// Predator apply them to themselves, flock::Flock to its state arrays
+double angle(const point::Point& position, const point::Point& velocity,
+             const point::Point& other);
+
+point::Point separation(const point::Point& position, double s, double ds,
+                        const Neighbors& near);
+
+point::Point alignment(const point::Point& velocity, double a,
+                       const Neighbors& near_prey);
+
+point::Point cohesion(const point::Point& position, double c,
+                      const Neighbors& near_prey);
+
+point::Point repulsion(const point::Point& position, double r,
+                       const Neighbors& near_predators);
+
+point::Point repulsion(const point::Point& position,
+                       const point::Point& velocity, double r, double d,
+                       double sight_angle, const PredatorLanes& predators);
+
+point::Point chase(const point::Point& position, double ch,
+                   const Neighbors& near_prey);
+
+void clamp(double min_speed, double max_speed, point::Point& velocity);
+
+// clamp over n velocities stored as two arrays, one per component, without
+// branches; the same result as the clamp of each velocity
+void clamp(double min_speed, double max_speed, double* vx, double* vy,
+           std::size_t n);
+
 class Boid {
  protected:
   point::Point position_;
@@ -23,8 +99,7 @@ class Boid {
   void setBoid(const point::Point& position, const point::Point& velocity);
   double angle(const Boid& other) const;
 
-  point::Point separation(double s, double ds,
-                          const std::vector<std::shared_ptr<Boid>>& near) const;
+  point::Point separation(double s, double ds, const Neighbors& near) const;
 
   virtual void clamp(double min_speed, double max_speed,
                      point::Point& velocity) = 0;
@@ -37,14 +112,14 @@ class Prey final : public Boid {
   Prey();
   Prey(const point::Point& position, const point::Point& velocity);
 
-  point::Point alignment(
-      double a, const std::vector<std::shared_ptr<Boid>>& near_prey) const;
+  point::Point alignment(double a, const Neighbors& near_prey) const;
+
+  point::Point cohesion(double c, const Neighbors& near_prey) const;
 
-  point::Point cohesion(
-      double c, const std::vector<std::shared_ptr<Boid>>& near_prey) const;
+  point::Point repulsion(double r, const Neighbors& near_predators) const;
 
-  point::Point repulsion(
-      double r, const std::vector<std::shared_ptr<Boid>>& near_predators) const;
+  point::Point repulsion(double r, double d, double sight_angle,
+                         const PredatorLanes& predators) const;
 
   void clamp(double min_speed, double max_speed,
              point::Point& velocity) override;
@@ -55,8 +130,7 @@ class Predator final : public Boid {
   Predator();
   Predator(const point::Point& position, const point::Point& velocity);
 
-  point::Point chase(double ch,
-                     const std::vector<std::shared_ptr<Boid>>& near_prey) const;
+  point::Point chase(double ch, const Neighbors& near_prey) const;
 
   void clamp(double min_speed, double max_speed,
              point::Point& velocity) override;
@@ -0,0 +1,143 @@
+#ifndef ENSEMBLE_HPP
+#define ENSEMBLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "boid.hpp"
+#include "flock.hpp"
+#include "grid.hpp"
+#include "obstacles.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+#include "statistics.hpp"
+
+namespace ensemble {
+
+// everything that sets one member of an ensemble apart; the defaults are
+// those of flock::Flock
+struct Config {
+  std::size_t n_prey{200};
+  std::size_t n_predators{5};
+  flock::FlightParameters flight_parameters{0.1, 0.1, 0.004, 0.6, 0.008};
+  flock::SpeedLimits speed_limits{7., 12., 5., 8.};
+  double d{75.};
+  double prey_ds{20.};
+  double predator_ds{37.5};
+
+  // as flock::Flock::setObstacles: built, shared rather than copied, none
+  // if null; not among the parameters below
+  std::shared_ptr<const obstacles::Field> obstacles;
+  double avoidance{0.2};
+  double obstacle_margin{30.};
+};
+
+// names of the parameters of Config, as spelled in sweep specs and settings
+const std::vector<std::string>& parameterNames();
+
+// the parameter `name` of a configuration; both throw
+// std::invalid_argument if there is no such parameter
+double get(const Config& config, const std::string& name);
+void set(Config& config, const std::string& name, double value);
+
+// throws std::invalid_argument describing what makes `config` no valid flock
+void validate(const Config& config);
+
+// many independent flocks stepped together. The boids of all the members
+// live back to back in one arena, one array per coordinate and species, with
+// a second arena the next state is written to; a step runs whole members as
+// costed tasks on a thread pool, the most expensive first, so that the small
+// ones fill the gaps at the end. Members follow flock::Flock::updateFlock,
+// through the same flock::Flock::PreyRules and PredatorRules, and step to
+// the same state as a flock would, without coasting
+class Ensemble {
+ private:
+  struct Lanes {
+    parallel::FirstTouchVector<double> x;
+    parallel::FirstTouchVector<double> y;
+    parallel::FirstTouchVector<double> vx;
+    parallel::FirstTouchVector<double> vy;
+
+    void resize(std::size_t n);
+    void set(std::size_t i, const point::Point& position,
+             const point::Point& velocity);
+  };
+
+  struct Member {
+    Config config;
+    std::size_t prey_begin;
+    std::size_t predator_begin;
+    flock::Flock::PreyRules prey_rules;  // copied fresh for every boid
+    flock::Flock::PredatorRules predator_rules;
+
+    // per member, so that members can be stepped concurrently
+    grid::Index prey_index;
+    grid::Index predator_index;
+    boid::PredatorLanes predator_lanes;  // while they fit
+    std::vector<point::Point> prey_positions;
+    std::vector<point::Point> predator_positions;
+    std::vector<std::size_t> candidates;
+
+    Member(const Config& member_config, std::size_t first_prey,
+           std::size_t first_predator);
+  };
+
+  Lanes prey_;
+  Lanes predators_;
+  Lanes next_prey_;
+  Lanes next_predators_;
+
+  std::vector<Member> members_;
+  std::vector<std::size_t> order_;  // members by decreasing cost of a step
+  std::vector<double> costs_;       // of the members in order_
+
+  std::size_t add(const Config& config,
+                  const std::vector<point::Point>& prey_positions,
+                  const std::vector<point::Point>& prey_velocities,
+                  const std::vector<point::Point>& predator_positions,
+                  const std::vector<point::Point>& predator_velocities);
+
+  void stepMember(std::size_t m, double dt);
+  void stepPrey(Member& member, std::size_t i);
+  void stepPredator(Member& member, std::size_t i);
+
+ public:
+  std::size_t size() const;
+  std::size_t getBoidCount() const;
+  const Config& getConfig(std::size_t m) const;
+
+  // removes every member, keeping the memory of the arena for the next ones
+  void clear();
+
+  // a member with boids drawn as flock::Flock::generateBoids does, from a
+  // generator seeded with `seed`
+  std::size_t add(const Config& config, std::uint32_t seed);
+
+  // a copy of the current state of `flock`
+  std::size_t add(const flock::Flock& flock);
+
+  std::vector<point::Point> getPreyPositions(std::size_t m) const;
+  std::vector<point::Point> getPreyVelocities(std::size_t m) const;
+  std::vector<point::Point> getPredatorPositions(std::size_t m) const;
+  std::vector<point::Point> getPredatorVelocities(std::size_t m) const;
+
+  // moves both arenas to new memory, each member's boids written first by
+  // the thread of `pool` that steps it: on a NUMA host with a pinned pool,
+  // every thread then finds the boids it steps on its own node. The member's
+  // grid indices already are, being built by that thread. Worth calling once
+  // the members are all added
+  void place(parallel::ThreadPool& pool);
+
+  void step(double dt, parallel::ThreadPool& pool);
+
+  // Flock::statistics of every member, computed in parallel over members
+  std::vector<statistics::Statistics> statistics(
+      parallel::ThreadPool& pool) const;
+};
+
+}  // namespace ensemble
+
+#endif
@@ -2,12 +2,19 @@
 #define FLOCK_HPP
 
 #include <array>
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
 #include <random>
 #include <vector>
 
+#include "arena.hpp"
 #include "boid.hpp"
+#include "grid.hpp"
+#include "obstacles.hpp"
+#include "parallel.hpp"
+#include "rules.hpp"
 #include "statistics.hpp"
 
 namespace flock {
@@ -27,7 +34,66 @@ struct SpeedLimits {
   double predator_max;
 };
 
+// bounds on the steps taken by Flock::advance
+struct StepLimits {
+  double min_dt;   // shorter frames are put off and merged with the next ones
+  double max_dt;   // longest step ever taken
+  double courant;  // fraction of the smallest radius two boids may close in
+                   // a single step
+};
+
+// what Flock::advance did in a frame, or what Flock::plan asks for
+struct StepReport {
+  std::size_t substeps;  // 0 when the frame was put off
+  double dt;             // length of each substep
+  double max_dt;         // longest step allowed by the speeds and radii
+  // seconds each thread (each tile process of a tiles::World) spent on the
+  // substeps; empty in a plan
+  std::vector<double> busy;
+};
+
+// positions and velocities of one species, an array each, left unwritten
+// when they grow so that Flock::place can choose their pages
+struct State {
+  parallel::FirstTouchVector<point::Point> positions;
+  parallel::FirstTouchVector<point::Point> velocities;
+};
+
+// read-only view of the elements of an array the flock owns, valid until
+// the next step, which swaps the arrays (see Flock::updateFlock)
+template <class T>
+class View {
+ private:
+  const T* begin_;
+  const T* end_;
+
+ public:
+  template <class Allocator>
+  View(const std::vector<T, Allocator>& array)
+      : begin_{array.data()}, end_{array.data() + array.size()} {}
+
+  const T* begin() const { return begin_; }
+  const T* end() const { return end_; }
+  std::size_t size() const { return static_cast<std::size_t>(end_ - begin_); }
+  bool empty() const { return begin_ == end_; }
+  const T& operator[](const std::size_t i) const { return begin_[i]; }
+};
+
 class Flock {
+ public:
+  static constexpr double prey_sight_angle = 2. / 3 * M_PI;
+  static constexpr double predator_sight_angle = 0.5 * M_PI;
+
+  // the rules of each species, fed in a single pass over the neighbours in
+  // sight (see rules.hpp): a new behaviour is a rule added to these lists.
+  // ensemble::Ensemble steps its members with the same ones
+  using PreyRules =
+      rules::Pipeline<rules::Repulsion, rules::Separation<rules::Set::prey>,
+                      rules::Alignment, rules::Cohesion, rules::Avoid>;
+  using PredatorRules =
+      rules::Pipeline<rules::Separation<rules::Set::predators>, rules::Chase,
+                      rules::Avoid>;
+
  private:
   std::mt19937 mt_{std::random_device{}()};
   std::size_t n_prey_;
@@ -36,42 +102,201 @@ class Flock {
   std::vector<std::shared_ptr<boid::Prey>> prey_flock_;
   std::vector<std::shared_ptr<boid::Predator>> predator_flock_;
 
-  static constexpr double prey_sight_angle_ = 2. / 3 * M_PI;
-  static constexpr double predator_sight_angle_ = 0.5 * M_PI;
-
   FlightParameters flight_parameters_;
   SpeedLimits speed_limits_;
+  StepLimits step_limits_{0.1, 1., 1.};
+  double pending_dt_{0.};  // time put off by advance, not yet simulated
+
+  double d_{75.};                 // radius for near boids
+  double prey_ds_{20.};           // separation radius for prey
+  double predator_ds_{d_ * 0.5};  // and for predators
+
+  // the state of each species, current and next: a step reads the first,
+  // writes the second and swaps them. The boids above are only written from
+  // the state when someone asks for them (see syncBoids)
+  State prey_;
+  State predators_;
+  State next_prey_;
+  State next_predators_;
+  mutable bool boids_stale_{false};
+
+  // one spatial index per species, each tuned for its own population
+  grid::Index prey_index_;
+  grid::Index predator_index_;
+  boid::PredatorLanes predator_lanes_;  // while they fit
 
-  static constexpr double d_ = 75.;        // radius for near boids
-  static constexpr double prey_ds_ = 20.;  // separation radius for prey
-  static constexpr double predator_ds_ = d_ * 0.5;  // and for predators
+  // static obstacles, shared with the copies of the flock: steered around
+  // from obstacle_margin_ away, and never entered (see land)
+  std::shared_ptr<const obstacles::Field> obstacles_;
+  double avoidance_{0.2};
+  double obstacle_margin_{30.};
+
+  // multi-rate stepping: a boid with no other boid in sight range just
+  // coasts, skipping the rules, for as long as its slack (how much closer
+  // than now the other boids may get before one can be in range) lasts
+  double coast_tolerance_{0.};
+  parallel::FirstTouchVector<double> prey_slack_;
+  parallel::FirstTouchVector<double> predator_slack_;
+  std::size_t coasting_{0};
+
+  // a step runs as tasks on the default pool (see buildTasks); the work per
+  // boid in the previous step estimates the cost of the next one
+  parallel::FirstTouchVector<double> prey_work_;
+  parallel::FirstTouchVector<double> predator_work_;
+  std::vector<std::size_t> task_boids_;
+  std::vector<std::size_t> task_start_;
+  std::vector<double> task_costs_;
+  std::size_t prey_tasks_{0};
+  std::vector<double> busy_time_;
+  parallel::RunReport run_report_;
+  parallel::ThreadPool* pool_{nullptr};  // the default pool if null
+
+  // the boids of generateBoids come from memory_, the scratch of a step
+  // (new states, neighbour lists, candidates) from the frame arena, which
+  // updateFlock resets as it starts
+  std::pmr::memory_resource* memory_;
+  arena::FrameArena frame_;
+  std::size_t frame_bytes_{0};
+  std::size_t frame_allocations_{0};
+
+  void readBoids();
+  void syncBoids() const;
+  void buildIndex();
+  void resetCoasting();
+  void buildTasks();
+  template <class Take>
+  void select(std::size_t i, bool is_prey, bool of_prey,
+              std::pmr::vector<std::size_t>& candidates, Take take) const;
+  PreyRules preyRules() const;
+  PredatorRules predatorRules() const;
+  template <class Rules>
+  point::Point steer(std::size_t i, bool is_prey, Rules rules,
+                     bool predators_pass, std::size_t& neighbours,
+                     std::pmr::vector<std::size_t>& candidates) const;
+  point::Point steered(std::size_t i, bool is_prey, std::size_t& neighbours,
+                       std::pmr::vector<std::size_t>& candidates) const;
+  std::array<double, 2> speedLimits(bool is_prey) const;
+  point::Point land(const point::Point& position, point::Point& velocity,
+                    bool is_prey, double dt) const;
+  std::array<point::Point, 2> evaluate(
+      std::size_t i, bool is_prey, double dt, std::size_t& neighbours,
+      std::pmr::vector<std::size_t>& candidates) const;
+  double slack(std::size_t i, bool is_prey, double closing,
+               std::pmr::vector<std::size_t>& candidates) const;
 
  public:
-  Flock(std::size_t n_prey, std::size_t n_predators);
+  // the rules for these parameters, steering around the obstacles of
+  // `field` unless it is null
+  static PreyRules preyRules(const FlightParameters& flight_parameters,
+                             double prey_ds, const obstacles::Field* field,
+                             double avoidance, double margin);
+  static PredatorRules predatorRules(const FlightParameters& flight_parameters,
+                                     double predator_ds,
+                                     const obstacles::Field* field,
+                                     double avoidance, double margin);
+
+  // `memory` must be safe to use from several threads at once, and outlive
+  // every boid allocated from it
+  Flock(std::size_t n_prey, std::size_t n_predators,
+        std::pmr::memory_resource* memory = std::pmr::get_default_resource());
 
   Flock(const std::vector<std::shared_ptr<boid::Prey>>& prey,
         const std::vector<std::shared_ptr<boid::Predator>>& predators,
-        const SpeedLimits& speed_limits);
+        const SpeedLimits& speed_limits,
+        std::pmr::memory_resource* memory = std::pmr::get_default_resource());
 
   std::size_t getPreyNum() const;
   std::size_t getPredatorsNum() const;
   std::size_t getFlockSize() const;
 
-  std::vector<std::shared_ptr<boid::Prey>> getPreyFlock() const;
-  std::vector<std::shared_ptr<boid::Predator>> getPredatorFlock() const;
+  // the boids, brought up to date with the state first: changing one by
+  // hand does not change the flock, setBoids does
+  const std::vector<std::shared_ptr<boid::Prey>>& getPreyFlock() const;
+  const std::vector<std::shared_ptr<boid::Predator>>& getPredatorFlock() const;
+
+  // the state as of the last step, without going through the boids
+  View<point::Point> getPreyPositions() const;
+  View<point::Point> getPreyVelocities() const;
+  View<point::Point> getPredatorPositions() const;
+  View<point::Point> getPredatorVelocities() const;
+
+  // the indices of either species as of the last step
+  const grid::Index& getPreyIndex() const;
+  const grid::Index& getPredatorIndex() const;
 
   FlightParameters getFlightParameters() const;
 
   SpeedLimits getSpeedLimits() const;
 
-  static std::array<double, 3> getDistanceParameters();
+  StepLimits getStepLimits() const;
+
+  void setStepLimits(const StepLimits& step_limits);
+
+  double getCoastTolerance() const;
+
+  void setCoastTolerance(double tolerance);
+
+  std::size_t getCoasting() const;
+
+  // seconds each thread of the default pool spent on the last updateFlock
+  const std::vector<double>& getBusyTime() const;
+
+  // bytes of scratch the last updateFlock used, and the allocations it made
+  // beyond the frame arena: none once the arena has grown to fit a step
+  std::size_t getFrameBytes() const;
+  std::size_t getFrameAllocations() const;
+
+  std::array<double, 3> getDistanceParameters() const;
+
+  void setDistanceParameters(double d, double prey_ds, double predator_ds);
 
   void setFlockSize();
 
+  void setFlockSize(std::size_t n_prey, std::size_t n_predators);
+
   void setFlightParameters();
 
+  void setFlightParameters(const FlightParameters& flight_parameters);
+
+  void setSpeedLimits(const SpeedLimits& speed_limits);
+
+  // `field` must be built, and is shared rather than copied; nullptr takes
+  // the obstacles away. A boid closer than `margin` to an obstacle steers
+  // out along the gradient of the field, by `avoidance` times how far
+  // within the margin it is. generateBoids places no boid inside one
+  void setObstacles(std::shared_ptr<const obstacles::Field> field,
+                    double avoidance = 0.2, double margin = 30.);
+
+  const std::shared_ptr<const obstacles::Field>& getObstacles() const;
+
+  // avoidance and margin
+  std::array<double, 2> getObstacleParameters() const;
+
+  void setSeed(std::uint32_t seed);
+
+  // the pool the steps and statistics run on, the default one if null; it
+  // must outlive the flock, or the next call
+  void setPool(parallel::ThreadPool* pool);
+
+  // the pool set, or the default one
+  parallel::ThreadPool& pool() const;
+
+  // renumbers the prey in the order a step visits them, cell by cell, then
+  // moves the state, the per-boid costs and slacks and the prey grid to
+  // memory first written by the threads of the pool in the tasks of a step:
+  // with a pinned pool, each thread finds its boids on its own NUMA node.
+  // The boid objects follow their state to the new indices. It lasts while
+  // the numbers of boids and cells stay the same, fading as boids change
+  // cell; the predators, a few arrays, get no grid
+  void place();
+
   void generateBoids();
 
+  // replaces the position and velocity of every boid, and the number of
+  // boids of either species if the arrays are longer or shorter
+  void setBoids(const std::vector<std::array<point::Point, 2>>& prey,
+                const std::vector<std::array<point::Point, 2>>& predators);
+
   std::vector<std::shared_ptr<boid::Boid>> nearPrey(std::size_t i,
                                                     bool is_prey) const;
 
@@ -81,9 +306,25 @@ class Flock {
   std::array<point::Point, 2> updateBoid(std::size_t i, bool is_prey,
                                          double dt) const;
 
-  void updateFlock(double dt) const;
+  // steps every boid by dt, writing the next state while reading the
+  // current one, then swapping them
+  void updateFlock(double dt);
+
+  double maxStep() const;
+
+  // the substeps advance takes for frame_dt plus the time put off so far:
+  // none while that is shorter than min_dt, else as few equal ones as fit
+  // maxStep(). Unless none, the time counts as simulated from then on,
+  // whoever runs the substeps (advance does, a tiles::World may)
+  StepReport plan(double frame_dt);
+
+  StepReport advance(double frame_dt);
 
   statistics::Statistics statistics() const;
+
+  statistics::Structure structure(double cutoff, std::size_t n_bins) const;
+
+  std::vector<std::size_t> clusters() const;
 };
 
 }  // namespace flock
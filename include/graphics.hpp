@@ -2,9 +2,14 @@
 #define GRAPHICS_HPP
 
 #include <SFML/Graphics.hpp>
+#include <cstddef>
 #include <memory>
+#include <vector>
 
 #include "../include/flock.hpp"
+#include "../include/grid.hpp"
+#include "../include/obstacles.hpp"
+#include "../include/point.hpp"
 
 namespace graphics {
 
@@ -20,9 +25,53 @@ struct Style {
   sf::Color predator_fill = sf::Color(255, 100, 100);
   sf::Color predator_outline = sf::Color(160, 40, 40);
   sf::Color background = sf::Color(255, 255, 204);
+  sf::Color obstacle = sf::Color(70, 70, 70, 200);
+
+  // level of detail: with more prey than lod_density per pixel on screen,
+  // the prey are drawn as a heatmap of heatmap_texel pixels per texel,
+  // opaque from heatmap_saturation prey per texel, tinted by their heading
+  double lod_density = 0.01;
+  unsigned heatmap_texel = 4;
+  float heatmap_saturation = 6.f;
+};
+
+// prey per texel of the world and the colours drawn for them, RGBA, both
+// row by row; kept from frame to frame so that its memory is reused
+struct Heatmap {
+  unsigned width = 0;
+  unsigned height = 0;
+  std::vector<float> density;
+  std::vector<sf::Uint8> pixels;
+};
+
+// a boid on screen: which one, and where it is drawn, the world repeating
+// on every side
+struct Visible {
+  std::size_t i;
+  point::Point position;
+};
+
+// what drawFrame reuses from frame to frame, kept by its caller: the boids
+// on screen, the candidates the index gave for them and the heatmap
+struct Scratch {
+  std::vector<Visible> visible;
+  std::vector<std::size_t> candidates;
+  Heatmap heatmap;
 };
 
+// zoomed in at most this much, out no further than the whole world
+inline constexpr float max_zoom = 16.f;
+
 bool loadBackground(const std::string& filename);
+
+// an obstacle mask from an image, solid where a pixel is opaque and darker
+// than `threshold` (0 to 255, on its luminance); false if it cannot be read
+bool loadMask(const std::string& filename, obstacles::Mask& mask,
+              unsigned threshold = 128);
+
+// the cells of `field` inside an obstacle, a quad each
+sf::VertexArray makeObstacleMesh(const obstacles::Field& field,
+                                 sf::Color color);
 void clearBackground();
 
 std::unique_ptr<sf::RenderWindow> makeWindow(unsigned int width,
@@ -37,8 +86,39 @@ sf::ConvexShape makeBoidTriangle(float size, float stroke, sf::Color fill,
 void drawBoid(sf::RenderWindow& window, double x, double y, double vx,
               double vy, const Style& style, bool is_prey);
 
+// the rectangle of the plane shown by the view of target, in the
+// coordinates of the world; it may stick out of the world on any side
+sf::FloatRect visibleRect(const sf::RenderTarget& target);
+
+// moves the view by dx and dy times its size, its centre wrapping around
+// the world
+void pan(sf::View& view, float dx, float dy);
+
+// zooms the view in by factor (out below 1), within max_zoom and the world
+void zoom(sf::View& view, float factor);
+
+// the boids of `index`, at `positions`, in `rect`: the rectangle is cut
+// along the edges of the world, every piece queried from the index, and
+// every boid in it given at the position of the copy of the world it is in;
+// `candidates` holds the answers of the index in between
+void cull(const grid::Index& index, flock::View<point::Point> positions,
+          const sf::FloatRect& rect, std::vector<Visible>& out,
+          std::vector<std::size_t>& candidates);
+
+// prey per pixel of `target` for n prey spread over the whole world
+double screenDensity(const sf::RenderTarget& target, std::size_t n);
+
+// fills `heatmap` from the prey of `flock`, in parallel over bands of texel
+// rows on the flock's pool, each band reading the prey from the cells of
+// the prey grid over it
+void splatHeatmap(const flock::Flock& flock, const Style& style,
+                  Heatmap& heatmap);
+
+// what the view of `window` shows of the world: the prey as boids, or as a
+// heatmap when they are denser on screen than style.lod_density, and the
+// predators as boids, only those on screen
 void drawFrame(sf::RenderWindow& window, const flock::Flock& flock,
-               const Style& style);
+               const Style& style, Scratch& scratch);
 
 }  // namespace graphics
 
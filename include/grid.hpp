@@ -0,0 +1,123 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include "parallel.hpp"
+#include "point.hpp"
+
+namespace grid {
+
+// the lists of boid indices are filled in place, either a std::vector or a
+// std::pmr::vector of std::size_t (the only two instantiated), so that a
+// caller can keep them in scratch memory of its own. Positions likewise come
+// in a std::vector or a parallel::FirstTouchVector, as a flock keeps them
+
+// uniform bucket grid over the toroidal world: boids are counting-sorted into
+// cells no smaller than the search radius, so every neighbour of a point lies
+// in the 3x3 block of cells around it
+class Grid {
+ private:
+  double width_;
+  double height_;
+
+  std::size_t cols_{1};
+  std::size_t rows_{1};
+  double cell_width_;
+  double cell_height_;
+
+  // offsets into indices_ per cell, boid indices grouped by cell, and the
+  // next free slot per cell in build
+  parallel::FirstTouchVector<std::size_t> cell_start_;
+  parallel::FirstTouchVector<std::size_t> indices_;
+  parallel::FirstTouchVector<std::size_t> fill_;
+
+  std::size_t cellOf(const point::Point& p) const;
+  std::size_t column(double x) const;
+  std::size_t row(double y) const;
+
+ public:
+  Grid(double width, double height);
+
+  double getWidth() const;
+  double getHeight() const;
+  std::size_t getCols() const;
+  std::size_t getRows() const;
+  double getCellWidth() const;
+  double getCellHeight() const;
+  std::size_t getCellCount() const;
+
+  void tune(double radius, std::size_t n);
+
+  template <class Positions>
+  void build(const Positions& positions);
+
+  // moves the arrays to new memory first written in a costed run of `pool`
+  // over `costs`, task t writing cells first[t] to first[t + 1], the last
+  // entry being the cell count: the threads that later run the same tasks
+  // find their cells on their own node. tune() and build() leave the arrays
+  // where they are as long as the numbers of cells and boids stay the same
+  void place(parallel::ThreadPool& pool, const std::vector<double>& costs,
+             const std::vector<std::size_t>& first);
+
+  template <class Indices>
+  void cell(std::size_t c, Indices& out) const;
+
+  template <class Indices>
+  void query(const point::Point& p, Indices& out, std::size_t rings = 1) const;
+
+  template <class Indices>
+  void region(const point::Point& lo, const point::Point& hi,
+              Indices& out) const;
+};
+
+// spatial index over a single population: a Grid sized for its density or,
+// for a handful of boids, a small array sorted along x where a binary search
+// over the radius window is cheaper than bucketing; the choice is made at
+// every tune, so it follows the population size
+class Index {
+ private:
+  Grid grid_;
+  bool small_{true};
+  double radius_{0.};
+  std::vector<std::pair<double, std::size_t>> sorted_;  // x and boid index
+
+  template <class Indices>
+  void window(double lo, double hi, Indices& out) const;
+
+ public:
+  static constexpr std::size_t small_size = 32;
+
+  Index(double width, double height);
+
+  bool isSmall() const;
+  const Grid& getGrid() const;
+
+  void tune(double radius, std::size_t n);
+
+  template <class Positions>
+  void build(const Positions& positions);
+
+  // Grid::place, when the index is a grid; the small array is left alone
+  void place(parallel::ThreadPool& pool, const std::vector<double>& costs,
+             const std::vector<std::size_t>& first);
+
+  template <class Indices>
+  void query(const point::Point& p, Indices& out) const;
+
+  template <class Indices>
+  void queryAround(const point::Point& p, double reach, Indices& out) const;
+
+  // candidates for the boids in the rectangle from lo to hi, which lies
+  // within the world: all of them, and some of those around it
+  template <class Indices>
+  void region(const point::Point& lo, const point::Point& hi,
+              Indices& out) const;
+};
+
+}  // namespace grid
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef OBSTACLES_HPP
+#define OBSTACLES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "point.hpp"
+
+namespace obstacles {
+
+struct Circle {
+  point::Point centre;
+  double radius;
+};
+
+// a simple polygon, in either winding, smaller than half the world along
+// each axis so that it has a single nearest image on the torus
+struct Polygon {
+  std::vector<point::Point> vertices;
+};
+
+// a bitmap stretched over the whole world, row by row, solid where nonzero
+struct Mask {
+  std::size_t width;
+  std::size_t height;
+  std::vector<std::uint8_t> solid;
+};
+
+// signed distance to the nearest obstacle, negative inside one, and its
+// gradient, sampled once by build() at the centres of a grid of cells over
+// the toroidal world. Afterwards a lookup is a bilinear interpolation
+// between the four samples around a point, whatever the number of obstacles
+class Field {
+ private:
+  double width_;
+  double height_;
+  std::size_t cols_;
+  std::size_t rows_;
+  double cell_width_;
+  double cell_height_;
+
+  std::vector<Circle> circles_;
+  std::vector<Polygon> polygons_;
+  std::vector<Mask> masks_;
+
+  std::vector<double> distance_;        // per sample, row by row
+  std::vector<point::Point> gradient_;  // unit, pointing out of obstacles
+  bool built_{false};
+
+  point::Point centre(std::size_t c, std::size_t r) const;
+  void distanceToMasks();
+  template <class Sample>
+  auto interpolate(const point::Point& p, const std::vector<Sample>& samples)
+      const;
+
+ public:
+  // cells of about `cell` per side, tiling the world exactly
+  Field(double width, double height, double cell = 4.);
+
+  double getWidth() const;
+  double getHeight() const;
+  std::size_t getCols() const;
+  std::size_t getRows() const;
+  double getCellWidth() const;
+  double getCellHeight() const;
+
+  // the obstacles take effect at the next build()
+  void add(const Circle& circle);
+  void add(const Polygon& polygon);
+  void add(const Mask& mask);
+
+  // whether there is no obstacle at all
+  bool empty() const;
+
+  void build();
+
+  // the sample at the centre of cell (c, r)
+  double sample(std::size_t c, std::size_t r) const;
+
+  double distance(const point::Point& p) const;
+  point::Point gradient(const point::Point& p) const;
+  bool inside(const point::Point& p) const;
+
+  // puts a point found inside an obstacle back on its border, wrapped into
+  // the world, and takes from `velocity` the part going into the obstacle;
+  // returns whether it had to
+  bool keepOut(point::Point& position, point::Point& velocity) const;
+};
+
+}  // namespace obstacles
+
+#endif
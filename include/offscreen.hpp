@@ -0,0 +1,120 @@
+#ifndef OFFSCREEN_HPP
+#define OFFSCREEN_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flock.hpp"
+#include "graphics.hpp"
+#include "obstacles.hpp"
+
+// frames drawn without a window, on the CPU alone, and written out as a
+// numbered sequence of images by background threads
+namespace offscreen {
+
+// raw: the RGBA bytes alone; ppm: binary (P6) RGB; png: through sf::Image
+enum class Format { raw, ppm, png };
+
+// "raw", "ppm" or "png"; throws std::invalid_argument otherwise
+Format parseFormat(const std::string& name);
+
+// prefix, the frame number on six digits, and the extension of format
+std::string framePath(const std::string& prefix, std::uint64_t frame,
+                      Format format);
+
+// RGBA pixels, row by row; kept from frame to frame so that its memory is
+// reused
+struct Image {
+  unsigned width = 0;
+  unsigned height = 0;
+  std::vector<std::uint8_t> pixels;
+};
+
+// what graphics::drawFrame draws, without its background picture, into an
+// image of any size stretched over the whole world: the obstacles, the prey
+// as triangles or as a heatmap past style.lod_density prey per pixel, the
+// predators as triangles, wrapped around the edges of the world. Triangles
+// are filled at the centres of the pixels they cover, in parallel over bands
+// of rows on the default pool
+class Rasterizer {
+ private:
+  graphics::Heatmap heatmap_;
+
+  // the pixels covered by the obstacles, for the last field and size drawn
+  std::shared_ptr<const obstacles::Field> field_;
+  unsigned mask_width_{0};
+  unsigned mask_height_{0};
+  std::vector<std::uint8_t> mask_;
+
+  void cover(const obstacles::Field& field, unsigned width, unsigned height);
+
+ public:
+  // draws a frame of image.width by image.height pixels, both positive
+  void draw(const flock::Flock& flock, const graphics::Style& style,
+            Image& image);
+};
+
+// writes the images it is given to framePath(prefix, n, format), n counting
+// from 0, with a pool of encoding threads. The queue is bounded: when the
+// encoders cannot keep up, submit() waits for them, and counts the wait as
+// a stall, rather than dropping a frame of the sequence. The images come
+// back once written, to be handed out again by acquire()
+class Encoder {
+ private:
+  struct Job {
+    Image image;
+    std::uint64_t frame;
+  };
+
+  std::string prefix_;
+  Format format_;
+  std::size_t max_queued_;
+
+  std::deque<Job> queue_;
+  std::vector<Image> free_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;  // for the encoders: a job, or stop
+  std::condition_variable done_;  // for the caller: room, or a job done
+  bool stop_{false};
+  std::size_t busy_{0};
+  std::uint64_t next_{0};
+  std::uint64_t written_{0};
+  std::uint64_t failed_{0};
+  std::size_t stalls_{0};
+  std::vector<std::thread> encoders_;
+
+  void encode();
+  bool write(const Job& job, std::vector<std::uint8_t>& scratch) const;
+
+ public:
+  Encoder(std::string prefix, Format format, std::size_t n_threads = 2,
+          std::size_t max_queued = 8);
+  Encoder(const Encoder&) = delete;
+  Encoder& operator=(const Encoder&) = delete;
+  ~Encoder();  // writes what is still queued first
+
+  // an image to draw the next frame into: a written one when there is one
+  Image acquire();
+
+  // queues the next frame, waiting while the queue is full
+  void submit(Image&& image);
+
+  // waits until every frame submitted so far is written
+  void flush();
+
+  std::uint64_t getWritten();
+  std::uint64_t getFailed();  // frames whose file could not be written
+  std::size_t getStalls();
+};
+
+}  // namespace offscreen
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace parallel {
+
+// allocator that leaves the new elements of a vector default-initialised, so
+// that resizing does not write them: the pages are first touched, and on a
+// NUMA host placed, by the thread that first stores into them. Trivially
+// copyable types are not constructed at all, since a constructor that zeroes
+// them (point::Point's) would touch the pages itself; they must be assigned
+// before they are read
+template <class T>
+struct FirstTouchAllocator : std::allocator<T> {
+  template <class U>
+  struct rebind {
+    using other = FirstTouchAllocator<U>;
+  };
+
+  FirstTouchAllocator() = default;
+  template <class U>
+  FirstTouchAllocator(const FirstTouchAllocator<U>&) noexcept {}
+
+  template <class U>
+  void construct(U* p) noexcept(
+      std::is_nothrow_default_constructible<U>::value) {
+    if constexpr (!std::is_trivially_copyable<U>::value) {
+      ::new (static_cast<void*>(p)) U;
+    }
+  }
+  template <class U, class... Args>
+  void construct(U* p, Args&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+  }
+};
+
+template <class T>
+using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
+
+// what a run with cost estimates did: the seconds each thread spent in tasks,
+// the caller's first (the caller's alone if the run was serial), and the
+// number of tasks a thread took from another's range
+struct RunReport {
+  std::vector<double> busy;
+  std::size_t steals{0};
+};
+
+// persistent pool of worker threads; run() hands out the task indices
+// 0..n_tasks-1 dynamically and returns when all of them are done. The calling
+// thread takes part in the work, so a pool of size 1 spawns no thread at all.
+// Tasks should write their results in slots indexed by the task: reducing
+// the slots in order keeps results independent of the scheduling. A run()
+// issued from inside a task, or while another thread is using the pool, is
+// executed serially by the caller instead of waiting for the workers.
+//
+// When the tasks come with cost estimates, they are dealt to the threads in
+// contiguous ranges of about equal cost instead; each thread works through
+// its own range from the front and, once done, steals from the back of the
+// others' ranges, so that bad estimates cost little. The same costs give
+// the same ranges, so a thread keeps meeting the same tasks run after run.
+//
+// A pool can pin each worker to its own core (Linux only): together with
+// data first written inside the tasks that later use it, this keeps a
+// thread's memory on its own node of a NUMA host
+class ThreadPool {
+ private:
+  // tasks [begin, end) still to run from a thread's share of a costed run
+  struct Range {
+    std::mutex mutex;
+    std::size_t begin{0};
+    std::size_t end{0};
+  };
+
+  std::vector<std::thread> workers_;
+
+  std::mutex run_mutex_;  // held by the thread currently driving a run
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+
+  const std::function<void(std::size_t)>* task_{nullptr};
+  std::size_t n_tasks_{0};
+  std::atomic<std::size_t> next_{0};
+  std::size_t joined_{0};  // workers that have seen the current generation
+  std::size_t busy_{0};
+  std::size_t generation_{0};
+  bool stop_{false};
+  std::atomic<std::size_t> pinned_{0};
+
+  bool costed_{false};
+  std::vector<Range> ranges_;     // one per thread, the caller's first
+  std::vector<double> busy_time_;  // seconds in tasks, per thread
+  std::atomic<std::size_t> steals_{0};
+
+  void work(std::size_t slot);
+  void drain(std::size_t slot);
+  bool take(Range& range, bool from_back, std::size_t& t);
+  static double serial(std::size_t n_tasks,
+                       const std::function<void(std::size_t)>& task);
+  void dispatch(const std::function<void(std::size_t)>& task);
+
+ public:
+  explicit ThreadPool(std::size_t n_threads, bool pin = false);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  std::size_t size() const;
+
+  // workers pinned so far; the caller is never pinned
+  std::size_t getPinned() const;
+
+  void run(std::size_t n_tasks, const std::function<void(std::size_t)>& task);
+
+  // runs task t for every t < costs.size(), costs[t] being its estimated cost
+  RunReport run(const std::vector<double>& costs,
+                const std::function<void(std::size_t)>& task);
+
+  // the same, writing the report into `report`, whose storage is reused
+  void run(const std::vector<double>& costs,
+           const std::function<void(std::size_t)>& task, RunReport& report);
+};
+
+// process-wide pool, created on first use with one thread per hardware
+// thread and no pinning unless configureDefaultPool asked otherwise
+ThreadPool& defaultPool();
+
+// size (0: one per hardware thread) and pinning of the default pool; returns
+// false, changing nothing, once the pool has been created
+bool configureDefaultPool(std::size_t n_threads, bool pin);
+
+}  // namespace parallel
+
+#endif
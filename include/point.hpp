@@ -30,6 +30,14 @@ bool operator==(Point const&, Point const&);
 Point relativePosition(const Point&, const Point&);
 double toroidalDistance(Point const&, Point const&);
 
+// branchless form of the wrap in relativePosition, for one coordinate: same
+// result, but loops using it can be vectorized
+inline double wrap(const double delta, const double size) {
+  const double half = size / 2.;
+  return delta - size * static_cast<double>(delta > half) +
+         size * static_cast<double>(delta < -half);
+}
+
 }  // namespace point
 
 #endif
\ No newline at end of file
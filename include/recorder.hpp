@@ -0,0 +1,90 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace recorder {
+
+// appends rows of doubles (one per frame) to a columnar binary file:
+//
+//   "BOIDCOL1", uint32 number of columns, then per column uint32 name length
+//   and name; then chunks, each a uint32 number of rows followed by the
+//   values column after column (native byte order)
+//
+// Rows are gathered in chunks which a background thread writes out; the
+// queue of full chunks is bounded, and when the disk cannot keep up the
+// caller waits for it, each wait counted as a stall. Only a Recorder made
+// with Overflow::drop drops whole chunks instead, counting them, so that
+// it never blocks; flush() and the destructor never drop.
+//
+// The file is checked after every chunk: once a write fails (a full disk,
+// say) the recorder has failed for good, and the rows of that chunk and of
+// every later one are neither written nor counted as written
+enum class Overflow { block, drop };
+
+class Recorder {
+ private:
+  struct Chunk {
+    std::vector<double> values;  // column-major, chunk_rows_ per column
+    std::size_t rows{0};
+  };
+
+  std::ofstream file_;
+  std::vector<std::string> columns_;
+  std::size_t chunk_rows_;
+  std::size_t max_queued_;
+  Overflow overflow_;
+
+  Chunk current_;
+  std::deque<Chunk> queue_;
+  std::vector<Chunk> free_;  // written chunks, kept to be refilled
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_{false};
+  bool writing_{false};  // a chunk is out of the queue, being written
+  bool failed_{false};
+  std::size_t dropped_{0};
+  std::size_t stalls_{0};
+  std::uint64_t written_{0};
+  std::thread writer_;
+
+  void write();
+  bool writeChunk(const Chunk& chunk);
+  void submit(bool lossless);
+
+ public:
+  Recorder(const std::string& path, std::vector<std::string> columns,
+           std::size_t chunk_rows = 4096, std::size_t max_queued = 64,
+           Overflow overflow = Overflow::block);
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+  ~Recorder();
+
+  bool isOpen() const;
+  const std::vector<std::string>& getColumns() const;
+  std::size_t getDropped();
+  std::size_t getStalls();
+  std::uint64_t getWritten();
+  bool hasFailed();
+
+  void record(const std::vector<double>& row);
+  void flush();
+};
+
+// rewrites a file produced by Recorder as CSV with a header line; returns
+// false if the input cannot be read or is malformed, including a length or a
+// number of rows that goes past the end of the file
+bool toCsv(const std::string& binary_path, const std::string& csv_path);
+
+}  // namespace recorder
+
+#endif
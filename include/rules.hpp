@@ -0,0 +1,271 @@
+#ifndef RULES_HPP
+#define RULES_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <tuple>
+
+#include "boid.hpp"
+#include "obstacles.hpp"
+#include "point.hpp"
+
+// the steering rules as policies, composed at compile time into a Pipeline
+// that feeds every neighbour in sight to all the rules reading its species
+// in a single pass. Everything is in this header, so that the compiler sees
+// a whole pipeline at once and can inline the rules into the pass
+namespace rules {
+
+// the neighbours a rule reads: one species, or none at all for a rule that
+// only depends on the boid itself
+enum class Set { none, prey, predators };
+
+// the boid being steered
+struct Self {
+  point::Point position;
+  point::Point velocity;
+};
+
+// a neighbour in sight, as seen from the boid being steered
+struct Neighbour {
+  point::Point offset;  // relativePosition from the boid to it
+  double distance;      // length of offset
+  point::Point velocity;
+};
+
+// the `skip` of inSight when the boid looks at the other species
+constexpr std::size_t nobody = static_cast<std::size_t>(-1);
+
+// calls take(j, offset, distance) for every candidate j but `skip` closer
+// than d to the boid and within sight_angle of its heading, in the order of
+// the candidates; position(j) reads where j is, from whatever arrays hold
+// it, so that a flock and an ensemble feed their pipelines alike
+template <class Candidates, class Position, class Take>
+void inSight(const Self& self, const Candidates& candidates,
+             const std::size_t skip, Position position, const double d,
+             const double sight_angle, Take take) {
+  for (const std::size_t j : candidates) {
+    if (j == skip) continue;
+
+    const point::Point other = position(j);
+    const point::Point offset = point::relativePosition(self.position, other);
+    const double dist = offset.distance();
+
+    if (dist < d && std::abs(boid::angle(self.position, self.velocity,
+                                         other)) < sight_angle) {
+      take(j, offset, dist);
+    }
+  }
+}
+
+// A rule is a copyable class with
+//   static constexpr Set set;
+//   void add(const Neighbour&);                    for each neighbour of set
+//   point::Point result(const Self&, std::size_t n) const;
+// where n is the number of neighbours it was given; the result is added to
+// the velocity. Rules with their own radius test it in add(), the pipeline
+// only hands out the neighbours closer than d and within the sight angle
+
+// away from the neighbours of S closer than ds, as boid::separation
+template <Set S>
+class Separation {
+ private:
+  double s_;
+  double ds_;
+  point::Point sum_;
+
+ public:
+  static constexpr Set set = S;
+
+  Separation(const double s, const double ds) : s_{s}, ds_{ds} {
+    assert(s >= 0);
+    assert(ds >= 0);
+  }
+
+  void add(const Neighbour& n) {
+    if (n.distance < ds_) sum_ = sum_ + n.offset;
+  }
+
+  point::Point result(const Self&, const std::size_t n) const {
+    return n == 0 ? point::Point(0., 0.) : (-s_) * sum_;
+  }
+};
+
+// towards the mean velocity of the prey in sight, as boid::alignment
+class Alignment {
+ private:
+  double a_;
+  point::Point sum_;
+
+ public:
+  static constexpr Set set = Set::prey;
+
+  explicit Alignment(const double a) : a_{a} { assert(a >= 0); }
+
+  void add(const Neighbour& n) { sum_ = sum_ + n.velocity; }
+
+  point::Point result(const Self& self, const std::size_t n) const {
+    if (n == 0) return point::Point(0., 0.);
+    return a_ * (sum_ / static_cast<double>(n) - self.velocity);
+  }
+};
+
+// towards the centre of the prey in sight, as boid::cohesion
+class Cohesion {
+ private:
+  double c_;
+  point::Point sum_;
+
+ public:
+  static constexpr Set set = Set::prey;
+
+  explicit Cohesion(const double c) : c_{c} { assert(c >= 0); }
+
+  void add(const Neighbour& n) { sum_ = sum_ + n.offset; }
+
+  point::Point result(const Self&, const std::size_t n) const {
+    if (n == 0) return point::Point(0., 0.);
+    return c_ * (sum_ / static_cast<double>(n));
+  }
+};
+
+// away from the predators in sight, as boid::repulsion
+class Repulsion {
+ private:
+  double r_;
+  point::Point sum_;
+
+ public:
+  static constexpr Set set = Set::predators;
+
+  explicit Repulsion(const double r) : r_{r} { assert(r >= 0); }
+
+  void add(const Neighbour& n) { sum_ = sum_ + n.offset; }
+
+  point::Point result(const Self&, const std::size_t n) const {
+    return n == 0 ? point::Point(0., 0.) : (-r_) * sum_;
+  }
+};
+
+// towards the prey in sight, as boid::chase
+class Chase {
+ private:
+  double ch_;
+  point::Point sum_;
+
+ public:
+  static constexpr Set set = Set::prey;
+
+  explicit Chase(const double ch) : ch_{ch} { assert(ch >= 0); }
+
+  void add(const Neighbour& n) { sum_ = sum_ + n.offset; }
+
+  point::Point result(const Self&, const std::size_t n) const {
+    return n == 0 ? point::Point(0., 0.) : ch_ * sum_;
+  }
+};
+
+// towards a fixed point of the world, whatever is in sight
+class Goal {
+ private:
+  point::Point target_;
+  double g_;
+
+ public:
+  static constexpr Set set = Set::none;
+
+  Goal(const point::Point& target, const double g) : target_{target}, g_{g} {
+    assert(g >= 0);
+  }
+
+  void add(const Neighbour&) {}
+
+  point::Point result(const Self& self, std::size_t) const {
+    return g_ * point::relativePosition(self.position, target_);
+  }
+};
+
+// out of the way of the obstacles of a field, as soon as one is closer than
+// `margin` and harder the closer it gets; no field, no obstacles. A single
+// lookup whatever the number of obstacles (see obstacles::Field)
+class Avoid {
+ private:
+  const obstacles::Field* field_;
+  double k_;
+  double margin_;
+
+ public:
+  static constexpr Set set = Set::none;
+
+  Avoid(const obstacles::Field* field, const double k, const double margin)
+      : field_{field}, k_{k}, margin_{margin} {
+    assert(k >= 0);
+    assert(margin >= 0);
+  }
+
+  void add(const Neighbour&) {}
+
+  point::Point result(const Self& self, std::size_t) const {
+    if (field_ == nullptr) return point::Point(0., 0.);
+    const double d = field_->distance(self.position);
+    if (d >= margin_) return point::Point(0., 0.);
+    return (k_ * (margin_ - d)) * field_->gradient(self.position);
+  }
+};
+
+// the rules, in order: a pass over the neighbours feeds them with add(),
+// then steer() sums what they add to the velocity. A pipeline is meant to be
+// copied for every boid, fresh from the one holding the parameters
+template <class... Rules>
+class Pipeline {
+ private:
+  std::tuple<Rules...> rules_;
+  std::size_t n_prey_{0};
+  std::size_t n_predators_{0};
+
+  template <Set S, class Rule>
+  static void feed(Rule& rule, const Neighbour& n) {
+    if constexpr (Rule::set == S) rule.add(n);
+  }
+
+  template <class Rule>
+  std::size_t count() const {
+    if constexpr (Rule::set == Set::prey) return n_prey_;
+    if constexpr (Rule::set == Set::predators) return n_predators_;
+    return 0;
+  }
+
+ public:
+  explicit Pipeline(Rules... rules) : rules_{rules...} {}
+
+  // whether some rule reads the neighbours of `set`: a pass over those
+  // neighbours is needed only then
+  static constexpr bool reads(const Set set) {
+    return ((Rules::set == set) || ... || false);
+  }
+
+  template <Set S>
+  void add(const Neighbour& n) {
+    static_assert(S != Set::none);
+    std::apply([&](Rules&... rules) { (feed<S>(rules, n), ...); }, rules_);
+    ++(S == Set::prey ? n_prey_ : n_predators_);
+  }
+
+  // neighbours handed out so far, of either species
+  std::size_t size() const { return n_prey_ + n_predators_; }
+
+  // the sum of the results of the rules, in their order
+  point::Point steer(const Self& self) const {
+    point::Point sum(0., 0.);
+    std::apply(
+        [&](const Rules&... rules) {
+          ((sum = sum + rules.result(self, count<Rules>())), ...);
+        },
+        rules_);
+    return sum;
+  }
+};
+
+}  // namespace rules
+
+#endif
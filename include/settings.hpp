@@ -0,0 +1,65 @@
+#ifndef SETTINGS_HPP
+#define SETTINGS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ensemble.hpp"
+#include "offscreen.hpp"
+#include "tiles.hpp"
+
+namespace settings {
+
+// how the simulation is started
+struct Settings {
+  ensemble::Config flock;  // sizes, flight parameters, speed limits, radii
+  std::optional<std::uint32_t> seed;  // random if not given
+  double coast_tolerance{0.};         // see Flock::setCoastTolerance
+  std::size_t threads{0};             // 0: one per hardware thread
+  bool pin{false};                    // pinned workers, boids placed
+  tiles::Layout tiles;                // one process per tile unless 1x1
+  std::string record;                 // statistics recording, none if empty
+  std::string background{"assets/world_map31.png"};
+  std::string obstacles;  // image of the obstacles (dark pixels), none if empty
+  std::optional<double> lod_density;  // graphics::Style's if not given
+
+  // frames written to files named from this prefix, without a window,
+  // frame_count of them; a window instead if empty
+  std::string frames;
+  offscreen::Format frame_format{offscreen::Format::ppm};
+  std::size_t frame_count{600};
+
+  // nothing about the flock was given, so it is asked for on stdin
+  bool interactive{true};
+
+  // repulsion and chase follow separation and cohesion until they are set
+  bool derive_repulsion{true};
+  bool derive_chase{true};
+};
+
+// sets `key` (a name of ensemble::parameterNames, or seed, coast_tolerance,
+// threads, pin (0 or 1), tiles (as 2x2), record, background, obstacles,
+// lod_density, frames, frame_format (raw, ppm or png), frame_count) from its
+// text; throws std::invalid_argument if the key is unknown or the value
+// malformed
+void apply(Settings& settings, const std::string& key,
+           const std::string& value);
+
+// applies the `key = value` lines of a settings file, '#' starting a
+// comment; errors are thrown as std::runtime_error naming source and line
+void read(Settings& settings, std::istream& in, const std::string& source);
+
+// the settings of a command line: the files given with --config, in order,
+// then the --key=value (or --key value) overrides, also in order. As in
+// Flock::setFlightParameters, repulsion and chase follow separation and
+// cohesion unless they are set. Everything is validated before returning;
+// errors are thrown as std::runtime_error
+Settings load(const std::vector<std::string>& args);
+
+}  // namespace settings
+
+#endif
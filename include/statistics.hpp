@@ -1,19 +1,151 @@
-
 #ifndef STATISTICS_HPP
 #define STATISTICS_HPP
 
+#include <cstddef>
+#include <vector>
+
+#include "grid.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+
 namespace statistics {
 struct Statistics {
   double mean_distance;
   double dev_distance;
   double mean_velocity;
   double dev_velocity;
+  std::size_t n_clusters;       // connected groups of boids
+  std::size_t largest_cluster;  // and the size of the largest one
 
   Statistics();
 
   Statistics(double mean_dist, double dev_dist, double mean_vel,
              double dev_vel);
 };
+
+// running count, mean and sum of squared deviations (Welford), with no
+// cancellation between large squares; two accumulators merge exactly (Chan et
+// al.), so partial results can be combined across threads and time windows
+class Accumulator {
+ private:
+  std::size_t count_{0};
+  double mean_{0.};
+  double m2_{0.};
+
+ public:
+  std::size_t getCount() const;
+  double getMean() const;
+  double getVariance() const;
+  double getDeviation() const;
+
+  void add(double x);
+  void addBlock(const double* values, std::size_t n);
+  void merge(const Accumulator& other);
+};
+
+// accumulators of every field of Statistics, e.g. over a stretch of frames
+struct Summary {
+  Accumulator mean_distance;
+  Accumulator dev_distance;
+  Accumulator mean_velocity;
+  Accumulator dev_velocity;
+  Accumulator n_clusters;
+  Accumulator largest_cluster;
+
+  void add(const Statistics& stats);
+  void merge(const Summary& other);
+};
+
+// per-frame statistics of the last `capacity` frames, oldest first, plus a
+// summary over the whole run; push() is O(1)
+class Series {
+ private:
+  std::vector<Statistics> frames_;
+  std::size_t head_{0};
+  std::size_t size_{0};
+  Summary total_;
+
+ public:
+  explicit Series(std::size_t capacity);
+
+  std::size_t size() const;
+  std::size_t capacity() const;
+  const Statistics& operator[](std::size_t i) const;
+
+  void push(const Statistics& stats);
+
+  Summary window() const;
+  const Summary& total() const;
+};
+
+// counts of values in [0, max) over uniform bins; larger values are only
+// counted in the overflow
+class Histogram {
+ private:
+  double max_;
+  std::vector<std::size_t> counts_;
+  std::size_t overflow_{0};
+
+ public:
+  Histogram(double max, std::size_t n_bins);
+
+  double getMax() const;
+  double getBinWidth() const;
+  const std::vector<std::size_t>& getCounts() const;
+  std::size_t getOverflow() const;
+  std::size_t getTotal() const;
+
+  void add(double x);
+  void merge(const Histogram& other);
+};
+
+// structural metrics of a set of boids up to a cutoff distance
+struct Structure {
+  Histogram pair_distances;  // pairs i < j closer than the cutoff
+  std::vector<double> rdf;   // pair correlation g(r), one value per bin
+  Histogram nearest;  // nearest-neighbour distance, overflow if >= cutoff
+  double polarization;  // norm of the mean heading, 1 when all aligned
+
+  Structure(double cutoff, std::size_t n_bins);
+};
+
+// computes Structure in one parallel pass over `index`, built over
+// `positions` and tuned for any radius: a cutoff past its cells widens the
+// window of each query. The cutoff must not exceed half the world; chunks of
+// boids are merged in order, so the result does not depend on the number of
+// threads. The arrays are those of a flock or any std::vector (see grid.hpp)
+template <class Points>
+Structure structure(const Points& positions, const Points& velocities,
+                    const grid::Index& index, double cutoff,
+                    std::size_t n_bins, parallel::ThreadPool& pool);
+
+// the same through an index of its own, with cells as large as the cutoff
+Structure structure(const std::vector<point::Point>& positions,
+                    const std::vector<point::Point>& velocities, double width,
+                    double height, double cutoff, std::size_t n_bins,
+                    parallel::ThreadPool& pool);
+
+// sizes of the connected components, largest first, of the graph linking
+// boids closer than `radius`: lock-free union-find over the pairs found
+// through `index`, built over `positions` and tuned for any radius, run in
+// parallel over chunks of boids
+template <class Points>
+std::vector<std::size_t> clusters(const Points& positions,
+                                  const grid::Index& index, double radius,
+                                  parallel::ThreadPool& pool);
+
+// the same through an index of its own, for boids that have none
+std::vector<std::size_t> clusters(const std::vector<point::Point>& positions,
+                                  double width, double height, double radius,
+                                  parallel::ThreadPool& pool);
+
+// toroidal distances over all the pairs i < j of the points (x[i], y[i]).
+// The pair matrix is split in square tiles that fit in cache, run on the pool
+// and merged in tile order, so the result does not depend on the number of
+// threads
+Accumulator pairDistances(const std::vector<double>& x,
+                          const std::vector<double>& y, double width,
+                          double height, parallel::ThreadPool& pool);
 }  // namespace statistics
 
 #endif
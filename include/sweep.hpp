@@ -0,0 +1,73 @@
+#ifndef SWEEP_HPP
+#define SWEEP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ensemble.hpp"
+#include "parallel.hpp"
+
+namespace sweep {
+
+// a parameter varied over [lo, hi]: at `levels` evenly spaced values in a
+// grid design, in as many strata as samples in a Latin hypercube
+struct Axis {
+  std::string name;
+  double lo;
+  double hi;
+  std::size_t levels;
+};
+
+enum class Design { grid, latin_hypercube };
+
+// what to run: every configuration is `base` with the axes applied, simulated
+// for `steps` steps of `dt`; the statistics are sampled every `sample_every`
+// steps once the first `warmup` steps are over
+struct Spec {
+  ensemble::Config base;
+  std::vector<Axis> axes;
+  Design design{Design::grid};
+  std::size_t samples{0};  // Latin hypercube only
+  std::uint32_t seed{1};
+  std::size_t steps{500};
+  std::size_t warmup{100};
+  std::size_t sample_every{10};
+  double dt{1.};
+
+  // repulsion and chase follow separation and cohesion (6 s and 2 c, as in
+  // Flock::setFlightParameters) unless the spec sets them
+  bool derive_repulsion{true};
+  bool derive_chase{true};
+};
+
+// reads a spec made of `key = value` lines, '#' starting a comment. A
+// parameter (see ensemble::parameterNames) given a single value changes the
+// base configuration, one given as lo:hi:levels (lo:hi in a Latin hypercube)
+// becomes an axis; the other keys are design (grid or lhs), samples, seed,
+// steps, warmup, sample_every and dt. Throws std::runtime_error naming the
+// offending line
+Spec parseSpec(std::istream& in);
+
+// every configuration of the spec, in a fixed order; throws
+// std::runtime_error if one of them is not a valid flock, or if there are
+// more of them than seeds from spec.seed up (configuration c is seeded with
+// spec.seed + c)
+std::vector<ensemble::Config> configurations(const Spec& spec);
+
+// runs the configurations not yet in the CSV file at `results_path`, one
+// ensemble of `batch` members at a time on `pool`, appending a row of summary
+// statistics for each as soon as its batch is done: a sweep that is stopped
+// picks up where it left off, dropping a row it left half written. The file
+// starts with a "# sweep <fingerprint>" line identifying the spec, then the
+// CSV header; throws std::runtime_error if it was written by another spec.
+// Returns the number of configurations run
+std::size_t run(const Spec& spec, const std::string& results_path,
+                parallel::ThreadPool& pool, std::size_t batch,
+                std::ostream& progress);
+
+}  // namespace sweep
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TILES_HPP
+#define TILES_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "flock.hpp"
+
+namespace tiles {
+
+// the world cut in columns x rows equal tiles
+struct Layout {
+  std::size_t columns{1};
+  std::size_t rows{1};
+};
+
+// a layout written as "<columns>x<rows>", e.g. "2x2"; throws
+// std::invalid_argument if the text is no such layout
+Layout parseLayout(const std::string& text);
+
+// a flock::Flock stepped by one process per tile, all on this machine (POSIX
+// only). A process owns the prey in its tile; after each step it sends every
+// other tile the prey that moved into it, together with those now closer
+// than d to it, which that tile needs to step its own (the halo). The
+// predators, few and fast, are kept in every process, each stepping the ones
+// in its tile. Neighbour lists keep the order of the flock, so the result is
+// that of Flock::updateFlock, bit for bit (with coasting off, as by default)
+class World {
+ private:
+  Layout layout_;
+  std::size_t n_prey_;
+  std::size_t n_predators_;
+  std::vector<int> processes_;  // process ids, per tile
+  std::vector<int> links_;      // sockets to the tile processes
+
+ public:
+  // forks the tile processes, each starting from the current state of flock
+  World(const flock::Flock& flock, Layout layout);
+  World(const World&) = delete;
+  World& operator=(const World&) = delete;
+  ~World();
+
+  std::size_t size() const;
+
+  // n_steps steps of dt, as many calls to Flock::updateFlock; returns the
+  // seconds each tile process spent in them (see Flock::getBusyTime), and
+  // throws std::runtime_error if a tile process is gone
+  std::vector<double> step(double dt, std::size_t n_steps = 1);
+
+  // copies the current state into `flock`, the one the world was made from
+  void gather(flock::Flock& flock) const;
+};
+
+}  // namespace tiles
+
+#endif
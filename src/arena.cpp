@@ -0,0 +1,133 @@
+#include "../include/arena.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+namespace arena {
+
+// ---------- FrameArena ----------
+
+FrameArena::FrameArena(std::pmr::memory_resource* upstream)
+    : upstream_{upstream} {
+  assert(upstream != nullptr);
+}
+
+FrameArena::FrameArena(const FrameArena& other)
+    : std::pmr::memory_resource(), upstream_{other.upstream_} {}
+
+FrameArena& FrameArena::operator=(const FrameArena& other) {
+  if (this != &other) {
+    release();
+    upstream_ = other.upstream_;
+  }
+  return *this;
+}
+
+FrameArena::~FrameArena() { release(); }
+
+// returns the buffer and the overflow blocks upstream
+void FrameArena::release() {
+  for (const Block& block : overflow_) {
+    upstream_->deallocate(block.p, block.bytes, block.alignment);
+  }
+  overflow_.clear();
+  if (buffer_ != nullptr) {
+    upstream_->deallocate(buffer_, capacity_, alignof(std::max_align_t));
+  }
+  buffer_ = nullptr;
+  capacity_ = 0;
+  used_ = 0;
+  overflow_bytes_ = 0;
+}
+
+void* FrameArena::do_allocate(std::size_t bytes, const std::size_t alignment) {
+  bytes = std::max<std::size_t>(bytes, 1);
+  const auto base = reinterpret_cast<std::uintptr_t>(buffer_);
+  std::size_t offset = used_.load(std::memory_order_relaxed);
+  while (true) {
+    const std::size_t start =
+        ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+    if (start + bytes > capacity_) break;
+    if (used_.compare_exchange_weak(offset, start + bytes,
+                                    std::memory_order_relaxed)) {
+      return buffer_ + start;
+    }
+  }
+
+  // past the end of the buffer: from upstream until the next reset
+  std::lock_guard<std::mutex> lock(overflow_mutex_);
+  if (overflow_.size() == overflow_.capacity()) {
+    overflow_.reserve(2 * overflow_.size() + 8);
+  }
+  void* p = upstream_->allocate(bytes, alignment);
+  overflow_.push_back({p, bytes, alignment});
+  overflow_bytes_ += bytes + alignment;
+  ++upstream_allocations_;
+  return p;
+}
+
+void FrameArena::do_deallocate(void*, std::size_t, std::size_t) {}
+
+bool FrameArena::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+// a step that overflowed is followed by a buffer half as large again as
+// the whole of it, so that a slowly growing step does not regrow it each time
+void FrameArena::reset() {
+  const std::size_t needed = used_ + overflow_bytes_;
+  upstream_allocations_ = 0;
+  if (needed <= capacity_) {
+    used_ = 0;
+    return;
+  }
+
+  release();
+  const std::size_t capacity = needed + needed / 2;
+  buffer_ = static_cast<std::byte*>(
+      upstream_->allocate(capacity, alignof(std::max_align_t)));
+  capacity_ = capacity;
+  upstream_allocations_ = 1;
+}
+
+std::size_t FrameArena::getUsed() const { return used_ + overflow_bytes_; }
+
+std::size_t FrameArena::getUpstreamAllocations() const {
+  return upstream_allocations_;
+}
+
+std::size_t FrameArena::getCapacity() const { return capacity_; }
+
+// ---------- CountingResource ----------
+
+CountingResource::CountingResource(std::pmr::memory_resource* upstream)
+    : upstream_{upstream} {
+  assert(upstream != nullptr);
+}
+
+void* CountingResource::do_allocate(const std::size_t bytes,
+                                    const std::size_t alignment) {
+  void* p = upstream_->allocate(bytes, alignment);
+  ++allocations_;
+  bytes_ += bytes;
+  return p;
+}
+
+void CountingResource::do_deallocate(void* p, const std::size_t bytes,
+                                     const std::size_t alignment) {
+  upstream_->deallocate(p, bytes, alignment);
+  bytes_ -= bytes;
+}
+
+bool CountingResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+std::size_t CountingResource::getAllocations() const { return allocations_; }
+
+std::size_t CountingResource::getBytes() const { return bytes_; }
+
+}  // namespace arena
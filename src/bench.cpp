@@ -0,0 +1,166 @@
+// measures what thread pinning and first-touch placement are worth: memory
+// bandwidth of a parallel triad, and steps per second of an ensemble and of
+// a flock, each with and without them. On a single memory node the two
+// columns should agree; on a NUMA host the placed ones should not fall behind.
+// Then the steps per second of the flock cut in ever more tiles, one process
+// each
+//
+//   Boids.bench [threads [members [prey [steps]]]]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/ensemble.hpp"
+#include "../include/flock.hpp"
+#include "../include/parallel.hpp"
+#include "../include/tiles.hpp"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+double since(const clock_type::time_point start) {
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+std::size_t argument(const int argc, char* argv[], const int i,
+                     const std::size_t fallback) {
+  if (i >= argc) return fallback;
+  const long value = std::strtol(argv[i], nullptr, 10);
+  return value > 0 ? static_cast<std::size_t>(value) : fallback;
+}
+
+// GB/s of a = b + s c over arrays of n doubles, in one block per thread. With
+// `place` the blocks are first written by the threads that run them,
+// otherwise by the calling thread
+template <class Vector>
+double triad(parallel::ThreadPool& pool, const std::size_t n,
+             const bool place) {
+  const std::vector<double> costs(pool.size(), 1.);
+  const std::size_t block = (n + pool.size() - 1) / pool.size();
+  auto blocks = [&](const auto& body) {
+    pool.run(costs, [&](const std::size_t t) {
+      const std::size_t begin = std::min(n, t * block);
+      const std::size_t end = std::min(n, begin + block);
+      for (std::size_t i = begin; i < end; ++i) body(i);
+    });
+  };
+
+  Vector a(n);
+  Vector b(n);
+  Vector c(n);
+  auto fill = [&](const std::size_t i) {
+    a[i] = 0.;
+    b[i] = 1.;
+    c[i] = 2.;
+  };
+  if (place) {
+    blocks(fill);
+  } else {
+    for (std::size_t i = 0; i < n; ++i) fill(i);
+  }
+
+  constexpr int repeats = 10;
+  const auto start = clock_type::now();
+  for (int r = 0; r < repeats; ++r) {
+    blocks([&](const std::size_t i) { a[i] = b[i] + 3. * c[i]; });
+  }
+  const double seconds = since(start);
+  return 3. * sizeof(double) * static_cast<double>(n) * repeats / seconds /
+         1e9;
+}
+
+double ensembleSteps(parallel::ThreadPool& pool, const std::size_t members,
+                     const std::size_t prey, const std::size_t steps,
+                     const bool place) {
+  ensemble::Config config;
+  config.n_prey = prey;
+  ensemble::Ensemble flocks;
+  for (std::size_t m = 0; m < members; ++m) {
+    flocks.add(config, static_cast<std::uint32_t>(m + 1));
+  }
+  if (place) flocks.place(pool);
+
+  flocks.step(1., pool);  // grid indices and caches warm up
+  const auto start = clock_type::now();
+  for (std::size_t s = 0; s < steps; ++s) flocks.step(1., pool);
+  return static_cast<double>(steps) / since(start);
+}
+
+double flockSteps(parallel::ThreadPool& pool, const std::size_t prey,
+                  const std::size_t steps, const bool place) {
+  flock::Flock flock(prey, prey / 40 + 1);
+  flock.setPool(&pool);
+  flock.setSeed(1);
+  flock.generateBoids();
+  if (place) flock.place();
+
+  flock.updateFlock(1.);
+  const auto start = clock_type::now();
+  for (std::size_t s = 0; s < steps; ++s) flock.updateFlock(1.);
+  return static_cast<double>(steps) / since(start);
+}
+
+double tiledSteps(const std::size_t prey, const std::size_t steps,
+                  const tiles::Layout layout) {
+  flock::Flock flock(prey, prey / 40 + 1);
+  flock.setSeed(1);
+  flock.generateBoids();
+  tiles::World world(flock, layout);
+
+  world.step(1.);
+  const auto start = clock_type::now();
+  world.step(1., steps);
+  return static_cast<double>(steps) / since(start);
+}
+
+void row(const std::string& what, const double without, const double with) {
+  std::cout << std::left << std::setw(36) << what << std::right
+            << std::setw(12) << without << std::setw(12) << with << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const std::size_t threads = argument(
+      argc, argv, 1,
+      std::max<std::size_t>(1, std::thread::hardware_concurrency()));
+  const std::size_t members = argument(argc, argv, 2, 64);
+  const std::size_t prey = argument(argc, argv, 3, 500);
+  const std::size_t steps = argument(argc, argv, 4, 50);
+
+  parallel::ThreadPool loose(threads);
+  parallel::ThreadPool pinned(threads, true);
+  pinned.run(pinned.size(), [](std::size_t) {});  // every worker has started
+  std::cout << threads << " threads, " << pinned.getPinned()
+            << " workers pinned\n\n"
+            << std::fixed << std::setprecision(2) << std::left
+            << std::setw(36) << "" << std::right << std::setw(12) << "without"
+            << std::setw(12) << "with" << '\n';
+
+  constexpr std::size_t n = std::size_t{1} << 23;  // 64 MiB per array
+  row("triad bandwidth (GB/s)", triad<std::vector<double>>(loose, n, false),
+      triad<parallel::FirstTouchVector<double>>(pinned, n, true));
+  row("ensemble of " + std::to_string(members) + " (steps/s)",
+      ensembleSteps(loose, members, prey, steps, false),
+      ensembleSteps(pinned, members, prey, steps, true));
+  row("flock of " + std::to_string(members * prey) + " (steps/s)",
+      flockSteps(loose, members * prey, steps / 5 + 1, false),
+      flockSteps(pinned, members * prey, steps / 5 + 1, true));
+
+  std::cout << "\nflock of " << members * prey << " in tiles (steps/s)\n";
+  for (const std::string text : {"1x1", "2x1", "2x2", "4x2"}) {
+    std::cout << std::left << std::setw(36) << text << std::right
+              << std::setw(12)
+              << tiledSteps(members * prey, steps / 5 + 1,
+                            tiles::parseLayout(text))
+              << '\n';
+  }
+}
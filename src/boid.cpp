@@ -3,182 +3,292 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <numeric>
+#include <limits>
 
 #include "../include/graphics.hpp"
 
 namespace boid {
 
-// ---------- Boid ----------
+// ---------- PredatorLanes ----------
 
-Boid::Boid(const point::Point& position, const point::Point& velocity)
-    : position_(position), velocity_(velocity) {}
+PredatorLanes::PredatorLanes() { clear(); }
 
-point::Point Boid::getPosition() const { return position_; }
-point::Point Boid::getVelocity() const { return velocity_; }
+std::size_t PredatorLanes::padded() const {
+  return (size + width - 1) / width * width;
+}
 
-void Boid::setBoid(const point::Point& position, const point::Point& velocity) {
-  position_ = position;
-  velocity_ = velocity;
+void PredatorLanes::clear() {
+  x.fill(std::numeric_limits<double>::quiet_NaN());
+  y.fill(std::numeric_limits<double>::quiet_NaN());
+  size = 0;
 }
 
-double Boid::angle(const Boid& other) const {
-  const point::Point delta = relativePosition(position_, other.getPosition());
-  const double vel_mag = velocity_.distance();
+void PredatorLanes::push(const point::Point& position) {
+  assert(size < capacity);
+  x[size] = position.getX();
+  y[size] = position.getY();
+  ++size;
+}
+
+// ---------- Neighbors ----------
+
+Neighbors::Neighbors(const point::Point* positions,
+                     const point::Point* velocities, const std::size_t size)
+    : positions_{positions}, velocities_{velocities}, size_{size} {}
+
+Neighbors::Neighbors(const std::vector<std::shared_ptr<Boid>>& list)
+    : size_{list.size()} {
+  gathered_.reserve(2 * size_);
+  for (const auto& boid : list) gathered_.push_back(boid->getPosition());
+  for (const auto& boid : list) gathered_.push_back(boid->getVelocity());
+  positions_ = gathered_.data();
+  velocities_ = gathered_.data() + size_;
+}
+
+// ---------- rules ----------
+
+double angle(const point::Point& position, const point::Point& velocity,
+             const point::Point& other) {
+  const point::Point delta = relativePosition(position, other);
+  const double vel_mag = velocity.distance();
   const double delta_mag = delta.distance();
 
   if (vel_mag == 0.0 || delta_mag == 0.0) return 0.0;
 
   double cosine =
-      (velocity_.getX() * delta.getX() + velocity_.getY() * delta.getY()) /
+      (velocity.getX() * delta.getX() + velocity.getY() * delta.getY()) /
       (vel_mag * delta_mag);
   cosine = std::clamp(cosine, -1.0, 1.0);
 
   const double sign =
-      velocity_.getX() * delta.getY() - velocity_.getY() * delta.getX();
+      velocity.getX() * delta.getY() - velocity.getY() * delta.getX();
 
   return (sign >= 0) ? std::acos(cosine) : -std::acos(cosine);
 }
 
-point::Point Boid::separation(
-    const double s, const double ds,
-    const std::vector<std::shared_ptr<Boid>>& near) const {
+point::Point separation(const point::Point& position, const double s,
+                        const double ds, const Neighbors& near) {
   assert(s >= 0);
   assert(ds >= 0);
   if (near.empty()) {
     return point::Point(0., 0.);
   }
-  const point::Point sum = std::accumulate(
-      near.begin(), near.end(), point::Point(0., 0.),
-      [this, ds](const point::Point& accumulate,
-                 const std::shared_ptr<Boid>& boid) {
-        if (point::toroidalDistance(position_, boid->getPosition()) < ds) {
-          return accumulate +
-                 point::relativePosition(position_, boid->getPosition());
-        }
-        return accumulate;
-      });
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < near.size(); ++k) {
+    if (point::toroidalDistance(position, near.position(k)) < ds) {
+      sum = sum + point::relativePosition(position, near.position(k));
+    }
+  }
 
   return (-s) * sum;
 }
 
-// ---------- Prey ----------
-
-Prey::Prey() = default;
-Prey::Prey(const point::Point& position, const point::Point& velocity)
-    : Boid(position, velocity) {}
-
-point::Point Prey::alignment(
-    const double a, const std::vector<std::shared_ptr<Boid>>& near_prey) const {
+point::Point alignment(const point::Point& velocity, const double a,
+                       const Neighbors& near_prey) {
   assert(a >= 0);
   if (near_prey.empty()) {
     return point::Point(0., 0.);
   }
 
-  const point::Point sum = std::accumulate(
-      near_prey.begin(), near_prey.end(), point::Point(0., 0.),
-      [](const point::Point& accumulate, const std::shared_ptr<Boid>& boid) {
-        return accumulate + boid->getVelocity();
-      });
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < near_prey.size(); ++k) {
+    sum = sum + near_prey.velocity(k);
+  }
 
-  return a * (sum / static_cast<double>(near_prey.size()) - velocity_);
+  return a * (sum / static_cast<double>(near_prey.size()) - velocity);
 }
 
-point::Point Prey::cohesion(
-    const double c, const std::vector<std::shared_ptr<Boid>>& near_prey) const {
+point::Point cohesion(const point::Point& position, const double c,
+                      const Neighbors& near_prey) {
   assert(c >= 0);
   if (near_prey.empty()) {
     return point::Point(0., 0.);
   }
 
-  const point::Point sum =
-      std::accumulate(near_prey.begin(), near_prey.end(), point::Point(0., 0.),
-                      [this](const point::Point& accumulate,
-                             const std::shared_ptr<Boid>& boid) {
-                        return accumulate + point::relativePosition(
-                                                position_, boid->getPosition());
-                      });
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < near_prey.size(); ++k) {
+    sum = sum + point::relativePosition(position, near_prey.position(k));
+  }
 
   return c * (sum / static_cast<double>(near_prey.size()));
 }
 
-point::Point Prey::repulsion(
-    const double r,
-    const std::vector<std::shared_ptr<Boid>>& near_predators) const {
+point::Point repulsion(const point::Point& position, const double r,
+                       const Neighbors& near_predators) {
   assert(r >= 0);
   if (near_predators.empty()) {
     return point::Point(0., 0.);
   }
 
-  const point::Point sum = std::accumulate(
-      near_predators.begin(), near_predators.end(), point::Point(0., 0.),
-      [this](const point::Point& accumulate,
-             const std::shared_ptr<Boid>& boid) {
-        return accumulate +
-               point::relativePosition(position_, boid->getPosition());
-      });
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < near_predators.size(); ++k) {
+    sum = sum + point::relativePosition(position, near_predators.position(k));
+  }
 
   return (-r) * sum;
 }
 
-void Prey::clamp(const double min_speed, const double max_speed,
-                 point::Point& velocity) {
-  assert(min_speed >= 0);
-  assert(max_speed > 0);
-  assert(min_speed <= max_speed);
+// same result as repulsion() over the predators that Flock::nearPredators
+// would select (closer than d, within the sight angle), but as a single pass
+// over the lanes: the visibility test is turned into a mask, with the angle
+// test written as a comparison of cosines, and the masked offsets are summed
+// in lane order as the list version sums them in index order
+point::Point repulsion(const point::Point& position,
+                       const point::Point& velocity, const double r,
+                       const double d, const double sight_angle,
+                       const PredatorLanes& predators) {
+  assert(r >= 0);
+  assert(d > 0);
+  constexpr auto width = static_cast<double>(graphics::window_width);
+  constexpr auto height = static_cast<double>(graphics::window_height);
+
+  const double px = position.getX();
+  const double py = position.getY();
+  const double vx = velocity.getX();
+  const double vy = velocity.getY();
+  const double vel_mag = velocity.distance();
+  const double cos_sight = std::cos(sight_angle);
+
+  std::array<double, PredatorLanes::capacity> dx;
+  std::array<double, PredatorLanes::capacity> dy;
+  const std::size_t n = predators.padded();
+
+  for (std::size_t k = 0; k < n; ++k) {
+    const double ox = point::wrap(predators.x[k] - px, width);
+    const double oy = point::wrap(predators.y[k] - py, height);
+    const double delta_mag = std::sqrt(ox * ox + oy * oy);
+    const bool visible =
+        (delta_mag < d) &
+        ((vel_mag == 0.) | (delta_mag == 0.) |
+         (vx * ox + vy * oy > cos_sight * vel_mag * delta_mag));
+    dx[k] = visible ? ox : 0.;
+    dy[k] = visible ? oy : 0.;
+  }
 
-  const double speed = velocity.distance();
-  if (speed == 0.0) {
-    velocity = point::Point(min_speed, 0.);
-    return;
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < n; ++k) {
+    sum += point::Point(dx[k], dy[k]);
   }
-  if (speed > max_speed)
-    velocity = max_speed * (velocity / speed);
-  else if (speed < min_speed)
 
-    velocity = min_speed * (velocity / speed);
+  return (-r) * sum;
 }
 
-// ---------- Predator ----------
-
-Predator::Predator() = default;
-Predator::Predator(const point::Point& position, const point::Point& velocity)
-    : Boid(position, velocity) {}
-
-point::Point Predator::chase(
-    const double ch,
-    const std::vector<std::shared_ptr<Boid>>& near_prey) const {
+point::Point chase(const point::Point& position, const double ch,
+                   const Neighbors& near_prey) {
   assert(ch >= 0);
   if (near_prey.empty()) {
     return point::Point(0., 0.);
   }
 
-  const point::Point sum =
-      std::accumulate(near_prey.begin(), near_prey.end(), point::Point(0., 0.),
-                      [this](const point::Point& accumulate,
-                             const std::shared_ptr<Boid>& boid) {
-                        return accumulate + point::relativePosition(
-                                                position_, boid->getPosition());
-                      });
+  point::Point sum(0., 0.);
+  for (std::size_t k = 0; k < near_prey.size(); ++k) {
+    sum = sum + point::relativePosition(position, near_prey.position(k));
+  }
 
   return ch * sum;
 }
 
-void Predator::clamp(const double min_speed, const double max_speed,
-                     point::Point& velocity) {
+void clamp(const double min_speed, const double max_speed,
+           point::Point& velocity) {
+  double vx = velocity.getX();
+  double vy = velocity.getY();
+  clamp(min_speed, max_speed, &vx, &vy, 1);
+  velocity = point::Point(vx, vy);
+}
+
+// every lane goes through the same operations, the limits being selected
+// rather than branched on, so that the loop can be vectorized: one square
+// root and one division per velocity, whatever limit applies. A velocity
+// within the limits is left exactly as it is; one whose squared speed is
+// zero (or underflows to it) becomes (min_speed, 0)
+void clamp(const double min_speed, const double max_speed, double* vx,
+           double* vy, const std::size_t n) {
   assert(min_speed >= 0);
   assert(max_speed > 0);
   assert(min_speed <= max_speed);
-  //
-  const double speed = velocity.distance();
-  if (speed == 0.0) {
-    velocity = point::Point(min_speed, 0.);
-    return;
+
+  for (std::size_t k = 0; k < n; ++k) {
+    const double x = vx[k];
+    const double y = vy[k];
+    const double speed2 = x * x + y * y;
+    const bool zero = speed2 == 0.;
+    const double speed = std::sqrt(speed2);
+    const double inverse = 1. / (zero ? 1. : speed);
+    const double target = std::min(std::max(speed, min_speed), max_speed);
+    const double factor =
+        (speed > max_speed) | (speed < min_speed) ? target * inverse : 1.;
+    vx[k] = zero ? min_speed : x * factor;
+    vy[k] = zero ? 0. : y * factor;
   }
-  if (speed > max_speed)
-    velocity = max_speed * (velocity / speed);
-  else if (speed < min_speed)
-    velocity = min_speed * (velocity / speed);
+}
+
+// ---------- Boid ----------
+
+Boid::Boid(const point::Point& position, const point::Point& velocity)
+    : position_(position), velocity_(velocity) {}
+
+point::Point Boid::getPosition() const { return position_; }
+point::Point Boid::getVelocity() const { return velocity_; }
+
+void Boid::setBoid(const point::Point& position, const point::Point& velocity) {
+  position_ = position;
+  velocity_ = velocity;
+}
+
+double Boid::angle(const Boid& other) const {
+  return boid::angle(position_, velocity_, other.getPosition());
+}
+
+point::Point Boid::separation(const double s, const double ds,
+                              const Neighbors& near) const {
+  return boid::separation(position_, s, ds, near);
+}
+
+// ---------- Prey ----------
+
+Prey::Prey() = default;
+Prey::Prey(const point::Point& position, const point::Point& velocity)
+    : Boid(position, velocity) {}
+
+point::Point Prey::alignment(const double a,
+                             const Neighbors& near_prey) const {
+  return boid::alignment(velocity_, a, near_prey);
+}
+
+point::Point Prey::cohesion(const double c, const Neighbors& near_prey) const {
+  return boid::cohesion(position_, c, near_prey);
+}
+
+point::Point Prey::repulsion(const double r,
+                             const Neighbors& near_predators) const {
+  return boid::repulsion(position_, r, near_predators);
+}
+
+point::Point Prey::repulsion(const double r, const double d,
+                             const double sight_angle,
+                             const PredatorLanes& predators) const {
+  return boid::repulsion(position_, velocity_, r, d, sight_angle, predators);
+}
+
+void Prey::clamp(const double min_speed, const double max_speed,
+                 point::Point& velocity) {
+  boid::clamp(min_speed, max_speed, velocity);
+}
+
+// ---------- Predator ----------
+
+Predator::Predator() = default;
+Predator::Predator(const point::Point& position, const point::Point& velocity)
+    : Boid(position, velocity) {}
+
+point::Point Predator::chase(const double ch,
+                             const Neighbors& near_prey) const {
+  return boid::chase(position_, ch, near_prey);
+}
+
+void Predator::clamp(const double min_speed, const double max_speed,
+                     point::Point& velocity) {
+  boid::clamp(min_speed, max_speed, velocity);
 }
 
 }  // namespace boid
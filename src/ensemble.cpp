@@ -0,0 +1,543 @@
+#include "../include/ensemble.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#include "../include/boid.hpp"
+#include "../include/graphics.hpp"
+#include "../include/rules.hpp"
+
+namespace ensemble {
+
+namespace {
+
+constexpr auto width = static_cast<double>(graphics::window_width);
+constexpr auto height = static_cast<double>(graphics::window_height);
+
+double wrapped(double x, const double size) {
+  if (x < 0) x += size;
+  if (x > size) x -= size;
+  return x;
+}
+
+std::vector<point::Point> gather(const parallel::FirstTouchVector<double>& x,
+                                 const parallel::FirstTouchVector<double>& y,
+                                 const std::size_t begin,
+                                 const std::size_t n) {
+  std::vector<point::Point> points;
+  points.reserve(n);
+  for (std::size_t i = begin; i < begin + n; ++i) {
+    points.emplace_back(x[i], y[i]);
+  }
+  return points;
+}
+
+// rough number of pair tests in a step, used to schedule the members
+double cost(const Config& config) {
+  const auto n = static_cast<double>(config.n_prey + config.n_predators);
+  return n * (1. + n * config.d * config.d / (width * height));
+}
+
+// the address of a floating-point parameter, nullptr for the population
+// sizes and for unknown names
+double* field(Config& config, const std::string& name) {
+  auto& flight = config.flight_parameters;
+  auto& speed = config.speed_limits;
+  if (name == "separation") return &flight.separation;
+  if (name == "alignment") return &flight.alignment;
+  if (name == "cohesion") return &flight.cohesion;
+  if (name == "repulsion") return &flight.repulsion;
+  if (name == "chase") return &flight.chase;
+  if (name == "prey_min") return &speed.prey_min;
+  if (name == "prey_max") return &speed.prey_max;
+  if (name == "predator_min") return &speed.predator_min;
+  if (name == "predator_max") return &speed.predator_max;
+  if (name == "d") return &config.d;
+  if (name == "prey_ds") return &config.prey_ds;
+  if (name == "predator_ds") return &config.predator_ds;
+  return nullptr;
+}
+
+}  // namespace
+
+const std::vector<std::string>& parameterNames() {
+  static const std::vector<std::string> names{
+      "n_prey",   "n_predators", "separation",   "alignment",
+      "cohesion", "repulsion",   "chase",        "prey_min",
+      "prey_max", "predator_min", "predator_max", "d",
+      "prey_ds",  "predator_ds"};
+  return names;
+}
+
+double get(const Config& config, const std::string& name) {
+  if (name == "n_prey") return static_cast<double>(config.n_prey);
+  if (name == "n_predators") return static_cast<double>(config.n_predators);
+  Config copy = config;
+  const double* value = field(copy, name);
+  if (value == nullptr) {
+    throw std::invalid_argument("unknown parameter '" + name + "'");
+  }
+  return *value;
+}
+
+// population sizes are rounded to the nearest count
+void set(Config& config, const std::string& name, const double value) {
+  if (name == "n_prey" || name == "n_predators") {
+    const auto n = static_cast<std::size_t>(std::llround(std::max(0., value)));
+    (name == "n_prey" ? config.n_prey : config.n_predators) = n;
+    return;
+  }
+  double* target = field(config, name);
+  if (target == nullptr) {
+    throw std::invalid_argument("unknown parameter '" + name + "'");
+  }
+  *target = value;
+}
+
+void validate(const Config& config) {
+  const auto& flight = config.flight_parameters;
+  const auto& speed = config.speed_limits;
+  if (flight.separation < 0 || flight.alignment < 0 || flight.cohesion < 0 ||
+      flight.repulsion < 0 || flight.chase < 0) {
+    throw std::invalid_argument("negative flight parameter");
+  }
+  if (speed.prey_min < 0 || speed.prey_max <= 0 ||
+      speed.prey_min > speed.prey_max) {
+    throw std::invalid_argument("invalid prey speed limits");
+  }
+  if (speed.predator_min < 0 || speed.predator_max <= 0 ||
+      speed.predator_min > speed.predator_max) {
+    throw std::invalid_argument("invalid predator speed limits");
+  }
+  if (config.d <= 0 || config.prey_ds < 0 || config.predator_ds < 0) {
+    throw std::invalid_argument("invalid radii");
+  }
+  if (config.avoidance < 0 || config.obstacle_margin < 0) {
+    throw std::invalid_argument("invalid obstacle parameters");
+  }
+}
+
+void Ensemble::Lanes::resize(const std::size_t n) {
+  x.resize(n);
+  y.resize(n);
+  vx.resize(n);
+  vy.resize(n);
+}
+
+void Ensemble::Lanes::set(const std::size_t i, const point::Point& position,
+                          const point::Point& velocity) {
+  x[i] = position.getX();
+  y[i] = position.getY();
+  vx[i] = velocity.getX();
+  vy[i] = velocity.getY();
+}
+
+Ensemble::Member::Member(const Config& member_config,
+                         const std::size_t first_prey,
+                         const std::size_t first_predator)
+    : config(member_config),
+      prey_begin{first_prey},
+      predator_begin{first_predator},
+      prey_rules{flock::Flock::preyRules(
+          config.flight_parameters, config.prey_ds, config.obstacles.get(),
+          config.avoidance, config.obstacle_margin)},
+      predator_rules{flock::Flock::predatorRules(
+          config.flight_parameters, config.predator_ds, config.obstacles.get(),
+          config.avoidance, config.obstacle_margin)},
+      prey_index{width, height},
+      predator_index{width, height} {
+  prey_index.tune(config.d, config.n_prey);
+  predator_index.tune(config.d, config.n_predators);
+  prey_positions.resize(config.n_prey);
+  predator_positions.resize(config.n_predators);
+}
+
+std::size_t Ensemble::size() const { return members_.size(); }
+
+std::size_t Ensemble::getBoidCount() const {
+  return prey_.x.size() + predators_.x.size();
+}
+
+const Config& Ensemble::getConfig(const std::size_t m) const {
+  assert(m < members_.size());
+  return members_[m].config;
+}
+
+void Ensemble::clear() {
+  for (Lanes* lanes : {&prey_, &predators_, &next_prey_, &next_predators_}) {
+    lanes->resize(0);
+  }
+  members_.clear();
+  order_.clear();
+  costs_.clear();
+}
+
+std::size_t Ensemble::add(
+    const Config& config, const std::vector<point::Point>& prey_positions,
+    const std::vector<point::Point>& prey_velocities,
+    const std::vector<point::Point>& predator_positions,
+    const std::vector<point::Point>& predator_velocities) {
+  assert(config.d > 0);
+  assert(config.prey_ds >= 0);
+  assert(config.predator_ds >= 0);
+  assert(config.avoidance >= 0);
+  assert(config.obstacle_margin >= 0);
+  assert(prey_positions.size() == config.n_prey);
+  assert(predator_positions.size() == config.n_predators);
+
+  const std::size_t prey_begin = prey_.x.size();
+  const std::size_t predator_begin = predators_.x.size();
+  prey_.resize(prey_begin + config.n_prey);
+  predators_.resize(predator_begin + config.n_predators);
+  next_prey_.resize(prey_.x.size());
+  next_predators_.resize(predators_.x.size());
+
+  for (std::size_t i = 0; i < config.n_prey; ++i) {
+    prey_.set(prey_begin + i, prey_positions[i], prey_velocities[i]);
+  }
+  for (std::size_t i = 0; i < config.n_predators; ++i) {
+    predators_.set(predator_begin + i, predator_positions[i],
+                   predator_velocities[i]);
+  }
+
+  members_.emplace_back(config, prey_begin, predator_begin);
+
+  order_.push_back(members_.size() - 1);
+  std::stable_sort(order_.begin(), order_.end(),
+                   [this](const std::size_t a, const std::size_t b) {
+                     return cost(members_[a].config) >
+                            cost(members_[b].config);
+                   });
+  costs_.clear();
+  for (const std::size_t m : order_) costs_.push_back(cost(members_[m].config));
+
+  return members_.size() - 1;
+}
+
+std::size_t Ensemble::add(const Config& config, const std::uint32_t seed) {
+  std::mt19937 mt{seed};
+  std::uniform_real_distribution<> dist_pos_x(0., graphics::window_width);
+  std::uniform_real_distribution<> dist_pos_y(0., graphics::window_height);
+  std::uniform_real_distribution<> dist_angle(0., 2 * M_PI);
+  std::uniform_real_distribution<> dist_vel(2, 5);
+
+  // away from the obstacles, as generateBoids draws them
+  auto position = [&] {
+    point::Point pos;
+    for (int draw = 0; draw < 100; ++draw) {
+      const double x = dist_pos_x(mt);
+      const double y = dist_pos_y(mt);
+      pos = point::Point(x, y);
+      if (!config.obstacles || !config.obstacles->inside(pos)) break;
+    }
+    return pos;
+  };
+  auto draw = [&](const std::size_t n, std::vector<point::Point>& positions,
+                  std::vector<point::Point>& velocities) {
+    for (std::size_t i = 0; i < n; ++i) {
+      const point::Point pos = position();
+      const double speed = dist_vel(mt);
+      const double angle = dist_angle(mt);
+      positions.push_back(pos);
+      velocities.emplace_back(speed * std::cos(angle),
+                              speed * std::sin(angle));
+    }
+  };
+
+  std::vector<point::Point> prey_positions;
+  std::vector<point::Point> prey_velocities;
+  std::vector<point::Point> predator_positions;
+  std::vector<point::Point> predator_velocities;
+  draw(config.n_prey, prey_positions, prey_velocities);
+  draw(config.n_predators, predator_positions, predator_velocities);
+
+  return add(config, prey_positions, prey_velocities, predator_positions,
+             predator_velocities);
+}
+
+std::size_t Ensemble::add(const flock::Flock& flock) {
+  Config config;
+  config.n_prey = flock.getPreyNum();
+  config.n_predators = flock.getPredatorsNum();
+  config.flight_parameters = flock.getFlightParameters();
+  config.speed_limits = flock.getSpeedLimits();
+  const auto distances = flock.getDistanceParameters();
+  config.d = distances[0];
+  config.prey_ds = distances[1];
+  config.predator_ds = distances[2];
+  const auto avoidance = flock.getObstacleParameters();
+  config.obstacles = flock.getObstacles();
+  config.avoidance = avoidance[0];
+  config.obstacle_margin = avoidance[1];
+
+  auto array = [](const flock::View<point::Point> view) {
+    return std::vector<point::Point>(view.begin(), view.end());
+  };
+  return add(config, array(flock.getPreyPositions()),
+             array(flock.getPreyVelocities()),
+             array(flock.getPredatorPositions()),
+             array(flock.getPredatorVelocities()));
+}
+
+std::vector<point::Point> Ensemble::getPreyPositions(
+    const std::size_t m) const {
+  const Member& member = members_[m];
+  return gather(prey_.x, prey_.y, member.prey_begin, member.config.n_prey);
+}
+
+std::vector<point::Point> Ensemble::getPreyVelocities(
+    const std::size_t m) const {
+  const Member& member = members_[m];
+  return gather(prey_.vx, prey_.vy, member.prey_begin, member.config.n_prey);
+}
+
+std::vector<point::Point> Ensemble::getPredatorPositions(
+    const std::size_t m) const {
+  const Member& member = members_[m];
+  return gather(predators_.x, predators_.y, member.predator_begin,
+                member.config.n_predators);
+}
+
+std::vector<point::Point> Ensemble::getPredatorVelocities(
+    const std::size_t m) const {
+  const Member& member = members_[m];
+  return gather(predators_.vx, predators_.vy, member.predator_begin,
+                member.config.n_predators);
+}
+
+// the velocity updateBoid gives prey i of the member, short of the speed
+// limits (see stepMember): the rules of Flock, fed from the lanes in the
+// same order, and a few predators tested at once as Flock does
+void Ensemble::stepPrey(Member& member, const std::size_t i) {
+  const Config& config = member.config;
+  const std::size_t g = member.prey_begin + i;
+  const rules::Self self{member.prey_positions[i],
+                         point::Point(prey_.vx[g], prey_.vy[g])};
+  point::Point vel = self.velocity;
+
+  const bool lanes = config.n_predators <= boid::PredatorLanes::capacity;
+  if (lanes) {
+    vel += boid::repulsion(self.position, self.velocity,
+                           config.flight_parameters.repulsion, config.d,
+                           flock::Flock::prey_sight_angle,
+                           member.predator_lanes);
+  }
+
+  flock::Flock::PreyRules rules = member.prey_rules;
+  member.prey_index.query(self.position, member.candidates);
+  rules::inSight(
+      self, member.candidates, i,
+      [&](const std::size_t j) { return member.prey_positions[j]; }, config.d,
+      flock::Flock::prey_sight_angle,
+      [&](const std::size_t j, const point::Point& offset,
+          const double distance) {
+        const std::size_t o = member.prey_begin + j;
+        rules.add<rules::Set::prey>(
+            {offset, distance, point::Point(prey_.vx[o], prey_.vy[o])});
+      });
+  if (!lanes) {
+    member.predator_index.query(self.position, member.candidates);
+    rules::inSight(
+        self, member.candidates, rules::nobody,
+        [&](const std::size_t j) { return member.predator_positions[j]; },
+        config.d, flock::Flock::prey_sight_angle,
+        [&](const std::size_t j, const point::Point& offset,
+            const double distance) {
+          const std::size_t o = member.predator_begin + j;
+          rules.add<rules::Set::predators>(
+              {offset, distance,
+               point::Point(predators_.vx[o], predators_.vy[o])});
+        });
+  }
+  vel += rules.steer(self);
+
+  next_prey_.vx[g] = vel.getX();
+  next_prey_.vy[g] = vel.getY();
+}
+
+void Ensemble::stepPredator(Member& member, const std::size_t i) {
+  const Config& config = member.config;
+  const std::size_t g = member.predator_begin + i;
+  const rules::Self self{member.predator_positions[i],
+                         point::Point(predators_.vx[g], predators_.vy[g])};
+
+  flock::Flock::PredatorRules rules = member.predator_rules;
+  member.prey_index.query(self.position, member.candidates);
+  rules::inSight(
+      self, member.candidates, rules::nobody,
+      [&](const std::size_t j) { return member.prey_positions[j]; }, config.d,
+      flock::Flock::predator_sight_angle,
+      [&](const std::size_t j, const point::Point& offset,
+          const double distance) {
+        const std::size_t o = member.prey_begin + j;
+        rules.add<rules::Set::prey>(
+            {offset, distance, point::Point(prey_.vx[o], prey_.vy[o])});
+      });
+  member.predator_index.query(self.position, member.candidates);
+  rules::inSight(
+      self, member.candidates, i,
+      [&](const std::size_t j) { return member.predator_positions[j]; },
+      config.d, flock::Flock::predator_sight_angle,
+      [&](const std::size_t j, const point::Point& offset,
+          const double distance) {
+        const std::size_t o = member.predator_begin + j;
+        rules.add<rules::Set::predators>(
+            {offset, distance,
+             point::Point(predators_.vx[o], predators_.vy[o])});
+      });
+  point::Point vel = self.velocity;
+  vel += rules.steer(self);
+
+  next_predators_.vx[g] = vel.getX();
+  next_predators_.vy[g] = vel.getY();
+}
+
+// reads the member's boids from the current arena and writes them to the
+// next one: members touch disjoint ranges, so they run concurrently
+void Ensemble::stepMember(const std::size_t m, const double dt) {
+  Member& member = members_[m];
+  const Config& config = member.config;
+
+  for (std::size_t i = 0; i < config.n_prey; ++i) {
+    const std::size_t g = member.prey_begin + i;
+    member.prey_positions[i] = point::Point(prey_.x[g], prey_.y[g]);
+  }
+  for (std::size_t i = 0; i < config.n_predators; ++i) {
+    const std::size_t g = member.predator_begin + i;
+    member.predator_positions[i] =
+        point::Point(predators_.x[g], predators_.y[g]);
+  }
+  member.prey_index.build(member.prey_positions);
+  member.predator_index.build(member.predator_positions);
+  member.predator_lanes.clear();
+  if (config.n_predators <= boid::PredatorLanes::capacity) {
+    for (const auto& p : member.predator_positions) {
+      member.predator_lanes.push(p);
+    }
+  }
+
+  for (std::size_t i = 0; i < config.n_prey; ++i) {
+    stepPrey(member, i);
+  }
+  for (std::size_t i = 0; i < config.n_predators; ++i) {
+    stepPredator(member, i);
+  }
+
+  // the speed limits over the whole member at once, then the move, out of
+  // the obstacles as Flock::land does
+  const obstacles::Field* field = config.obstacles.get();
+  auto finish = [dt, field](const Lanes& current, Lanes& next,
+                            const std::size_t begin, const std::size_t n,
+                            const double min_speed, const double max_speed) {
+    boid::clamp(min_speed, max_speed, next.vx.data() + begin,
+                next.vy.data() + begin, n);
+    for (std::size_t g = begin; g < begin + n; ++g) {
+      next.x[g] = wrapped(current.x[g] + next.vx[g] * dt, width);
+      next.y[g] = wrapped(current.y[g] + next.vy[g] * dt, height);
+      if (field == nullptr) continue;
+      point::Point position(next.x[g], next.y[g]);
+      point::Point velocity(next.vx[g], next.vy[g]);
+      if (field->keepOut(position, velocity)) {
+        boid::clamp(min_speed, max_speed, velocity);
+        next.set(g, position, velocity);
+      }
+    }
+  };
+  finish(prey_, next_prey_, member.prey_begin, config.n_prey,
+         config.speed_limits.prey_min, config.speed_limits.prey_max);
+  finish(predators_, next_predators_, member.predator_begin,
+         config.n_predators, config.speed_limits.predator_min,
+         config.speed_limits.predator_max);
+}
+
+// the members are dealt as in step, and the next state is written as well so
+// that its pages, too, land where they are written every other step
+void Ensemble::place(parallel::ThreadPool& pool) {
+  const std::size_t n_prey = prey_.x.size();
+  const std::size_t n_predators = predators_.x.size();
+  Lanes prey;
+  Lanes predators;
+  Lanes next_prey;
+  Lanes next_predators;
+  prey.resize(n_prey);
+  predators.resize(n_predators);
+  next_prey.resize(n_prey);
+  next_predators.resize(n_predators);
+
+  auto copy = [](const Lanes& from, Lanes& to, Lanes& next,
+                 const std::size_t begin, const std::size_t n) {
+    for (std::size_t i = begin; i < begin + n; ++i) {
+      to.x[i] = from.x[i];
+      to.y[i] = from.y[i];
+      to.vx[i] = from.vx[i];
+      to.vy[i] = from.vy[i];
+      next.x[i] = 0.;
+      next.y[i] = 0.;
+      next.vx[i] = 0.;
+      next.vy[i] = 0.;
+    }
+  };
+  pool.run(costs_, [&](const std::size_t t) {
+    const Member& member = members_[order_[t]];
+    copy(prey_, prey, next_prey, member.prey_begin, member.config.n_prey);
+    copy(predators_, predators, next_predators, member.predator_begin,
+         member.config.n_predators);
+  });
+
+  prey_ = std::move(prey);
+  predators_ = std::move(predators);
+  next_prey_ = std::move(next_prey);
+  next_predators_ = std::move(next_predators);
+}
+
+void Ensemble::step(const double dt, parallel::ThreadPool& pool) {
+  assert(dt >= 0);
+  pool.run(costs_, [&](const std::size_t t) { stepMember(order_[t], dt); });
+  std::swap(prey_, next_prey_);
+  std::swap(predators_, next_predators_);
+}
+
+std::vector<statistics::Statistics> Ensemble::statistics(
+    parallel::ThreadPool& pool) const {
+  std::vector<statistics::Statistics> stats(members_.size());
+
+  // the member-level calls below run serially inside the task
+  pool.run(order_.size(), [&](const std::size_t t) {
+    const std::size_t m = order_[t];
+    const Member& member = members_[m];
+    const std::size_t begin = member.prey_begin;
+    const std::size_t n = member.config.n_prey;
+
+    const std::vector<double> x(prey_.x.begin() + static_cast<long>(begin),
+                                prey_.x.begin() + static_cast<long>(begin + n));
+    const std::vector<double> y(prey_.y.begin() + static_cast<long>(begin),
+                                prey_.y.begin() + static_cast<long>(begin + n));
+    const statistics::Accumulator distances =
+        statistics::pairDistances(x, y, width, height, pool);
+
+    std::vector<double> speed(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      const double vx = prey_.vx[begin + i];
+      const double vy = prey_.vy[begin + i];
+      speed[i] = std::sqrt(vx * vx + vy * vy);
+    }
+    statistics::Accumulator speeds;
+    speeds.addBlock(speed.data(), speed.size());
+
+    statistics::Statistics s{distances.getMean(), distances.getDeviation(),
+                             speeds.getMean(), speeds.getDeviation()};
+    const auto groups = statistics::clusters(getPreyPositions(m), width,
+                                             height, member.config.d, pool);
+    s.n_clusters = groups.size();
+    s.largest_cluster = groups.empty() ? 0 : groups.front();
+    stats[m] = s;
+  });
+
+  return stats;
+}
+
+}  // namespace ensemble
@@ -1,60 +1,215 @@
 #include "../include/flock.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
 #include <numeric>
 #include <random>
+#include <utility>
 #include <vector>
 
+#include "../include/arena.hpp"
 #include "../include/boid.hpp"
 #include "../include/graphics.hpp"
+#include "../include/grid.hpp"
+#include "../include/obstacles.hpp"
+#include "../include/parallel.hpp"
 #include "../include/point.hpp"
 #include "../include/statistics.hpp"
 
 namespace flock {
 
-Flock::Flock(const std::size_t n_prey, const std::size_t n_predators)
+namespace {
+// position after dt at velocity vel, wrapped back into the world
+point::Point move(point::Point pos, const point::Point& vel, const double dt) {
+  pos += dt * vel;
+
+  if (pos.getX() < 0) {
+    pos.setX(pos.getX() + graphics::window_width);
+  }
+  if (pos.getX() > graphics::window_width) {
+    pos.setX(pos.getX() - graphics::window_width);
+  }
+  if (pos.getY() < 0) {
+    pos.setY(pos.getY() + graphics::window_height);
+  }
+  if (pos.getY() > graphics::window_height) {
+    pos.setY(pos.getY() - graphics::window_height);
+  }
+
+  return pos;
+}
+}  // namespace
+
+Flock::Flock(const std::size_t n_prey, const std::size_t n_predators,
+             std::pmr::memory_resource* memory)
     : n_prey_(n_prey),
       n_predators_(n_predators),
       flight_parameters_{0.1, 0.1, 0.004, 0.6, 0.008},
-      speed_limits_{7., 12., 5., 8.} {
+      speed_limits_{7., 12., 5., 8.},
+      prey_index_{graphics::window_width, graphics::window_height},
+      predator_index_{graphics::window_width, graphics::window_height},
+      memory_{memory},
+      frame_{memory} {
   prey_flock_.reserve(n_prey_);
   predator_flock_.reserve(n_predators_);
+  readBoids();
 }
 
 Flock::Flock(const std::vector<std::shared_ptr<boid::Prey>>& prey,
              const std::vector<std::shared_ptr<boid::Predator>>& predators,
-             const SpeedLimits& speed_limits)
+             const SpeedLimits& speed_limits,
+             std::pmr::memory_resource* memory)
     : n_prey_(prey.size()),
       n_predators_(predators.size()),
       prey_flock_(prey),
       predator_flock_(predators),
       flight_parameters_{0.1, 0.1, 0.004, 0.6, 0.008},
-      speed_limits_(speed_limits) {}
+      speed_limits_(speed_limits),
+      prey_index_{graphics::window_width, graphics::window_height},
+      predator_index_{graphics::window_width, graphics::window_height},
+      memory_{memory},
+      frame_{memory} {
+  readBoids();
+}
 
 std::size_t Flock::getPreyNum() const { return n_prey_; }
 std::size_t Flock::getPredatorsNum() const { return n_predators_; }
 std::size_t Flock::getFlockSize() const { return n_prey_ + n_predators_; }
 
-std::vector<std::shared_ptr<boid::Prey>> Flock::getPreyFlock() const {
+const std::vector<std::shared_ptr<boid::Prey>>& Flock::getPreyFlock() const {
+  syncBoids();
   return prey_flock_;
 }
-std::vector<std::shared_ptr<boid::Predator>> Flock::getPredatorFlock() const {
+const std::vector<std::shared_ptr<boid::Predator>>& Flock::getPredatorFlock()
+    const {
+  syncBoids();
   return predator_flock_;
 }
 
+View<point::Point> Flock::getPreyPositions() const { return prey_.positions; }
+
+View<point::Point> Flock::getPreyVelocities() const {
+  return prey_.velocities;
+}
+
+View<point::Point> Flock::getPredatorPositions() const {
+  return predators_.positions;
+}
+
+View<point::Point> Flock::getPredatorVelocities() const {
+  return predators_.velocities;
+}
+
+const grid::Index& Flock::getPreyIndex() const { return prey_index_; }
+
+const grid::Index& Flock::getPredatorIndex() const {
+  return predator_index_;
+}
+
 FlightParameters Flock::getFlightParameters() const {
   return flight_parameters_;
 }
 
 SpeedLimits Flock::getSpeedLimits() const { return speed_limits_; }
 
-std::array<double, 3> Flock::getDistanceParameters() {
+StepLimits Flock::getStepLimits() const { return step_limits_; }
+
+double Flock::getCoastTolerance() const { return coast_tolerance_; }
+
+// a positive tolerance lets boids coast while another boid may already be
+// up to that much inside their sight radius, trading accuracy for speed
+void Flock::setCoastTolerance(const double tolerance) {
+  assert(tolerance >= 0);
+  coast_tolerance_ = tolerance;
+  resetCoasting();
+}
+
+std::size_t Flock::getCoasting() const { return coasting_; }
+
+const std::vector<double>& Flock::getBusyTime() const { return busy_time_; }
+
+std::size_t Flock::getFrameBytes() const { return frame_bytes_; }
+
+std::size_t Flock::getFrameAllocations() const { return frame_allocations_; }
+
+void Flock::setStepLimits(const StepLimits& step_limits) {
+  assert(step_limits.min_dt >= 0);
+  assert(step_limits.max_dt > 0);
+  assert(step_limits.min_dt <= step_limits.max_dt);
+  assert(step_limits.courant > 0);
+  step_limits_ = step_limits;
+}
+
+std::array<double, 3> Flock::getDistanceParameters() const {
   return {d_, prey_ds_, predator_ds_};
 }
 
+void Flock::setDistanceParameters(const double d, const double prey_ds,
+                                  const double predator_ds) {
+  assert(d > 0);
+  assert(prey_ds >= 0);
+  assert(predator_ds >= 0);
+  d_ = d;
+  prey_ds_ = prey_ds;
+  predator_ds_ = predator_ds;
+  buildIndex();
+  resetCoasting();
+}
+
+// copies the state out of the boids, which from then on only follow it
+void Flock::readBoids() {
+  prey_.positions.resize(prey_flock_.size());
+  prey_.velocities.resize(prey_flock_.size());
+  for (std::size_t i = 0; i < prey_flock_.size(); ++i) {
+    prey_.positions[i] = prey_flock_[i]->getPosition();
+    prey_.velocities[i] = prey_flock_[i]->getVelocity();
+  }
+  predators_.positions.resize(predator_flock_.size());
+  predators_.velocities.resize(predator_flock_.size());
+  for (std::size_t i = 0; i < predator_flock_.size(); ++i) {
+    predators_.positions[i] = predator_flock_[i]->getPosition();
+    predators_.velocities[i] = predator_flock_[i]->getVelocity();
+  }
+  boids_stale_ = false;
+  buildIndex();
+}
+
+// writes the state into the boids, if it has changed since they were last
+// written; a const Flock may do it, the boids being only a copy of the state
+void Flock::syncBoids() const {
+  if (!boids_stale_) return;
+  for (std::size_t i = 0; i < prey_flock_.size(); ++i) {
+    prey_flock_[i]->setBoid(prey_.positions[i], prey_.velocities[i]);
+  }
+  for (std::size_t i = 0; i < predator_flock_.size(); ++i) {
+    predator_flock_[i]->setBoid(predators_.positions[i],
+                                predators_.velocities[i]);
+  }
+  boids_stale_ = false;
+}
+
+// the indices are retuned on every rebuild, so that they follow both the
+// current radius and the current size of each population; the predators,
+// usually a few, end up on the sorted small-array path of grid::Index
+void Flock::buildIndex() {
+  prey_index_.tune(d_, prey_.positions.size());
+  prey_index_.build(prey_.positions);
+
+  predator_index_.tune(d_, predators_.positions.size());
+  predator_index_.build(predators_.positions);
+
+  predator_lanes_.clear();
+  if (predators_.positions.size() <= boid::PredatorLanes::capacity) {
+    for (const auto& p : predators_.positions) predator_lanes_.push(p);
+  }
+}
+
 void Flock::setFlockSize() {
   std::cout << "Enter the number of prey to simulate: ";
   std::size_t prey;
@@ -68,7 +223,7 @@ void Flock::setFlockSize() {
   std::cout << "\nEnter the number of predators to simulate: ";
   std::size_t predators;
   std::cin >> predators;
-  if (std::cin.fail() || predators > 100) {
+  if (std::cin.fail() || predators > boid::PredatorLanes::capacity) {
     std::cout << "\n Invalid input, using default value.";
     predators = 5;
     std::cin.clear();
@@ -78,6 +233,13 @@ void Flock::setFlockSize() {
   n_predators_ = predators;
 }
 
+// the sizes take effect at the next generateBoids
+void Flock::setFlockSize(const std::size_t n_prey,
+                         const std::size_t n_predators) {
+  n_prey_ = n_prey;
+  n_predators_ = n_predators;
+}
+
 void Flock ::setFlightParameters() {
   std::cout << "\nWould you like to customize the parameters of the simulation?"
                "\n (Y/n)";
@@ -121,233 +283,645 @@ void Flock ::setFlightParameters() {
   }
 }
 
+void Flock::setFlightParameters(const FlightParameters& flight_parameters) {
+  assert(flight_parameters.separation >= 0);
+  assert(flight_parameters.alignment >= 0);
+  assert(flight_parameters.cohesion >= 0);
+  assert(flight_parameters.repulsion >= 0);
+  assert(flight_parameters.chase >= 0);
+  flight_parameters_ = flight_parameters;
+}
+
+void Flock::setSpeedLimits(const SpeedLimits& speed_limits) {
+  assert(speed_limits.prey_min >= 0);
+  assert(speed_limits.prey_min <= speed_limits.prey_max);
+  assert(speed_limits.predator_min >= 0);
+  assert(speed_limits.predator_min <= speed_limits.predator_max);
+  speed_limits_ = speed_limits;
+  resetCoasting();
+}
+
+void Flock::setObstacles(std::shared_ptr<const obstacles::Field> field,
+                         const double avoidance, const double margin) {
+  assert(avoidance >= 0);
+  assert(margin >= 0);
+  obstacles_ = std::move(field);
+  avoidance_ = avoidance;
+  obstacle_margin_ = margin;
+  resetCoasting();
+}
+
+const std::shared_ptr<const obstacles::Field>& Flock::getObstacles() const {
+  return obstacles_;
+}
+
+std::array<double, 2> Flock::getObstacleParameters() const {
+  return {avoidance_, obstacle_margin_};
+}
+
+// makes generateBoids repeatable
+void Flock::setSeed(const std::uint32_t seed) { mt_.seed(seed); }
+
+void Flock::setPool(parallel::ThreadPool* const pool) { pool_ = pool; }
+
+parallel::ThreadPool& Flock::pool() const {
+  return pool_ != nullptr ? *pool_ : parallel::defaultPool();
+}
+
 void Flock::generateBoids() {
   std::uniform_real_distribution<> dist_pos_x(0., graphics::window_width);
   std::uniform_real_distribution<> dist_pos_y(0., graphics::window_height);
   std::uniform_real_distribution<> dist_angle(0., 2 * M_PI);
   std::uniform_real_distribution<> dist_vel(2, 5);
 
+  // drawn again while inside an obstacle, but not forever: a world all but
+  // covered by them gets a boid inside after a hundred draws
+  auto position = [&] {
+    point::Point pos;
+    for (int draw = 0; draw < 100; ++draw) {
+      const double x = dist_pos_x(mt_);
+      const double y = dist_pos_y(mt_);
+      pos = point::Point(x, y);
+      if (!obstacles_ || !obstacles_->inside(pos)) break;
+    }
+    return pos;
+  };
+
   prey_flock_.clear();
   prey_flock_.reserve(n_prey_);
 
   for (std::size_t i = 0; i < n_prey_; ++i) {
-    const double x = dist_pos_x(mt_);
-    const double y = dist_pos_y(mt_);
+    const point::Point pos = position();
     const double speed = dist_vel(mt_);
     const double angle = dist_angle(mt_);
 
-    const point::Point pos(x, y);
     const point::Point vel(speed * std::cos(angle), speed * std::sin(angle));
-    prey_flock_.emplace_back(std::make_shared<boid::Prey>(pos, vel));
+    prey_flock_.emplace_back(std::allocate_shared<boid::Prey>(
+        std::pmr::polymorphic_allocator<boid::Prey>(memory_), pos, vel));
   }
 
   predator_flock_.clear();
   predator_flock_.reserve(n_predators_);
 
   for (std::size_t i = 0; i < n_predators_; ++i) {
-    const double x = dist_pos_x(mt_);
-    const double y = dist_pos_y(mt_);
+    const point::Point pos = position();
     const double speed = dist_vel(mt_);
     const double angle = dist_angle(mt_);
 
-    const point::Point pos(x, y);
     const point::Point vel(speed * std::cos(angle), speed * std::sin(angle));
-    predator_flock_.emplace_back(std::make_shared<boid::Predator>(pos, vel));
+    predator_flock_.emplace_back(std::allocate_shared<boid::Predator>(
+        std::pmr::polymorphic_allocator<boid::Predator>(memory_), pos, vel));
   }
+
+  readBoids();
+  resetCoasting();
+}
+
+// calls take(j, offset, distance) for every boid j of one species (prey if
+// `of_prey`) closer than d_ to boid i and in its field of view, in the order
+// of the flock; offset is the relative position of j seen from i
+template <class Take>
+void Flock::select(const std::size_t i, const bool is_prey,
+                   const bool of_prey,
+                   std::pmr::vector<std::size_t>& candidates,
+                   Take take) const {
+  const State& own = is_prey ? prey_ : predators_;
+  const rules::Self self{own.positions[i], own.velocities[i]};
+  const State& other = of_prey ? prey_ : predators_;
+  (of_prey ? prey_index_ : predator_index_).query(self.position, candidates);
+  rules::inSight(
+      self, candidates, is_prey == of_prey ? i : rules::nobody,
+      [&](const std::size_t j) { return other.positions[j]; }, d_,
+      is_prey ? prey_sight_angle : predator_sight_angle, take);
 }
 
 std::vector<std::shared_ptr<boid::Boid>> Flock::nearPrey(
     const std::size_t i, const bool is_prey) const {
+  syncBoids();
   std::vector<std::shared_ptr<boid::Boid>> near;
-
-  const std::shared_ptr<boid::Boid> target =
-      is_prey ? std::static_pointer_cast<boid::Boid>(prey_flock_[i])
-              : std::static_pointer_cast<boid::Boid>(predator_flock_[i]);
-
-  for (std::size_t j = 0; j < n_prey_; ++j) {
-    if (is_prey && i == j) continue;
-
-    const auto& other = prey_flock_[j];
-
-    const double dist =
-        point::toroidalDistance(target->getPosition(), other->getPosition());
-
-    if (dist < d_) {
-      const double relative_angle = target->angle(*other);
-
-      const double sight_angle =
-          is_prey ? prey_sight_angle_ : predator_sight_angle_;
-      if (std::abs(relative_angle) < sight_angle) {
-        near.emplace_back(other);
-      }
-    }
-  }
-
+  std::pmr::vector<std::size_t> candidates;
+  select(i, is_prey, true, candidates,
+         [&](const std::size_t j, const point::Point&, double) {
+           near.emplace_back(prey_flock_[j]);
+         });
   return near;
 }
 
 std::vector<std::shared_ptr<boid::Boid>> Flock::nearPredators(
     const std::size_t i, const bool is_prey) const {
+  syncBoids();
   std::vector<std::shared_ptr<boid::Boid>> near;
+  std::pmr::vector<std::size_t> candidates;
+  select(i, is_prey, false, candidates,
+         [&](const std::size_t j, const point::Point&, double) {
+           near.emplace_back(predator_flock_[j]);
+         });
+  return near;
+}
 
-  const std::shared_ptr<boid::Boid> target =
-      is_prey ? std::static_pointer_cast<boid::Boid>(prey_flock_[i])
-              : std::static_pointer_cast<boid::Boid>(predator_flock_[i]);
+std::array<point::Point, 2> Flock::updateBoid(const std::size_t i,
+                                              const bool is_prey,
+                                              const double dt) const {
+  std::size_t neighbours;
+  std::pmr::vector<std::size_t> candidates;
+  return evaluate(i, is_prey, dt, neighbours, candidates);
+}
 
-  for (std::size_t j = 0; j < n_predators_; ++j) {
-    if (!is_prey && i == j) continue;
+Flock::PreyRules Flock::preyRules(const FlightParameters& flight_parameters,
+                                  const double prey_ds,
+                                  const obstacles::Field* field,
+                                  const double avoidance,
+                                  const double margin) {
+  return PreyRules(rules::Repulsion(flight_parameters.repulsion),
+                   rules::Separation<rules::Set::prey>(
+                       flight_parameters.separation, prey_ds),
+                   rules::Alignment(flight_parameters.alignment),
+                   rules::Cohesion(flight_parameters.cohesion),
+                   rules::Avoid(field, avoidance, margin));
+}
 
-    const auto& other = predator_flock_[j];
+Flock::PredatorRules Flock::predatorRules(
+    const FlightParameters& flight_parameters, const double predator_ds,
+    const obstacles::Field* field, const double avoidance,
+    const double margin) {
+  return PredatorRules(rules::Separation<rules::Set::predators>(
+                           flight_parameters.separation, predator_ds),
+                       rules::Chase(flight_parameters.chase),
+                       rules::Avoid(field, avoidance, margin));
+}
 
-    const double dist =
-        point::toroidalDistance(target->getPosition(), other->getPosition());
+Flock::PreyRules Flock::preyRules() const {
+  return preyRules(flight_parameters_, prey_ds_, obstacles_.get(), avoidance_,
+                   obstacle_margin_);
+}
 
-    if (dist < d_) {
-      const double relative_angle = target->angle(*other);
+Flock::PredatorRules Flock::predatorRules() const {
+  return predatorRules(flight_parameters_, predator_ds_, obstacles_.get(),
+                       avoidance_, obstacle_margin_);
+}
 
-      const double sight_angle =
-          is_prey ? prey_sight_angle_ : predator_sight_angle_;
-      if (std::abs(relative_angle) < sight_angle) {
-        near.emplace_back(other);
-      }
+// what `rules` add to the velocity of boid i: one pass over each species
+// some rule reads (over the predators only if `predators_pass`), feeding
+// every neighbour in sight to all the rules at once
+template <class Rules>
+point::Point Flock::steer(const std::size_t i, const bool is_prey,
+                          Rules rules, const bool predators_pass,
+                          std::size_t& neighbours,
+                          std::pmr::vector<std::size_t>& candidates) const {
+  if constexpr (Rules::reads(rules::Set::prey)) {
+    select(i, is_prey, true, candidates,
+           [&](const std::size_t j, const point::Point& offset,
+               const double distance) {
+             rules.template add<rules::Set::prey>(
+                 {offset, distance, prey_.velocities[j]});
+           });
+  }
+  if constexpr (Rules::reads(rules::Set::predators)) {
+    if (predators_pass) {
+      select(i, is_prey, false, candidates,
+             [&](const std::size_t j, const point::Point& offset,
+                 const double distance) {
+               rules.template add<rules::Set::predators>(
+                   {offset, distance, predators_.velocities[j]});
+             });
     }
   }
+  neighbours = rules.size();
 
-  return near;
+  const State& own = is_prey ? prey_ : predators_;
+  return rules.steer({own.positions[i], own.velocities[i]});
 }
 
-std::array<point::Point, 2> Flock::updateBoid(const std::size_t i,
-                                              const bool is_prey,
-                                              const double dt) const {
-  point::Point pos;
-  point::Point vel;
+// the velocity of boid i after the rules, short of the speed limits; also
+// counts the neighbours the rules went through
+point::Point Flock::steered(const std::size_t i, const bool is_prey,
+                            std::size_t& neighbours,
+                            std::pmr::vector<std::size_t>& candidates) const {
+  const State& own = is_prey ? prey_ : predators_;
+  const point::Point& pos = own.positions[i];
+  point::Point vel = own.velocities[i];
 
   if (is_prey) {
-    pos = prey_flock_[i]->getPosition();
-    vel = prey_flock_[i]->getVelocity();
+    // a few predators are all tested at once, without a pass over them
+    const bool lanes =
+        predators_.positions.size() <= boid::PredatorLanes::capacity;
+    if (lanes) {
+      vel += boid::repulsion(pos, vel, flight_parameters_.repulsion, d_,
+                             prey_sight_angle, predator_lanes_);
+    }
+    vel += steer(i, true, preyRules(), !lanes, neighbours, candidates);
+  } else {
+    vel += steer(i, false, predatorRules(), true, neighbours, candidates);
+  }
+  return vel;
+}
 
-    const auto near_prey = nearPrey(i, true);
-    const auto near_predators = nearPredators(i, true);
+// min and max speed of a species
+std::array<double, 2> Flock::speedLimits(const bool is_prey) const {
+  if (is_prey) return {speed_limits_.prey_min, speed_limits_.prey_max};
+  return {speed_limits_.predator_min, speed_limits_.predator_max};
+}
 
-    if (!near_predators.empty())
-      vel += prey_flock_[i]->repulsion(flight_parameters_.repulsion,
-                                       near_predators);
+// where a boid at `position` gets in dt, at a velocity within the speed
+// limits: out of the obstacles, which may turn the velocity as well
+point::Point Flock::land(const point::Point& position,
+                         point::Point& velocity, const bool is_prey,
+                         const double dt) const {
+  point::Point next = move(position, velocity, dt);
+  if (obstacles_ && obstacles_->keepOut(next, velocity)) {
+    const auto limits = speedLimits(is_prey);
+    boid::clamp(limits[0], limits[1], velocity);
+  }
+  return next;
+}
 
-    if (!near_prey.empty())
-      vel +=
-          prey_flock_[i]->separation(flight_parameters_.separation, prey_ds_,
-                                     near_prey) +
-          prey_flock_[i]->alignment(flight_parameters_.alignment, near_prey) +
-          prey_flock_[i]->cohesion(flight_parameters_.cohesion, near_prey);
+// updateBoid, also counting the neighbours the rules went through
+std::array<point::Point, 2> Flock::evaluate(
+    const std::size_t i, const bool is_prey, const double dt,
+    std::size_t& neighbours, std::pmr::vector<std::size_t>& candidates) const {
+  point::Point vel = steered(i, is_prey, neighbours, candidates);
+  const auto limits = speedLimits(is_prey);
+  boid::clamp(limits[0], limits[1], vel);
+  const State& own = is_prey ? prey_ : predators_;
+  return {land(own.positions[i], vel, is_prey, dt), vel};
+}
 
-    prey_flock_[i]->clamp(speed_limits_.prey_min, speed_limits_.prey_max, vel);
+// slack of a boid after a step in which any two boids close by at most
+// `closing`: the distance to the nearest other boid, of either species,
+// minus d_ (plus the tolerance) minus `closing`. Looking as far as 3 d_ is
+// enough to let an isolated boid coast for several steps
+double Flock::slack(const std::size_t i, const bool is_prey,
+                    const double closing,
+                    std::pmr::vector<std::size_t>& candidates) const {
+  const double reach = 3. * d_;
+  const point::Point p =
+      is_prey ? prey_.positions[i] : predators_.positions[i];
+
+  double nearest = reach;
+  prey_index_.queryAround(p, reach, candidates);
+  for (const std::size_t j : candidates) {
+    if (is_prey && j == i) continue;
+    nearest =
+        std::min(nearest, point::toroidalDistance(p, prey_.positions[j]));
+  }
+  predator_index_.queryAround(p, reach, candidates);
+  for (const std::size_t j : candidates) {
+    if (!is_prey && j == i) continue;
+    nearest =
+        std::min(nearest, point::toroidalDistance(p, predators_.positions[j]));
+  }
 
-  } else {
-    pos = predator_flock_[i]->getPosition();
-    vel = predator_flock_[i]->getVelocity();
+  // nor may a coasting boid get within the margin of an obstacle, which is
+  // looked up in the field rather than searched for
+  double room = nearest - d_ + coast_tolerance_;
+  if (obstacles_) {
+    room = std::min(room, obstacles_->distance(p) - obstacle_margin_);
+  }
+  return room - closing;
+}
 
-    const auto near_prey = nearPrey(i, false);
-    const auto near_predators = nearPredators(i, false);
+void Flock::resetCoasting() {
+  prey_slack_.assign(prey_.positions.size(), -1.);
+  predator_slack_.assign(predators_.positions.size(), -1.);
+}
 
-    if (!near_predators.empty())
-      vel += predator_flock_[i]->separation(flight_parameters_.separation,
-                                            predator_ds_, near_predators);
+// splits a step in tasks: the cells of the prey grid (all the prey at once
+// when their index is a plain array), then blocks of predators. A task is
+// costed with the neighbours its boids went through in the previous step,
+// which follow the boids as they change cell
+void Flock::buildTasks() {
+  // as many tasks as boids at most: reserved once, not regrown as the
+  // number of occupied cells changes
+  task_start_.reserve(n_prey_ + n_predators_ + 1);
+  task_costs_.reserve(n_prey_ + n_predators_);
+  task_boids_.clear();
+  task_start_.assign(1, 0);
+  if (prey_index_.isSmall()) {
+    for (std::size_t i = 0; i < n_prey_; ++i) task_boids_.push_back(i);
+    task_start_.push_back(task_boids_.size());
+  } else {
+    const grid::Grid& cells = prey_index_.getGrid();
+    std::pmr::vector<std::size_t> cell(&frame_);
+    for (std::size_t c = 0; c < cells.getCellCount(); ++c) {
+      cells.cell(c, cell);
+      if (cell.empty()) continue;
+      task_boids_.insert(task_boids_.end(), cell.begin(), cell.end());
+      task_start_.push_back(task_boids_.size());
+    }
+  }
+  prey_tasks_ = task_start_.size() - 1;
 
-    if (!near_prey.empty())
-      vel += predator_flock_[i]->chase(flight_parameters_.chase, near_prey);
+  constexpr std::size_t predator_block = 8;
+  for (std::size_t i = 0; i < n_predators_; i += predator_block) {
+    for (std::size_t j = i; j < std::min(n_predators_, i + predator_block);
+         ++j) {
+      task_boids_.push_back(j);
+    }
+    task_start_.push_back(task_boids_.size());
+  }
 
-    predator_flock_[i]->clamp(speed_limits_.predator_min,
-                              speed_limits_.predator_max, vel);
+  const std::size_t n_tasks = task_start_.size() - 1;
+  task_costs_.assign(n_tasks, 0.);
+  for (std::size_t t = 0; t < n_tasks; ++t) {
+    const auto& work = t < prey_tasks_ ? prey_work_ : predator_work_;
+    for (std::size_t k = task_start_[t]; k < task_start_[t + 1]; ++k) {
+      task_costs_[t] += work[task_boids_[k]];
+    }
   }
+}
 
-  pos += dt * vel;
+void Flock::setBoids(
+    const std::vector<std::array<point::Point, 2>>& prey,
+    const std::vector<std::array<point::Point, 2>>& predators) {
+  // the boids follow the numbers, new ones coming from memory_
+  if (prey.size() != n_prey_ || predators.size() != n_predators_) {
+    n_prey_ = prey.size();
+    n_predators_ = predators.size();
+    prey_.positions.resize(n_prey_);
+    prey_.velocities.resize(n_prey_);
+    predators_.positions.resize(n_predators_);
+    predators_.velocities.resize(n_predators_);
+    prey_flock_.resize(std::min(prey_flock_.size(), n_prey_));
+    while (prey_flock_.size() < n_prey_) {
+      prey_flock_.push_back(std::allocate_shared<boid::Prey>(
+          std::pmr::polymorphic_allocator<boid::Prey>(memory_)));
+    }
+    predator_flock_.resize(std::min(predator_flock_.size(), n_predators_));
+    while (predator_flock_.size() < n_predators_) {
+      predator_flock_.push_back(std::allocate_shared<boid::Predator>(
+          std::pmr::polymorphic_allocator<boid::Predator>(memory_)));
+    }
+  }
+  for (std::size_t i = 0; i < prey.size(); ++i) {
+    prey_.positions[i] = prey[i][0];
+    prey_.velocities[i] = prey[i][1];
+  }
+  for (std::size_t i = 0; i < predators.size(); ++i) {
+    predators_.positions[i] = predators[i][0];
+    predators_.velocities[i] = predators[i][1];
+  }
+  boids_stale_ = true;
+  buildIndex();
+  resetCoasting();
+}
 
-  if (pos.getX() < 0) {
-    pos.setX(pos.getX() + graphics::window_width);
+// each task copies its boids to the new arrays, as a step would write them:
+// prey task t ends up with the prey from task_start_[t] to task_start_[t + 1]
+// and the predators, in blocks of consecutive ones, keep their indices. The
+// index is then rebuilt over the renumbered prey, which gives the same tasks,
+// and its cells are moved the same way
+void Flock::place() {
+  if (prey_slack_.size() != n_prey_ ||
+      predator_slack_.size() != n_predators_) {
+    resetCoasting();
   }
-  if (pos.getX() > graphics::window_width) {
-    pos.setX(pos.getX() - graphics::window_width);
+  if (prey_work_.size() != n_prey_) prey_work_.assign(n_prey_, 1.);
+  if (predator_work_.size() != n_predators_) {
+    predator_work_.assign(n_predators_, 1.);
   }
-  if (pos.getY() < 0) {
-    pos.setY(pos.getY() + graphics::window_height);
+  buildTasks();
+
+  auto fresh = [](const std::size_t n) {
+    return State{parallel::FirstTouchVector<point::Point>(n),
+                 parallel::FirstTouchVector<point::Point>(n)};
+  };
+  State prey = fresh(n_prey_);
+  State next_prey = fresh(n_prey_);
+  State predators = fresh(n_predators_);
+  State next_predators = fresh(n_predators_);
+  parallel::FirstTouchVector<double> prey_work(n_prey_);
+  parallel::FirstTouchVector<double> prey_slack(n_prey_);
+  parallel::FirstTouchVector<double> predator_work(n_predators_);
+  parallel::FirstTouchVector<double> predator_slack(n_predators_);
+
+  auto task = [&](const std::size_t t) {
+    const bool is_prey = t < prey_tasks_;
+    const State& from = is_prey ? prey_ : predators_;
+    State& to = is_prey ? prey : predators;
+    State& next = is_prey ? next_prey : next_predators;
+    const auto& work_from = is_prey ? prey_work_ : predator_work_;
+    const auto& slack_from = is_prey ? prey_slack_ : predator_slack_;
+    auto& work_to = is_prey ? prey_work : predator_work;
+    auto& slack_to = is_prey ? prey_slack : predator_slack;
+    for (std::size_t k = task_start_[t]; k < task_start_[t + 1]; ++k) {
+      const std::size_t i = task_boids_[k];
+      const std::size_t j = is_prey ? k : i;
+      to.positions[j] = from.positions[i];
+      to.velocities[j] = from.velocities[i];
+      next.positions[j] = from.positions[i];
+      next.velocities[j] = from.velocities[i];
+      work_to[j] = work_from[i];
+      slack_to[j] = slack_from[i];
+    }
+  };
+  pool().run(task_costs_, std::ref(task));
+
+  std::vector<std::shared_ptr<boid::Prey>> prey_flock(n_prey_);
+  for (std::size_t k = 0; k < n_prey_; ++k) {
+    prey_flock[k] = prey_flock_[task_boids_[k]];
   }
-  if (pos.getY() > graphics::window_height) {
-    pos.setY(pos.getY() - graphics::window_height);
+  prey_flock_.swap(prey_flock);
+  std::swap(prey_, prey);
+  std::swap(next_prey_, next_prey);
+  std::swap(predators_, predators);
+  std::swap(next_predators_, next_predators);
+  prey_work_.swap(prey_work);
+  prey_slack_.swap(prey_slack);
+  predator_work_.swap(predator_work);
+  predator_slack_.swap(predator_slack);
+
+  buildIndex();
+  if (prey_index_.isSmall()) return;
+  buildTasks();
+  // task t takes the cells from its own up to the next task's; the leading
+  // empty ones go to the first, the predator tasks take none
+  const grid::Grid& cells = prey_index_.getGrid();
+  std::vector<std::size_t> first(task_costs_.size() + 1,
+                                 cells.getCellCount());
+  first[0] = 0;
+  std::vector<std::size_t> cell;
+  for (std::size_t c = 0, t = 0; c < cells.getCellCount(); ++c) {
+    cells.cell(c, cell);
+    if (cell.empty()) continue;
+    if (t > 0) first[t] = c;
+    ++t;
+  }
+  prey_index_.place(pool(), task_costs_, first);
+}
+
+// all the scratch of a step comes from the frame arena, so that once it has
+// grown to fit one a step allocates nothing; the new state goes straight to
+// the next arrays, and committing it is a swap
+void Flock::updateFlock(const double dt) {
+  frame_.reset();
+  next_prey_.positions.resize(n_prey_);
+  next_prey_.velocities.resize(n_prey_);
+  next_predators_.positions.resize(n_predators_);
+  next_predators_.velocities.resize(n_predators_);
+
+  if (prey_slack_.size() != n_prey_ ||
+      predator_slack_.size() != n_predators_) {
+    resetCoasting();
+  }
+  if (prey_work_.size() != n_prey_) prey_work_.assign(n_prey_, 1.);
+  if (predator_work_.size() != n_predators_) {
+    predator_work_.assign(n_predators_, 1.);
   }
+  const double closing =
+      2. * std::max(speed_limits_.prey_max, speed_limits_.predator_max) * dt;
+
+  // every boid reads the current state and writes only its own slots of the
+  // next one, so the result does not depend on how the tasks are scheduled.
+  // A task holds boids of one species, whose velocities are clamped in a
+  // batch once the rules have gone through all of them
+  buildTasks();
+  std::pmr::vector<std::size_t> coasted(task_costs_.size(), 0, &frame_);
+  auto task = [&](const std::size_t t) {
+    const bool is_prey = t < prey_tasks_;
+    const State& own = is_prey ? prey_ : predators_;
+    State& next = is_prey ? next_prey_ : next_predators_;
+    auto& slack_of = is_prey ? prey_slack_ : predator_slack_;
+    auto& work_of = is_prey ? prey_work_ : predator_work_;
+    const std::size_t begin = task_start_[t];
+    const std::size_t n = task_start_[t + 1] - begin;
+
+    // reused from boid to boid, so that it grows only a few times per task
+    std::pmr::vector<std::size_t> candidates(&frame_);
+    std::pmr::vector<double> vx(n, &frame_);
+    std::pmr::vector<double> vy(n, &frame_);
+    for (std::size_t k = 0; k < n; ++k) {
+      const std::size_t i = task_boids_[begin + k];
+      point::Point vel = own.velocities[i];
+      if (slack_of[i] >= 0.) {
+        ++coasted[t];
+        slack_of[i] -= closing;
+        work_of[i] = 1.;
+      } else {
+        std::size_t neighbours;
+        vel = steered(i, is_prey, neighbours, candidates);
+        work_of[i] = 1. + static_cast<double>(neighbours);
+        // a boid whose velocity the rules left untouched is likely
+        // isolated: only then the (wider) search for its nearest boid is
+        // worth doing
+        if (vel == own.velocities[i]) {
+          slack_of[i] = slack(i, is_prey, closing, candidates);
+        }
+      }
+      vx[k] = vel.getX();
+      vy[k] = vel.getY();
+    }
 
-  return {pos, vel};
+    const auto limits = speedLimits(is_prey);
+    boid::clamp(limits[0], limits[1], vx.data(), vy.data(), n);
+    for (std::size_t k = 0; k < n; ++k) {
+      const std::size_t i = task_boids_[begin + k];
+      point::Point vel(vx[k], vy[k]);
+      next.positions[i] = land(own.positions[i], vel, is_prey, dt);
+      next.velocities[i] = vel;
+    }
+  };
+  // by reference, the task does not have to be copied into the heap
+  pool().run(task_costs_, std::ref(task), run_report_);
+  busy_time_ = run_report_.busy;
+  coasting_ = std::accumulate(coasted.begin(), coasted.end(), std::size_t{0});
+
+  std::swap(prey_, next_prey_);
+  std::swap(predators_, next_predators_);
+  boids_stale_ = true;
+
+  buildIndex();
+  frame_bytes_ = frame_.getUsed();
+  frame_allocations_ = frame_.getUpstreamAllocations();
 }
 
-void Flock::updateFlock(const double dt) const {
-  std::vector<point::Point> new_prey_pos;
-  std::vector<point::Point> new_prey_vel;
-  new_prey_pos.reserve(n_prey_);
-  new_prey_vel.reserve(n_prey_);
+// longest step in which no two boids, both at top speed and heading at each
+// other, can close more than a fraction `courant` of the smallest interaction
+// radius: a longer step lets a fast predator jump over a separation radius
+double Flock::maxStep() const {
+  double radius = d_;
+  if (prey_ds_ > 0) radius = std::min(radius, prey_ds_);
+  if (predator_ds_ > 0) radius = std::min(radius, predator_ds_);
 
-  std::vector<point::Point> new_pred_pos;
-  std::vector<point::Point> new_pred_vel;
-  new_pred_pos.reserve(n_predators_);
-  new_pred_vel.reserve(n_predators_);
+  const double top_speed =
+      std::max(speed_limits_.prey_max, speed_limits_.predator_max);
 
-  for (std::size_t i = 0; i < n_prey_; ++i) {
-    const auto result = updateBoid(i, true, dt);
-    new_prey_pos.push_back(result[0]);
-    new_prey_vel.push_back(result[1]);
-  }
+  return std::min(step_limits_.max_dt,
+                  step_limits_.courant * radius / (2. * top_speed));
+}
 
-  for (std::size_t i = 0; i < n_predators_; ++i) {
-    const auto result = updateBoid(i, false, dt);
-    new_pred_pos.push_back(result[0]);
-    new_pred_vel.push_back(result[1]);
+// frames shorter than min_dt are put off and merged with the following ones
+// into a larger step, long frames are split into equal substeps no longer
+// than maxStep()
+StepReport Flock::plan(const double frame_dt) {
+  assert(frame_dt >= 0);
+  pending_dt_ += frame_dt;
+
+  const double max_dt = maxStep();
+  if (pending_dt_ < step_limits_.min_dt || pending_dt_ == 0.) {
+    return {0, 0., max_dt, {}};
   }
 
-  for (std::size_t i = 0; i < n_predators_; ++i) {
-    predator_flock_[i]->setBoid(new_pred_pos[i], new_pred_vel[i]);
+  const auto substeps =
+      static_cast<std::size_t>(std::ceil(pending_dt_ / max_dt));
+  const double dt = pending_dt_ / static_cast<double>(substeps);
+  pending_dt_ = 0.;
+  return {substeps, dt, max_dt, {}};
+}
+
+// simulates frame_dt of time in the substeps of plan
+StepReport Flock::advance(const double frame_dt) {
+  StepReport report = plan(frame_dt);
+  for (std::size_t k = 0; k < report.substeps; ++k) {
+    updateFlock(report.dt);
+    auto& busy = report.busy;
+    busy.resize(std::max(busy.size(), busy_time_.size()), 0.);
+    for (std::size_t t = 0; t < busy_time_.size(); ++t) {
+      busy[t] += busy_time_[t];
+    }
   }
+  return report;
+}
+
+statistics::Statistics Flock::statistics() const {
+  std::vector<double> x(n_prey_);
+  std::vector<double> y(n_prey_);
+  std::vector<double> speed(n_prey_);
   for (std::size_t i = 0; i < n_prey_; ++i) {
-    prey_flock_[i]->setBoid(new_prey_pos[i], new_prey_vel[i]);
+    x[i] = prey_.positions[i].getX();
+    y[i] = prey_.positions[i].getY();
+    speed[i] = prey_.velocities[i].distance();
   }
+
+  const statistics::Accumulator distances = statistics::pairDistances(
+      x, y, graphics::window_width, graphics::window_height,
+      pool());
+
+  statistics::Accumulator speeds;
+  speeds.addBlock(speed.data(), speed.size());
+
+  statistics::Statistics stats{distances.getMean(), distances.getDeviation(),
+                               speeds.getMean(), speeds.getDeviation()};
+
+  const auto groups = clusters();
+  stats.n_clusters = groups.size();
+  stats.largest_cluster = groups.empty() ? 0 : groups.front();
+
+  return stats;
 }
 
-statistics::Statistics Flock::statistics() const {
-  const int n = static_cast<int>(n_prey_);
-
-  double mean_dist = 0.0;
-  double mean_dist2 = 0.0;
-  for (auto it = prey_flock_.begin(); it != prey_flock_.begin() + n; ++it) {
-    const auto sum = std::accumulate(
-        it + 1, prey_flock_.begin() + n, std::array<double, 2>{0.0, 0.0},
-        [&it](auto& accumulate, const std::shared_ptr<boid::Boid>& boid) {
-          const double dist = point::toroidalDistance((*it)->getPosition(),
-                                                      boid->getPosition());
-          accumulate[0] += dist;
-          accumulate[1] += dist * dist;
-          return accumulate;
-        });
-    mean_dist += sum[0];
-    mean_dist2 += sum[1];
-  }
-  const double denom = n * (n - 1) / 2.0;
-  mean_dist /= denom;
-  mean_dist2 /= denom;
-
-  const auto sum = std::accumulate(
-      prey_flock_.begin(), prey_flock_.begin() + n,
-      std::array<double, 2>{0.0, 0.0},
-      [](auto& accumulate, const std::shared_ptr<boid::Boid>& boid) {
-        const double vel = boid->getVelocity().distance();
-        accumulate[0] += vel;
-        accumulate[1] += vel * vel;
-        return accumulate;
-      });
-
-  const double mean_speed = sum[0] / n;
-  const double mean_speed2 = sum[1] / n;
-
-  const double dev_dist = std::sqrt(mean_dist2 - mean_dist * mean_dist);
-  const double dev_speed = std::sqrt(mean_speed2 - mean_speed * mean_speed);
-
-  return {mean_dist, dev_dist, mean_speed, dev_speed};
+// sizes of the groups of prey, largest first: two prey belong to the same
+// group when a chain of prey closer than d_ links them. The prey index is
+// kept current with the positions, so no other is built
+std::vector<std::size_t> Flock::clusters() const {
+  return statistics::clusters(prey_.positions, prey_index_, d_, pool());
+}
+
+// radial distribution, nearest-neighbour distances and polarization of the
+// prey, up to `cutoff`, through the prey index
+statistics::Structure Flock::structure(const double cutoff,
+                                       const std::size_t n_bins) const {
+  return statistics::structure(prey_.positions, prey_.velocities,
+                               prey_index_, cutoff, n_bins, pool());
 }
 
 }  // namespace flock
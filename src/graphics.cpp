@@ -1,11 +1,17 @@
 #include "../include/graphics.hpp"
 
 #include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <memory>
+#include <vector>
 
 #include "../include/boid.hpp"
 #include "../include/flock.hpp"
+#include "../include/grid.hpp"
+#include "../include/obstacles.hpp"
+#include "../include/parallel.hpp"
 #include "../include/point.hpp"
 
 namespace graphics {
@@ -13,6 +19,46 @@ namespace graphics {
 sf::Texture backgroundTexture;
 sf::Sprite backgroundSprite;
 
+// the texture of the last heatmap drawn
+sf::Texture heatmapTexture;
+
+// built again only when the flock gets other obstacles; holding the field
+// keeps its address from being taken by another one
+std::shared_ptr<const obstacles::Field> obstacleField;
+sf::VertexArray obstacleMesh;
+
+namespace {
+// f(lo, hi, offset) for every copy of the world that rect overlaps: lo and
+// hi are the corners of the part of rect over it, in the coordinates of the
+// world, offset where the copy lies
+template <class F>
+void forEachCopy(const sf::FloatRect& rect, F&& f) {
+  const double w = window_width;
+  const double h = window_height;
+  const double left = rect.left;
+  const double top = rect.top;
+  const double right = left + static_cast<double>(rect.width);
+  const double bottom = top + static_cast<double>(rect.height);
+  for (double ky = std::floor(top / h); ky * h < bottom; ++ky) {
+    for (double kx = std::floor(left / w); kx * w < right; ++kx) {
+      const point::Point offset(kx * w, ky * h);
+      const point::Point lo(std::max(left, kx * w) - kx * w,
+                            std::max(top, ky * h) - ky * h);
+      const point::Point hi(std::min(right, (kx + 1) * w) - kx * w,
+                            std::min(bottom, (ky + 1) * h) - ky * h);
+      f(lo, hi, offset);
+    }
+  }
+}
+
+sf::RenderStates translated(const point::Point& offset) {
+  sf::RenderStates states;
+  states.transform.translate(static_cast<float>(offset.getX()),
+                             static_cast<float>(offset.getY()));
+  return states;
+}
+}  // namespace
+
 bool loadBackground(const std::string& filename) {
   if (!backgroundTexture.loadFromFile(filename)) {
     return false;
@@ -27,6 +73,46 @@ bool loadBackground(const std::string& filename) {
   return true;
 }
 
+bool loadMask(const std::string& filename, obstacles::Mask& mask,
+              const unsigned threshold) {
+  sf::Image image;
+  if (!image.loadFromFile(filename)) {
+    return false;
+  }
+  const sf::Vector2u size = image.getSize();
+  mask.width = size.x;
+  mask.height = size.y;
+  mask.solid.assign(std::size_t{size.x} * size.y, 0);
+  for (unsigned y = 0; y < size.y; ++y) {
+    for (unsigned x = 0; x < size.x; ++x) {
+      const sf::Color c = image.getPixel(x, y);
+      const unsigned luminance = (299u * c.r + 587u * c.g + 114u * c.b) / 1000;
+      mask.solid[std::size_t{y} * size.x + x] =
+          c.a > 127 && luminance < threshold ? 1 : 0;
+    }
+  }
+  return mask.width > 0 && mask.height > 0;
+}
+
+sf::VertexArray makeObstacleMesh(const obstacles::Field& field,
+                                 const sf::Color color) {
+  sf::VertexArray mesh(sf::Quads);
+  const auto w = static_cast<float>(field.getCellWidth());
+  const auto h = static_cast<float>(field.getCellHeight());
+  for (std::size_t r = 0; r < field.getRows(); ++r) {
+    for (std::size_t c = 0; c < field.getCols(); ++c) {
+      if (field.sample(c, r) >= 0.) continue;
+      const float x = static_cast<float>(c) * w;
+      const float y = static_cast<float>(r) * h;
+      mesh.append(sf::Vertex(sf::Vector2f(x, y), color));
+      mesh.append(sf::Vertex(sf::Vector2f(x + w, y), color));
+      mesh.append(sf::Vertex(sf::Vector2f(x + w, y + h), color));
+      mesh.append(sf::Vertex(sf::Vector2f(x, y + h), color));
+    }
+  }
+  return mesh;
+}
+
 std::unique_ptr<sf::RenderWindow> makeWindow(const unsigned width,
                                              const unsigned height,
                                              const std::string& title) {
@@ -74,27 +160,215 @@ void drawBoid(sf::RenderWindow& window, const double x, const double y,
   window.draw(triangle);
 }
 
+sf::FloatRect visibleRect(const sf::RenderTarget& target) {
+  const sf::View& view = target.getView();
+  const sf::Vector2f centre = view.getCenter();
+  const sf::Vector2f size = view.getSize();
+  return sf::FloatRect(centre.x - size.x / 2.f, centre.y - size.y / 2.f,
+                       size.x, size.y);
+}
+
+void pan(sf::View& view, const float dx, const float dy) {
+  const sf::Vector2f size = view.getSize();
+  const sf::Vector2f centre = view.getCenter();
+  const auto w = static_cast<float>(window_width);
+  const auto h = static_cast<float>(window_height);
+  auto wrap = [](const float x, const float period) {
+    const float y = std::fmod(x, period);
+    return y < 0.f ? y + period : y;
+  };
+  view.setCenter(wrap(centre.x + dx * size.x, w),
+                 wrap(centre.y + dy * size.y, h));
+}
+
+void zoom(sf::View& view, const float factor) {
+  assert(factor > 0.f);
+  const auto w = static_cast<float>(window_width);
+  const auto h = static_cast<float>(window_height);
+  const float width =
+      std::clamp(view.getSize().x / factor, w / max_zoom, w);
+  view.setSize(width, width * h / w);
+}
+
+void cull(const grid::Index& index, const flock::View<point::Point> positions,
+          const sf::FloatRect& rect, std::vector<Visible>& out,
+          std::vector<std::size_t>& candidates) {
+  out.clear();
+  forEachCopy(rect, [&](const point::Point& lo, const point::Point& hi,
+                        const point::Point& offset) {
+    index.region(lo, hi, candidates);
+    for (const std::size_t i : candidates) {
+      const point::Point& p = positions[i];
+      if (p.getX() >= lo.getX() && p.getX() < hi.getX() &&
+          p.getY() >= lo.getY() && p.getY() < hi.getY()) {
+        out.push_back({i, p + offset});
+      }
+    }
+  });
+}
+
+double screenDensity(const sf::RenderTarget& target, const std::size_t n) {
+  const sf::Vector2f view = target.getView().getSize();
+  const sf::Vector2u size = target.getSize();
+  const double scale_x = static_cast<double>(size.x) / view.x;
+  const double scale_y = static_cast<double>(size.y) / view.y;
+  return static_cast<double>(n) /
+         (window_width * scale_x * window_height * scale_y);
+}
+
+// the grid rows scanned by a band run from the row of its top edge to that
+// of its bottom edge, one more on either side: the grid and the heatmap
+// round the borders of their rows apart, and both wrap around
+void splatHeatmap(const flock::Flock& flock, const Style& style,
+                  Heatmap& map) {
+  assert(style.heatmap_texel > 0);
+  const unsigned texel = style.heatmap_texel;
+  map.width = (window_width + texel - 1) / texel;
+  map.height = (window_height + texel - 1) / texel;
+  const std::size_t texels = std::size_t{map.width} * map.height;
+  map.density.assign(texels, 0.f);
+  map.pixels.assign(4 * texels, 0);
+
+  const auto positions = flock.getPreyPositions();
+  const auto velocities = flock.getPreyVelocities();
+  const grid::Index& index = flock.getPreyIndex();
+  const grid::Grid& grid = index.getGrid();
+
+  parallel::ThreadPool& pool = flock.pool();
+  const std::size_t bands = std::min<std::size_t>(map.height, 4 * pool.size());
+  pool.run(bands, [&](const std::size_t b) {
+    const std::size_t first = b * map.height / bands;
+    const std::size_t last = (b + 1) * map.height / bands;
+    std::vector<float> vx((last - first) * map.width, 0.f);
+    std::vector<float> vy((last - first) * map.width, 0.f);
+
+    auto add = [&](const std::size_t i) {
+      const point::Point& p = positions[i];
+      const auto column = std::min<std::size_t>(
+          map.width - 1, static_cast<std::size_t>(p.getX() / texel));
+      const auto row = std::min<std::size_t>(
+          map.height - 1, static_cast<std::size_t>(p.getY() / texel));
+      if (row < first || row >= last) return;
+      const std::size_t k = (row - first) * map.width + column;
+      map.density[row * map.width + column] += 1.f;
+      vx[k] += static_cast<float>(velocities[i].getX());
+      vy[k] += static_cast<float>(velocities[i].getY());
+    };
+    if (index.isSmall()) {
+      for (std::size_t i = 0; i < positions.size(); ++i) add(i);
+    } else {
+      const auto rows = static_cast<long>(grid.getRows());
+      const auto top = static_cast<long>(static_cast<double>(first * texel) /
+                                         grid.getCellHeight());
+      const auto bottom = static_cast<long>(
+          static_cast<double>(last * texel) / grid.getCellHeight());
+      std::vector<std::size_t> cell;
+      for (long r = top - 1; r <= std::min(bottom + 1, top - 2 + rows); ++r) {
+        const auto row = static_cast<std::size_t>(((r % rows) + rows) % rows);
+        for (std::size_t c = 0; c < grid.getCols(); ++c) {
+          grid.cell(row * grid.getCols() + c, cell);
+          for (const std::size_t i : cell) add(i);
+        }
+      }
+    }
+
+    // opacity from the number of prey, hue from their mean heading
+    for (std::size_t k = 0; k < vx.size(); ++k) {
+      const float n = map.density[first * map.width + k];
+      if (n == 0.f) continue;
+      const float heading = std::atan2(vy[k], vx[k]);
+      const float opacity =
+          std::min(1.f, std::sqrt(n / style.heatmap_saturation));
+      auto channel = [&](const float phase) {
+        return static_cast<sf::Uint8>(
+            127.5f + 127.5f * std::cos(heading - phase));
+      };
+      sf::Uint8* pixel = &map.pixels[4 * (first * map.width + k)];
+      pixel[0] = channel(0.f);
+      pixel[1] = channel(2.0944f);
+      pixel[2] = channel(-2.0944f);
+      pixel[3] = static_cast<sf::Uint8>(255.f * opacity);
+    }
+  });
+}
+
+// the background, the obstacles and the heatmap are drawn once for every
+// copy of the world in sight, the boids once for every copy they are in
 void drawFrame(sf::RenderWindow& window, const flock::Flock& flock,
-               const Style& style) {
+               const Style& style, Scratch& scratch) {
+  const sf::FloatRect view = visibleRect(window);
   if (backgroundTexture.getSize().x > 0 && backgroundTexture.getSize().y > 0) {
-    window.draw(backgroundSprite);
+    forEachCopy(view, [&](const point::Point&, const point::Point&,
+                          const point::Point& offset) {
+      window.draw(backgroundSprite, translated(offset));
+    });
   } else {
     window.clear(style.background);
   }
 
-  for (const auto& prey : flock.getPreyFlock()) {
-    const auto pos = prey->getPosition();
-    const auto vel = prey->getVelocity();
-    drawBoid(window, pos.getX(), pos.getY(), vel.getX(), vel.getY(), style,
-             true);
+  if (const auto& field = flock.getObstacles()) {
+    if (field != obstacleField) {
+      obstacleMesh = makeObstacleMesh(*field, style.obstacle);
+      obstacleField = field;
+    }
+    forEachCopy(view, [&](const point::Point&, const point::Point&,
+                          const point::Point& offset) {
+      window.draw(obstacleMesh, translated(offset));
+    });
   }
 
-  for (const auto& predator : flock.getPredatorFlock()) {
-    const auto pos = predator->getPosition();
-    const auto vel = predator->getVelocity();
-    drawBoid(window, pos.getX(), pos.getY(), vel.getX(), vel.getY(), style,
-             false);
+  // a boid is in sight if its position is, give or take its size
+  const float margin =
+      2.f * (std::max(style.prey_size, style.predator_size) + style.stroke);
+  const sf::FloatRect around(view.left - margin, view.top - margin,
+                             view.width + 2.f * margin,
+                             view.height + 2.f * margin);
+  auto draw = [&](const grid::Index& index,
+                  const flock::View<point::Point> positions,
+                  const flock::View<point::Point> velocities,
+                  const bool is_prey) {
+    cull(index, positions, around, scratch.visible, scratch.candidates);
+    for (const Visible& boid : scratch.visible) {
+      const point::Point& vel = velocities[boid.i];
+      drawBoid(window, boid.position.getX(), boid.position.getY(),
+               vel.getX(), vel.getY(), style, is_prey);
+    }
+  };
+  if (screenDensity(window, flock.getPreyNum()) > style.lod_density) {
+    Heatmap& heatmap = scratch.heatmap;
+    splatHeatmap(flock, style, heatmap);
+    if (heatmapTexture.getSize().x != heatmap.width ||
+        heatmapTexture.getSize().y != heatmap.height) {
+      heatmapTexture.create(heatmap.width, heatmap.height);
+    }
+    heatmapTexture.update(heatmap.pixels.data());
+
+    // a single quad, a texel of the texture over every texel of the world
+    const auto tw = static_cast<float>(heatmap.width);
+    const auto th = static_cast<float>(heatmap.height);
+    const float w = tw * static_cast<float>(style.heatmap_texel);
+    const float h = th * static_cast<float>(style.heatmap_texel);
+    const sf::Vertex quad[] = {
+        sf::Vertex(sf::Vector2f(0.f, 0.f), sf::Color::White,
+                   sf::Vector2f(0.f, 0.f)),
+        sf::Vertex(sf::Vector2f(w, 0.f), sf::Color::White,
+                   sf::Vector2f(tw, 0.f)),
+        sf::Vertex(sf::Vector2f(w, h), sf::Color::White,
+                   sf::Vector2f(tw, th)),
+        sf::Vertex(sf::Vector2f(0.f, h), sf::Color::White,
+                   sf::Vector2f(0.f, th))};
+    forEachCopy(view, [&](const point::Point&, const point::Point&,
+                          const point::Point& offset) {
+      sf::RenderStates states = translated(offset);
+      states.texture = &heatmapTexture;
+      window.draw(quad, 4, sf::Quads, states);
+    });
+  } else {
+    draw(flock.getPreyIndex(), flock.getPreyPositions(),
+         flock.getPreyVelocities(), true);
   }
+  draw(flock.getPredatorIndex(), flock.getPredatorPositions(),
+       flock.getPredatorVelocities(), false);
 }
 
 }  // namespace graphics
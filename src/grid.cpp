@@ -0,0 +1,301 @@
+#include "../include/grid.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace grid {
+
+Grid::Grid(const double width, const double height)
+    : width_{width},
+      height_{height},
+      cell_width_{width},
+      cell_height_{height},
+      cell_start_(2, 0) {
+  assert(width > 0);
+  assert(height > 0);
+}
+
+double Grid::getWidth() const { return width_; }
+double Grid::getHeight() const { return height_; }
+std::size_t Grid::getCols() const { return cols_; }
+std::size_t Grid::getRows() const { return rows_; }
+double Grid::getCellWidth() const { return cell_width_; }
+double Grid::getCellHeight() const { return cell_height_; }
+std::size_t Grid::getCellCount() const { return cols_ * rows_; }
+
+// picks the finest grid whose cells are still at least `radius` wide, then
+// coarsens it until there are no more cells than boids: smaller cells would
+// break the 3x3 lookup, more cells than boids only add empty buckets to scan
+void Grid::tune(const double radius, const std::size_t n) {
+  assert(radius > 0);
+
+  double cols = std::max(1., std::floor(width_ / radius));
+  double rows = std::max(1., std::floor(height_ / radius));
+
+  const double max_cells = std::max(1., static_cast<double>(n));
+  if (cols * rows > max_cells) {
+    const double shrink = std::sqrt(cols * rows / max_cells);
+    cols = std::max(1., std::floor(cols / shrink));
+    rows = std::max(1., std::floor(rows / shrink));
+  }
+
+  cols_ = static_cast<std::size_t>(cols);
+  rows_ = static_cast<std::size_t>(rows);
+  cell_width_ = width_ / cols;
+  cell_height_ = height_ / rows;
+  cell_start_.assign(cols_ * rows_ + 1, 0);
+}
+
+std::size_t Grid::column(const double x) const {
+  const auto c = static_cast<long>(std::floor(x / cell_width_));
+  const auto n = static_cast<long>(cols_);
+  return static_cast<std::size_t>(((c % n) + n) % n);
+}
+
+std::size_t Grid::row(const double y) const {
+  const auto r = static_cast<long>(std::floor(y / cell_height_));
+  const auto n = static_cast<long>(rows_);
+  return static_cast<std::size_t>(((r % n) + n) % n);
+}
+
+std::size_t Grid::cellOf(const point::Point& p) const {
+  return row(p.getY()) * cols_ + column(p.getX());
+}
+
+template <class Positions>
+void Grid::build(const Positions& positions) {
+  std::fill(cell_start_.begin(), cell_start_.end(), 0);
+  for (const auto& p : positions) {
+    ++cell_start_[cellOf(p) + 1];
+  }
+  for (std::size_t c = 1; c < cell_start_.size(); ++c) {
+    cell_start_[c] += cell_start_[c - 1];
+  }
+
+  indices_.resize(positions.size());
+  fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+  for (std::size_t i = 0; i < positions.size(); ++i) {
+    indices_[fill_[cellOf(positions[i])]++] = i;
+  }
+}
+
+void Grid::place(parallel::ThreadPool& pool, const std::vector<double>& costs,
+                 const std::vector<std::size_t>& first) {
+  assert(first.size() == costs.size() + 1);
+  assert(first.back() == getCellCount());
+  parallel::FirstTouchVector<std::size_t> cell_start(cell_start_.size());
+  parallel::FirstTouchVector<std::size_t> indices(indices_.size());
+  parallel::FirstTouchVector<std::size_t> fill(getCellCount());
+  pool.run(costs, [&](const std::size_t t) {
+    for (std::size_t c = first[t]; c < first[t + 1]; ++c) {
+      cell_start[c] = cell_start_[c];
+      fill[c] = cell_start_[c + 1];
+      std::copy(indices_.begin() + static_cast<long>(cell_start_[c]),
+                indices_.begin() + static_cast<long>(cell_start_[c + 1]),
+                indices.begin() + static_cast<long>(cell_start_[c]));
+    }
+  });
+  cell_start.back() = cell_start_.back();
+  cell_start_.swap(cell_start);
+  indices_.swap(indices);
+  fill_.swap(fill);
+}
+
+// the boids in cell c (row-major), in increasing index order
+template <class Indices>
+void Grid::cell(const std::size_t c, Indices& out) const {
+  assert(c < cols_ * rows_);
+  out.assign(indices_.begin() + static_cast<long>(cell_start_[c]),
+             indices_.begin() + static_cast<long>(cell_start_[c + 1]));
+}
+
+// collects, in increasing index order, every boid in the block of cells
+// `rings` cells around p (3x3 by default); with fewer cells along an axis
+// the whole axis is taken, so that no cell is visited twice
+template <class Indices>
+void Grid::query(const point::Point& p, Indices& out,
+                 const std::size_t rings) const {
+  out.clear();
+
+  const std::size_t c0 = column(p.getX());
+  const std::size_t r0 = row(p.getY());
+
+  const std::size_t span = 2 * rings + 1;
+  const std::size_t n_cols = std::min(cols_, span);
+  const std::size_t n_rows = std::min(rows_, span);
+  const std::size_t first_col = cols_ <= span ? 0 : c0 + cols_ - rings;
+  const std::size_t first_row = rows_ <= span ? 0 : r0 + rows_ - rings;
+
+  for (std::size_t dr = 0; dr < n_rows; ++dr) {
+    const std::size_t r = (first_row + dr) % rows_;
+    for (std::size_t dc = 0; dc < n_cols; ++dc) {
+      const std::size_t cell = r * cols_ + (first_col + dc) % cols_;
+      const auto first =
+          indices_.begin() + static_cast<long>(cell_start_[cell]);
+      const auto last =
+          indices_.begin() + static_cast<long>(cell_start_[cell + 1]);
+      out.insert(out.end(), first, last);
+    }
+  }
+
+  std::sort(out.begin(), out.end());
+}
+
+// every boid in the cells overlapping the rectangle from lo to hi, cell by
+// cell; the rectangle lies within the world and does not wrap
+template <class Indices>
+void Grid::region(const point::Point& lo, const point::Point& hi,
+                  Indices& out) const {
+  assert(lo.getX() <= hi.getX() && lo.getY() <= hi.getY());
+  out.clear();
+  auto clamp = [](const double i, const std::size_t n) {
+    return std::min(n - 1, static_cast<std::size_t>(std::max(0., i)));
+  };
+  const std::size_t c0 = clamp(lo.getX() / cell_width_, cols_);
+  const std::size_t c1 = clamp(hi.getX() / cell_width_, cols_);
+  const std::size_t r0 = clamp(lo.getY() / cell_height_, rows_);
+  const std::size_t r1 = clamp(hi.getY() / cell_height_, rows_);
+
+  for (std::size_t r = r0; r <= r1; ++r) {
+    // the cells of a row are contiguous in indices_
+    const auto first =
+        indices_.begin() + static_cast<long>(cell_start_[r * cols_ + c0]);
+    const auto last =
+        indices_.begin() + static_cast<long>(cell_start_[r * cols_ + c1 + 1]);
+    out.insert(out.end(), first, last);
+  }
+}
+
+// ---------- Index ----------
+
+Index::Index(const double width, const double height)
+    : grid_{width, height} {}
+
+bool Index::isSmall() const { return small_; }
+const Grid& Index::getGrid() const { return grid_; }
+
+void Index::tune(const double radius, const std::size_t n) {
+  assert(radius > 0);
+  radius_ = radius;
+  small_ = n <= small_size;
+  if (!small_) {
+    grid_.tune(radius, n);
+  }
+}
+
+template <class Positions>
+void Index::build(const Positions& positions) {
+  if (!small_) {
+    grid_.build(positions);
+    return;
+  }
+
+  const double width = grid_.getWidth();
+  sorted_.resize(positions.size());
+  for (std::size_t i = 0; i < positions.size(); ++i) {
+    double x = std::fmod(positions[i].getX(), width);
+    if (x < 0) x += width;
+    sorted_[i] = {x, i};
+  }
+  std::sort(sorted_.begin(), sorted_.end());
+}
+
+void Index::place(parallel::ThreadPool& pool,
+                  const std::vector<double>& costs,
+                  const std::vector<std::size_t>& first) {
+  if (!small_) grid_.place(pool, costs, first);
+}
+
+// appends the indices whose x lies in [lo, hi]
+template <class Indices>
+void Index::window(const double lo, const double hi, Indices& out) const {
+  auto it = std::lower_bound(
+      sorted_.begin(), sorted_.end(), lo,
+      [](const std::pair<double, std::size_t>& entry, const double x) {
+        return entry.first < x;
+      });
+  for (; it != sorted_.end() && it->first <= hi; ++it) {
+    out.push_back(it->second);
+  }
+}
+
+template <class Indices>
+void Index::query(const point::Point& p, Indices& out) const {
+  queryAround(p, radius_, out);
+}
+
+// like query, but the candidates include every boid closer than `reach`,
+// which may exceed the radius the index was tuned for
+template <class Indices>
+void Index::queryAround(const point::Point& p, const double reach,
+                        Indices& out) const {
+  if (!small_) {
+    const double cell =
+        std::min(grid_.getCellWidth(), grid_.getCellHeight());
+    grid_.query(p, out, static_cast<std::size_t>(std::ceil(reach / cell)));
+    return;
+  }
+
+  out.clear();
+  const double width = grid_.getWidth();
+  double x = std::fmod(p.getX(), width);
+  if (x < 0) x += width;
+  const double lo = x - reach;
+  const double hi = x + reach;
+
+  if (hi - lo >= width) {
+    window(0., width, out);
+  } else if (lo < 0) {
+    window(lo + width, width, out);
+    window(0., hi, out);
+  } else if (hi >= width) {
+    window(lo, width, out);
+    window(0., hi - width, out);
+  } else {
+    window(lo, hi, out);
+  }
+
+  std::sort(out.begin(), out.end());
+}
+
+// the small array is sorted along x alone: the window of the rectangle
+template <class Indices>
+void Index::region(const point::Point& lo, const point::Point& hi,
+                   Indices& out) const {
+  if (!small_) {
+    grid_.region(lo, hi, out);
+    return;
+  }
+  out.clear();
+  window(lo.getX(), hi.getX(), out);
+}
+
+template void Grid::build(const std::vector<point::Point>&);
+template void Grid::build(const parallel::FirstTouchVector<point::Point>&);
+template void Index::build(const std::vector<point::Point>&);
+template void Index::build(const parallel::FirstTouchVector<point::Point>&);
+template void Grid::cell(std::size_t, std::vector<std::size_t>&) const;
+template void Grid::cell(std::size_t, std::pmr::vector<std::size_t>&) const;
+template void Grid::query(const point::Point&, std::vector<std::size_t>&,
+                          std::size_t) const;
+template void Grid::query(const point::Point&,
+                          std::pmr::vector<std::size_t>&, std::size_t) const;
+template void Grid::region(const point::Point&, const point::Point&,
+                           std::vector<std::size_t>&) const;
+template void Grid::region(const point::Point&, const point::Point&,
+                           std::pmr::vector<std::size_t>&) const;
+template void Index::query(const point::Point&,
+                           std::vector<std::size_t>&) const;
+template void Index::query(const point::Point&,
+                           std::pmr::vector<std::size_t>&) const;
+template void Index::queryAround(const point::Point&, double,
+                                 std::vector<std::size_t>&) const;
+template void Index::queryAround(const point::Point&, double,
+                                 std::pmr::vector<std::size_t>&) const;
+template void Index::region(const point::Point&, const point::Point&,
+                            std::vector<std::size_t>&) const;
+template void Index::region(const point::Point&, const point::Point&,
+                            std::pmr::vector<std::size_t>&) const;
+
+}  // namespace grid
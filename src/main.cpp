@@ -1,28 +1,211 @@
 #include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iomanip>
+#include <memory>
+#include <memory_resource>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
 
+#include "../include/ensemble.hpp"
 #include "../include/flock.hpp"
 #include "../include/graphics.hpp"
+#include "../include/obstacles.hpp"
+#include "../include/offscreen.hpp"
+#include "../include/parallel.hpp"
+#include "../include/recorder.hpp"
+#include "../include/settings.hpp"
+#include "../include/statistics.hpp"
+#include "../include/sweep.hpp"
+#include "../include/tiles.hpp"
 
-int main() {
-  flock::Flock flock(0, 0);
-  flock.setFlockSize();
-  flock.setFlightParameters();
+namespace {
+double millisecondsSince(const std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Flock::advance for a tiled flock: the substeps the flock plans, run by the
+// tiles; the state is then copied back into `flock`
+flock::StepReport advance(tiles::World& world, flock::Flock& flock,
+                          const double frame_dt) {
+  flock::StepReport report = flock.plan(frame_dt);
+  if (report.substeps == 0) return report;
+  report.busy = world.step(report.dt, report.substeps);
+  world.gather(flock);
+  return report;
+}
+
+// frames of 1/60 s of the window (20 time units per second) drawn offscreen,
+// each into an image the encoders are done with, while they write the
+// previous ones out: half the hardware threads encode, the pool draws
+int renderFrames(flock::Flock& flock, tiles::World* world,
+                 const settings::Settings& options) {
+  graphics::Style style;
+  if (options.lod_density) style.lod_density = *options.lod_density;
+  const std::size_t encoders =
+      std::max<std::size_t>(2, std::thread::hardware_concurrency() / 2);
+  offscreen::Encoder encoder(options.frames, options.frame_format, encoders);
+  offscreen::Rasterizer rasterizer;
+
+  const double frame_dt = 20. / 60.;
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t frame = 0; frame < options.frame_count; ++frame) {
+    try {
+      if (world) {
+        advance(*world, flock, frame_dt);
+      } else {
+        flock.advance(frame_dt);
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      return 1;
+    }
+    offscreen::Image image = encoder.acquire();
+    image.width = graphics::window_width;
+    image.height = graphics::window_height;
+    rasterizer.draw(flock, style, image);
+    encoder.submit(std::move(image));
+  }
+  encoder.flush();
+
+  std::cout << encoder.getWritten() << " frames in "
+            << millisecondsSince(start) / 1000. << " s\n";
+  if (encoder.getStalls() > 0) {
+    std::cerr << "Warning: the simulation waited " << encoder.getStalls()
+              << " times for the encoders\n";
+  }
+  if (encoder.getFailed() > 0) {
+    std::cerr << "Error: " << encoder.getFailed()
+              << " frames could not be written\n";
+    return 1;
+  }
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Boids --to-csv <in> <out>: converts a recording and exits
+  if (argc == 4 && std::string(argv[1]) == "--to-csv") {
+    if (!recorder::toCsv(argv[2], argv[3])) {
+      std::cerr << "Error: cannot convert " << argv[2] << '\n';
+      return 1;
+    }
+    return 0;
+  }
+
+  // Boids --sweep <spec> <results>: runs (or resumes) a parameter sweep
+  // without opening a window
+  if (argc == 4 && std::string(argv[1]) == "--sweep") {
+    try {
+      std::ifstream spec_file(argv[2]);
+      if (!spec_file) throw std::runtime_error("cannot open the spec");
+      const sweep::Spec spec = sweep::parseSpec(spec_file);
+      parallel::ThreadPool& pool = parallel::defaultPool();
+      sweep::run(spec, argv[3], pool, 4 * pool.size(), std::cout);
+    } catch (const std::exception& e) {
+      std::cerr << "Error: " << argv[2] << ": " << e.what() << '\n';
+      return 1;
+    }
+    return 0;
+  }
+
+  // Boids [--config <file>]... [--<key>=<value>]...: starts the simulation
+  // with the given settings, or asks for the flock on stdin if none is given
+  settings::Settings options;
+  try {
+    options = settings::load(std::vector<std::string>(argv + 1, argv + argc));
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    return 1;
+  }
+  parallel::configureDefaultPool(options.threads, options.pin);
+
+  // --record <file>: appends the statistics of every frame to <file>
+  std::unique_ptr<recorder::Recorder> recording;
+  if (!options.record.empty()) {
+    recording = std::make_unique<recorder::Recorder>(
+        options.record,
+        std::vector<std::string>{
+            "frame", "dt", "substeps", "step_dt", "max_step_dt", "update_ms",
+            "statistics_ms", "coasting", "busy_mean_ms", "busy_max_ms",
+            "frame_kb", "frame_allocations", "mean_distance", "dev_distance",
+            "mean_velocity", "dev_velocity", "n_clusters", "largest_cluster"});
+    if (!recording->isOpen()) {
+      std::cerr << "Error: cannot open " << options.record
+                << " for recording\n";
+      return 1;
+    }
+  }
+
+  // the boids come from a pool, which must outlive them
+  std::pmr::synchronized_pool_resource boid_memory;
+  flock::Flock flock(0, 0, &boid_memory);
+  if (options.interactive) {
+    flock.setFlockSize();
+    flock.setFlightParameters();
+  } else {
+    const ensemble::Config& config = options.flock;
+    flock.setFlockSize(config.n_prey, config.n_predators);
+    flock.setFlightParameters(config.flight_parameters);
+    flock.setSpeedLimits(config.speed_limits);
+    flock.setDistanceParameters(config.d, config.prey_ds, config.predator_ds);
+  }
+  if (options.seed) flock.setSeed(*options.seed);
+  flock.setCoastTolerance(options.coast_tolerance);
+
+  // --obstacles <image>: its dark pixels, stretched over the world, are
+  // obstacles (the background itself will do)
+  if (!options.obstacles.empty()) {
+    obstacles::Mask mask;
+    if (!graphics::loadMask(options.obstacles, mask)) {
+      std::cerr << "Error: cannot load the obstacles from "
+                << options.obstacles << '\n';
+      return 1;
+    }
+    auto field = std::make_shared<obstacles::Field>(
+        static_cast<double>(graphics::window_width),
+        static_cast<double>(graphics::window_height));
+    field->add(mask);
+    field->build();
+    flock.setObstacles(field);
+  }
   flock.generateBoids();
+  if (options.pin) flock.place();
+
+  // with more than one tile, the flock is stepped by one process per tile
+  // and copied back every frame for drawing and statistics
+  std::unique_ptr<tiles::World> world;
+  try {
+    if (options.tiles.columns * options.tiles.rows > 1) {
+      world = std::make_unique<tiles::World>(flock, options.tiles);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    return 1;
+  }
+
+  // --frames <prefix>: no window, the frames go to image files
+  if (!options.frames.empty()) return renderFrames(flock, world.get(), options);
 
   auto window = graphics::makeWindow(graphics::window_width,
                                      graphics::window_height, "Boids");
 
   sf::Clock simClock;
 
-  if (!graphics::loadBackground("assets/world_map31.png")) {
+  if (!graphics::loadBackground(options.background)) {
     std::cerr << "Errore: impossibile caricare lo sfondo. Userò un colore di "
                  "default.\n";
   }
 
   sf::RectangleShape statsPanel;
-  statsPanel.setSize(sf::Vector2f(220.f, 85.f));
+  statsPanel.setSize(sf::Vector2f(220.f, 145.f));
   statsPanel.setFillColor(sf::Color(0, 0, 0, 130));
   statsPanel.setPosition(10.f, 10.f);
 
@@ -37,41 +220,154 @@ int main() {
   statsText.setFillColor(sf::Color::White);
   statsText.setPosition(15.f, 15.f);
 
+  // statistics of the last 100 frames, for a steadier readout
+  statistics::Series series(100);
+  std::vector<double> row;
+  std::size_t frame = 0;
+
+  // the arrows (or WASD) pan by a tenth of the view, +/- and the mouse
+  // wheel zoom; the world wraps around, so does the camera
+  sf::View camera = window->getDefaultView();
+  graphics::Scratch scratch;
+
   while (window->isOpen()) {
     graphics::Style style;
+    if (options.lod_density) style.lod_density = *options.lod_density;
     sf::Event event{};
     while (window->pollEvent(event)) {
       if (event.type == sf::Event::Closed) window->close();
       if (event.type == sf::Event::KeyPressed) {
-        if (event.key.code == sf::Keyboard::Escape) window->close();
+        switch (event.key.code) {
+          case sf::Keyboard::Escape:
+            window->close();
+            break;
+          case sf::Keyboard::Left:
+          case sf::Keyboard::A:
+            graphics::pan(camera, -0.1f, 0.f);
+            break;
+          case sf::Keyboard::Right:
+          case sf::Keyboard::D:
+            graphics::pan(camera, 0.1f, 0.f);
+            break;
+          case sf::Keyboard::Up:
+          case sf::Keyboard::W:
+            graphics::pan(camera, 0.f, -0.1f);
+            break;
+          case sf::Keyboard::Down:
+          case sf::Keyboard::S:
+            graphics::pan(camera, 0.f, 0.1f);
+            break;
+          case sf::Keyboard::Add:
+          case sf::Keyboard::Equal:
+            graphics::zoom(camera, 1.25f);
+            break;
+          case sf::Keyboard::Subtract:
+          case sf::Keyboard::Hyphen:
+            graphics::zoom(camera, 0.8f);
+            break;
+          default:
+            break;
+        }
+      }
+      if (event.type == sf::Event::MouseWheelScrolled) {
+        graphics::zoom(camera, std::pow(1.1f, event.mouseWheelScroll.delta));
       }
     }
 
     const float dt = 20 * simClock.restart().asSeconds();
 
-    flock.updateFlock(dt);
+    const auto update_start = std::chrono::steady_clock::now();
+    flock::StepReport steps;
+    try {
+      steps = world ? advance(*world, flock, dt) : flock.advance(dt);
+    } catch (const std::exception& e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      return 1;
+    }
+    const double update_ms = millisecondsSince(update_start);
 
-    graphics::drawFrame(*window, flock, style);
+    window->setView(camera);
+    graphics::drawFrame(*window, flock, style, scratch);
+    window->setView(window->getDefaultView());  // the panel stays put
 
+    statistics::Statistics stats;
+    const auto statistics_start = std::chrono::steady_clock::now();
     if (flock.getPreyNum() > 2) {
-      auto stats = flock.statistics();
+      stats = flock.statistics();
+      series.push(stats);
+      const statistics::Summary recent = series.window();
 
       std::ostringstream oss;
       oss << std::fixed << std::setprecision(2);
       oss << "Mean dist: " << stats.mean_distance << "\n"
           << "Dev dist: " << stats.dev_distance << "\n"
           << "Mean speed: " << stats.mean_velocity << "\n"
-          << "Dev speed: " << stats.dev_velocity;
+          << "Dev speed: " << stats.dev_velocity << "\n"
+          << "Groups: " << stats.n_clusters << " (largest "
+          << stats.largest_cluster << ")\n"
+          << "Mean dist (100 frames): " << recent.mean_distance.getMean()
+          << "\n"
+          << "Mean speed (100 frames): " << recent.mean_velocity.getMean();
       statsText.setString(oss.str());
 
     } else {
       statsText.setString("Not enough prey to run statistics");
     }
+    const double statistics_ms = millisecondsSince(statistics_start);
+
+    // per-thread time in the update: a max well above the mean means the
+    // threads were left idle
+    double busy_mean_ms = 0.;
+    double busy_max_ms = 0.;
+    for (const double busy : steps.busy) {
+      busy_mean_ms += 1000. * busy / static_cast<double>(steps.busy.size());
+      busy_max_ms = std::max(busy_max_ms, 1000. * busy);
+    }
+
+    if (recording) {
+      row = {static_cast<double>(frame),
+             dt,
+             static_cast<double>(steps.substeps),
+             steps.dt,
+             steps.max_dt,
+             update_ms,
+             statistics_ms,
+             static_cast<double>(flock.getCoasting()),
+             busy_mean_ms,
+             busy_max_ms,
+             static_cast<double>(flock.getFrameBytes()) / 1024.,
+             static_cast<double>(flock.getFrameAllocations()),
+             stats.mean_distance,
+             stats.dev_distance,
+             stats.mean_velocity,
+             stats.dev_velocity,
+             static_cast<double>(stats.n_clusters),
+             static_cast<double>(stats.largest_cluster)};
+      recording->record(row);
+    }
+    ++frame;
     window->draw(statsPanel);
     window->draw(statsText);
 
     window->display();
   }
 
+  if (recording) {
+    recording->flush();
+    if (recording->getStalls() > 0) {
+      std::cerr << "Warning: the simulation waited " << recording->getStalls()
+                << " times for the recording\n";
+    }
+    if (recording->getDropped() > 0) {
+      std::cerr << "Warning: " << recording->getDropped()
+                << " frames were dropped from the recording\n";
+    }
+    if (recording->hasFailed()) {
+      std::cerr << "Error: writing to " << options.record
+                << " failed; the recording is cut short\n";
+      return 1;
+    }
+  }
+
   return 0;
 }
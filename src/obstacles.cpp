@@ -0,0 +1,309 @@
+#include "../include/obstacles.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace obstacles {
+
+namespace {
+constexpr double infinity = std::numeric_limits<double>::infinity();
+
+// out[q] = min over p of (step (q - p))^2 + f[p], for the n samples of a
+// line spaced `step` apart and closed on itself: the lower envelope of the
+// parabolas of Felzenszwalb and Huttenlocher, in linear time, built over
+// three laps of the line and read on the middle one so that it wraps
+void transform(const std::vector<double>& f, const double step,
+               std::vector<double>& out) {
+  const auto n = static_cast<long>(f.size());
+  const double s2 = step * step;
+  auto at = [&](const long p) { return f[static_cast<std::size_t>(p % n)]; };
+  auto meet = [&](const long p, const long q) {
+    return ((at(q) + s2 * static_cast<double>(q * q)) -
+            (at(p) + s2 * static_cast<double>(p * p))) /
+           (2. * s2 * static_cast<double>(q - p));
+  };
+
+  std::vector<long> v;    // seeds whose parabola is on the envelope
+  std::vector<double> z;  // where each of them starts being the lowest
+  for (long q = 0; q < 3 * n; ++q) {
+    if (at(q) == infinity) continue;
+    double s = -infinity;
+    while (!v.empty()) {
+      s = meet(v.back(), q);
+      if (s > z.back()) break;
+      v.pop_back();
+      z.pop_back();
+      s = -infinity;
+    }
+    v.push_back(q);
+    z.push_back(s);
+  }
+
+  out.assign(f.size(), infinity);
+  if (v.empty()) return;
+  std::size_t k = 0;
+  for (long q = n; q < 2 * n; ++q) {
+    while (k + 1 < v.size() && z[k + 1] < static_cast<double>(q)) ++k;
+    const auto d = static_cast<double>(q - v[k]);
+    out[static_cast<std::size_t>(q - n)] = s2 * d * d + at(v[k]);
+  }
+}
+
+// distance from p to the segment ab
+double segmentDistance(const point::Point& p, const point::Point& a,
+                       const point::Point& b) {
+  const point::Point ab = b - a;
+  const point::Point ap = p - a;
+  const double length2 = ab.getX() * ab.getX() + ab.getY() * ab.getY();
+  double t = 0.;
+  if (length2 > 0.) {
+    t = (ap.getX() * ab.getX() + ap.getY() * ab.getY()) / length2;
+    t = std::clamp(t, 0., 1.);
+  }
+  return (ap - t * ab).distance();
+}
+}  // namespace
+
+Field::Field(const double width, const double height, const double cell)
+    : width_{width}, height_{height} {
+  assert(width > 0);
+  assert(height > 0);
+  assert(cell > 0);
+  cols_ = std::max<std::size_t>(1, static_cast<std::size_t>(width / cell));
+  rows_ = std::max<std::size_t>(1, static_cast<std::size_t>(height / cell));
+  cell_width_ = width_ / static_cast<double>(cols_);
+  cell_height_ = height_ / static_cast<double>(rows_);
+}
+
+double Field::getWidth() const { return width_; }
+double Field::getHeight() const { return height_; }
+std::size_t Field::getCols() const { return cols_; }
+std::size_t Field::getRows() const { return rows_; }
+double Field::getCellWidth() const { return cell_width_; }
+double Field::getCellHeight() const { return cell_height_; }
+
+void Field::add(const Circle& circle) {
+  assert(circle.radius >= 0);
+  circles_.push_back(circle);
+  built_ = false;
+}
+
+void Field::add(const Polygon& polygon) {
+  assert(polygon.vertices.size() >= 3);
+  polygons_.push_back(polygon);
+  built_ = false;
+}
+
+void Field::add(const Mask& mask) {
+  assert(mask.width > 0 && mask.height > 0);
+  assert(mask.solid.size() == mask.width * mask.height);
+  masks_.push_back(mask);
+  built_ = false;
+}
+
+bool Field::empty() const {
+  return circles_.empty() && polygons_.empty() && masks_.empty();
+}
+
+point::Point Field::centre(const std::size_t c, const std::size_t r) const {
+  return point::Point((static_cast<double>(c) + 0.5) * cell_width_,
+                      (static_cast<double>(r) + 0.5) * cell_height_);
+}
+
+// the masks are only known at the samples, as solid or not: the distance of
+// a free sample is that to the nearest solid one, of a solid sample that to
+// the nearest free one, both exact (separable transform, columns then rows)
+// and moved by half a cell to put the border between the two
+void Field::distanceToMasks() {
+  std::vector<bool> solid(cols_ * rows_, false);
+  for (std::size_t r = 0; r < rows_; ++r) {
+    for (std::size_t c = 0; c < cols_; ++c) {
+      const point::Point p = centre(c, r);
+      for (const Mask& mask : masks_) {
+        const auto x = std::min(
+            mask.width - 1, static_cast<std::size_t>(
+                                p.getX() / width_ *
+                                static_cast<double>(mask.width)));
+        const auto y = std::min(
+            mask.height - 1, static_cast<std::size_t>(
+                                 p.getY() / height_ *
+                                 static_cast<double>(mask.height)));
+        if (mask.solid[y * mask.width + x] != 0) solid[r * cols_ + c] = true;
+      }
+    }
+  }
+
+  // squared distance from every sample to the nearest one with seed == s
+  auto squared = [&](const bool s) {
+    std::vector<double> d(cols_ * rows_);
+    for (std::size_t k = 0; k < d.size(); ++k) {
+      d[k] = solid[k] == s ? 0. : infinity;
+    }
+    std::vector<double> line;
+    std::vector<double> out;
+    line.resize(rows_);
+    for (std::size_t c = 0; c < cols_; ++c) {
+      for (std::size_t r = 0; r < rows_; ++r) line[r] = d[r * cols_ + c];
+      transform(line, cell_height_, out);
+      for (std::size_t r = 0; r < rows_; ++r) d[r * cols_ + c] = out[r];
+    }
+    line.resize(cols_);
+    for (std::size_t r = 0; r < rows_; ++r) {
+      std::copy_n(d.begin() + static_cast<long>(r * cols_), cols_,
+                  line.begin());
+      transform(line, cell_width_, out);
+      std::copy(out.begin(), out.end(),
+                d.begin() + static_cast<long>(r * cols_));
+    }
+    return d;
+  };
+  const std::vector<double> to_solid = squared(true);
+  const std::vector<double> to_free = squared(false);
+
+  const double half = 0.5 * std::min(cell_width_, cell_height_);
+  const double far = std::max(width_, height_);
+  for (std::size_t k = 0; k < distance_.size(); ++k) {
+    const double d = solid[k] ? -(std::sqrt(to_free[k]) - half)
+                              : std::sqrt(to_solid[k]) - half;
+    distance_[k] = std::min(distance_[k], std::clamp(d, -far, far));
+  }
+}
+
+// the union of the obstacles: the least of their signed distances, exact
+// for circles and polygons, to within a cell for masks. The gradient is the
+// central difference of the samples around each one
+void Field::build() {
+  const double far = std::max(width_, height_);
+  distance_.assign(cols_ * rows_, far);
+  gradient_.assign(cols_ * rows_, point::Point(0., 0.));
+
+  for (std::size_t r = 0; r < rows_; ++r) {
+    for (std::size_t c = 0; c < cols_; ++c) {
+      const point::Point p = centre(c, r);
+      double& d = distance_[r * cols_ + c];
+      for (const Circle& circle : circles_) {
+        const double dx =
+            point::wrap(p.getX() - circle.centre.getX(), width_);
+        const double dy =
+            point::wrap(p.getY() - circle.centre.getY(), height_);
+        d = std::min(d, std::hypot(dx, dy) - circle.radius);
+      }
+      for (const Polygon& polygon : polygons_) {
+        // the image of p nearest to the polygon
+        const point::Point& first = polygon.vertices.front();
+        const point::Point q(
+            first.getX() + point::wrap(p.getX() - first.getX(), width_),
+            first.getY() + point::wrap(p.getY() - first.getY(), height_));
+        double nearest = infinity;
+        bool in = false;
+        const auto& v = polygon.vertices;
+        for (std::size_t i = 0, j = v.size() - 1; i < v.size(); j = i++) {
+          nearest = std::min(nearest, segmentDistance(q, v[j], v[i]));
+          if ((v[i].getY() > q.getY()) != (v[j].getY() > q.getY()) &&
+              q.getX() < (v[j].getX() - v[i].getX()) *
+                                 (q.getY() - v[i].getY()) /
+                                 (v[j].getY() - v[i].getY()) +
+                             v[i].getX()) {
+            in = !in;
+          }
+        }
+        d = std::min(d, in ? -nearest : nearest);
+      }
+    }
+  }
+  if (!masks_.empty()) distanceToMasks();
+
+  for (std::size_t r = 0; r < rows_; ++r) {
+    const std::size_t up = (r + rows_ - 1) % rows_;
+    const std::size_t down = (r + 1) % rows_;
+    for (std::size_t c = 0; c < cols_; ++c) {
+      const std::size_t left = (c + cols_ - 1) % cols_;
+      const std::size_t right = (c + 1) % cols_;
+      const point::Point g(
+          (distance_[r * cols_ + right] - distance_[r * cols_ + left]) /
+              (2. * cell_width_),
+          (distance_[down * cols_ + c] - distance_[up * cols_ + c]) /
+              (2. * cell_height_));
+      const double length = g.distance();
+      gradient_[r * cols_ + c] =
+          length > 1e-12 ? g / length : point::Point(0., 0.);
+    }
+  }
+  built_ = true;
+}
+
+double Field::sample(const std::size_t c, const std::size_t r) const {
+  assert(built_);
+  assert(c < cols_ && r < rows_);
+  return distance_[r * cols_ + c];
+}
+
+// bilinear between the four samples around p, across the edges of the world
+template <class Sample>
+auto Field::interpolate(const point::Point& p,
+                        const std::vector<Sample>& samples) const {
+  assert(built_);
+  const double x = p.getX() / cell_width_ - 0.5;
+  const double y = p.getY() / cell_height_ - 0.5;
+  const double x0 = std::floor(x);
+  const double y0 = std::floor(y);
+  const double fx = x - x0;
+  const double fy = y - y0;
+
+  auto index = [](const double i, const std::size_t n) {
+    const auto size = static_cast<long>(n);
+    return static_cast<std::size_t>(
+        ((static_cast<long>(i) % size) + size) % size);
+  };
+  const std::size_t c0 = index(x0, cols_);
+  const std::size_t c1 = (c0 + 1) % cols_;
+  const std::size_t r0 = index(y0, rows_);
+  const std::size_t r1 = (r0 + 1) % rows_;
+
+  return (1. - fy) * ((1. - fx) * samples[r0 * cols_ + c0] +
+                      fx * samples[r0 * cols_ + c1]) +
+         fy * ((1. - fx) * samples[r1 * cols_ + c0] +
+               fx * samples[r1 * cols_ + c1]);
+}
+
+double Field::distance(const point::Point& p) const {
+  return interpolate(p, distance_);
+}
+
+// interpolated too, so a little shorter than a unit between samples
+point::Point Field::gradient(const point::Point& p) const {
+  return interpolate(p, gradient_);
+}
+
+bool Field::inside(const point::Point& p) const { return distance(p) < 0.; }
+
+// near a corner the border is not where the gradient says, so a few pushes
+// may be needed
+bool Field::keepOut(point::Point& position, point::Point& velocity) const {
+  bool pushed = false;
+  for (int push = 0; push < 3; ++push) {
+    const double depth = -distance(position);
+    if (depth <= 0.) break;
+    const point::Point outwards = gradient(position);
+    const double length = outwards.distance();
+    if (length == 0.) break;
+
+    const point::Point normal = outwards / length;
+    position += depth * normal;
+    if (position.getX() < 0) position.setX(position.getX() + width_);
+    if (position.getX() > width_) position.setX(position.getX() - width_);
+    if (position.getY() < 0) position.setY(position.getY() + height_);
+    if (position.getY() > height_) position.setY(position.getY() - height_);
+
+    const double into =
+        velocity.getX() * normal.getX() + velocity.getY() * normal.getY();
+    if (into < 0.) velocity = velocity - into * normal;
+    pushed = true;
+  }
+  return pushed;
+}
+
+}  // namespace obstacles
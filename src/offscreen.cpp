@@ -0,0 +1,387 @@
+#include "../include/offscreen.hpp"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "../include/parallel.hpp"
+#include "../include/point.hpp"
+
+namespace offscreen {
+
+namespace {
+
+struct Triangle {
+  double x[3];
+  double y[3];
+};
+
+// c over the pixel, by the alpha of c; the pixel stays opaque
+void blend(std::uint8_t* pixel, const sf::Color c) {
+  const unsigned a = c.a;
+  const unsigned channels[3] = {c.r, c.g, c.b};
+  for (std::size_t k = 0; k < 3; ++k) {
+    pixel[k] = static_cast<std::uint8_t>(
+        (channels[k] * a + pixel[k] * (255u - a) + 127u) / 255u);
+  }
+  pixel[3] = 255;
+}
+
+// the pixels of rows [first, last) with their centre inside t, or on its
+// edges, whatever its winding
+void fill(Image& image, const std::size_t first, const std::size_t last,
+          const Triangle& t, const sf::Color color) {
+  const auto [x_min, x_max] = std::minmax({t.x[0], t.x[1], t.x[2]});
+  const auto [y_min, y_max] = std::minmax({t.y[0], t.y[1], t.y[2]});
+  const double left = std::max(0., std::ceil(x_min - 0.5));
+  const double right =
+      std::min(static_cast<double>(image.width) - 1., std::floor(x_max - 0.5));
+  const double top = std::max(static_cast<double>(first),
+                              std::ceil(y_min - 0.5));
+  const double bottom =
+      std::min(static_cast<double>(last) - 1., std::floor(y_max - 0.5));
+  if (left > right || top > bottom) return;
+
+  auto edge = [&](const std::size_t i, const std::size_t j, const double x,
+                  const double y) {
+    return (t.x[j] - t.x[i]) * (y - t.y[i]) - (t.y[j] - t.y[i]) * (x - t.x[i]);
+  };
+  const double area = edge(0, 1, t.x[2], t.y[2]);
+  if (area == 0.) return;
+
+  for (auto y = static_cast<std::size_t>(top);
+       y <= static_cast<std::size_t>(bottom); ++y) {
+    const double py = static_cast<double>(y) + 0.5;
+    for (auto x = static_cast<std::size_t>(left);
+         x <= static_cast<std::size_t>(right); ++x) {
+      const double px = static_cast<double>(x) + 0.5;
+      if (edge(0, 1, px, py) * area >= 0. && edge(1, 2, px, py) * area >= 0. &&
+          edge(2, 0, px, py) * area >= 0.) {
+        blend(&image.pixels[4 * (y * image.width + x)], color);
+      }
+    }
+  }
+}
+
+// the triangle of graphics::makeBoidTriangle at p, heading along v, in the
+// pixels of an image scaled by (sx, sy) from the world. Its outline is the
+// same triangle with every side moved out by stroke, that is scaled about
+// its incentre
+void boidTriangles(const point::Point& p, const point::Point& v,
+                   const double size, const double stroke, const double sx,
+                   const double sy, Triangle& shape, Triangle& outline) {
+  const double speed = v.distance();
+  const double c = speed > 0. ? v.getX() / speed : 1.;
+  const double s = speed > 0. ? v.getY() / speed : 0.;
+  const double lx[3] = {size, -size, -size};
+  const double ly[3] = {0., 0.6 * size, -0.6 * size};
+
+  double wx[3];
+  double wy[3];
+  double side[3];
+  for (std::size_t k = 0; k < 3; ++k) {
+    wx[k] = p.getX() + lx[k] * c - ly[k] * s;
+    wy[k] = p.getY() + lx[k] * s + ly[k] * c;
+  }
+  for (std::size_t k = 0; k < 3; ++k) {
+    side[k] = std::hypot(wx[(k + 2) % 3] - wx[(k + 1) % 3],
+                         wy[(k + 2) % 3] - wy[(k + 1) % 3]);
+  }
+  const double perimeter = side[0] + side[1] + side[2];
+  const double ix = (side[0] * wx[0] + side[1] * wx[1] + side[2] * wx[2]) /
+                    perimeter;
+  const double iy = (side[0] * wy[0] + side[1] * wy[1] + side[2] * wy[2]) /
+                    perimeter;
+  const double inradius = 2.4 * size * size / perimeter;  // area / semi-p.
+  const double grow = (inradius + stroke) / inradius;
+
+  for (std::size_t k = 0; k < 3; ++k) {
+    shape.x[k] = wx[k] * sx;
+    shape.y[k] = wy[k] * sy;
+    outline.x[k] = (ix + grow * (wx[k] - ix)) * sx;
+    outline.y[k] = (iy + grow * (wy[k] - iy)) * sy;
+  }
+}
+
+}  // namespace
+
+Format parseFormat(const std::string& name) {
+  if (name == "raw") return Format::raw;
+  if (name == "ppm") return Format::ppm;
+  if (name == "png") return Format::png;
+  throw std::invalid_argument("unknown image format '" + name + "'");
+}
+
+std::string framePath(const std::string& prefix, const std::uint64_t frame,
+                      const Format format) {
+  std::ostringstream path;
+  path << prefix << std::setw(6) << std::setfill('0') << frame;
+  switch (format) {
+    case Format::raw:
+      path << ".rgba";
+      break;
+    case Format::ppm:
+      path << ".ppm";
+      break;
+    case Format::png:
+      path << ".png";
+      break;
+  }
+  return path.str();
+}
+
+// ---------- Rasterizer ----------
+
+// the cells of the field inside an obstacle, as graphics::makeObstacleMesh
+// draws them
+void Rasterizer::cover(const obstacles::Field& field, const unsigned width,
+                       const unsigned height) {
+  mask_.assign(std::size_t{width} * height, 0);
+  const double cell_x = field.getCellWidth() * width / graphics::window_width;
+  const double cell_y =
+      field.getCellHeight() * height / graphics::window_height;
+  for (unsigned y = 0; y < height; ++y) {
+    const auto r = std::min(field.getRows() - 1,
+                            static_cast<std::size_t>((y + 0.5) / cell_y));
+    for (unsigned x = 0; x < width; ++x) {
+      const auto c = std::min(field.getCols() - 1,
+                              static_cast<std::size_t>((x + 0.5) / cell_x));
+      mask_[std::size_t{y} * width + x] = field.sample(c, r) < 0. ? 1 : 0;
+    }
+  }
+  mask_width_ = width;
+  mask_height_ = height;
+}
+
+void Rasterizer::draw(const flock::Flock& flock, const graphics::Style& style,
+                      Image& image) {
+  assert(image.width > 0 && image.height > 0);
+  const unsigned width = image.width;
+  const unsigned height = image.height;
+  image.pixels.resize(4 * std::size_t{width} * height);
+  const double sx = static_cast<double>(width) / graphics::window_width;
+  const double sy = static_cast<double>(height) / graphics::window_height;
+
+  const bool dense = static_cast<double>(flock.getPreyNum()) /
+                         (static_cast<double>(width) * height) >
+                     style.lod_density;
+  if (dense) graphics::splatHeatmap(flock, style, heatmap_);
+
+  const auto& field = flock.getObstacles();
+  if (field && (field != field_ || width != mask_width_ ||
+                height != mask_height_)) {
+    cover(*field, width, height);
+    field_ = field;
+  }
+
+  // how far a boid reaches from its position, outline included
+  const double reach =
+      2. * (std::max(style.prey_size, style.predator_size) + style.stroke) *
+      std::max(sx, sy);
+
+  parallel::ThreadPool& pool = parallel::defaultPool();
+  const std::size_t bands = std::min<std::size_t>(height, 4 * pool.size());
+  pool.run(bands, [&](const std::size_t b) {
+    const std::size_t first = b * height / bands;
+    const std::size_t last = (b + 1) * height / bands;
+
+    const sf::Color& background = style.background;
+    for (std::size_t k = first * width; k < last * width; ++k) {
+      std::uint8_t* pixel = &image.pixels[4 * k];
+      pixel[0] = background.r;
+      pixel[1] = background.g;
+      pixel[2] = background.b;
+      pixel[3] = 255;
+    }
+    if (field) {
+      for (std::size_t k = first * width; k < last * width; ++k) {
+        if (mask_[k] != 0) blend(&image.pixels[4 * k], style.obstacle);
+      }
+    }
+
+    if (dense) {
+      const double texel = style.heatmap_texel;
+      for (std::size_t y = first; y < last; ++y) {
+        const auto row = std::min<std::size_t>(
+            heatmap_.height - 1,
+            static_cast<std::size_t>((static_cast<double>(y) + 0.5) / sy /
+                                     texel));
+        for (std::size_t x = 0; x < width; ++x) {
+          const auto column = std::min<std::size_t>(
+              heatmap_.width - 1,
+              static_cast<std::size_t>((static_cast<double>(x) + 0.5) / sx /
+                                       texel));
+          const std::uint8_t* t =
+              &heatmap_.pixels[4 * (row * heatmap_.width + column)];
+          if (t[3] == 0) continue;
+          blend(&image.pixels[4 * (y * width + x)],
+                sf::Color(t[0], t[1], t[2], t[3]));
+        }
+      }
+    }
+
+    Triangle shape;
+    Triangle outline;
+    auto draw = [&](const flock::View<point::Point> positions,
+                    const flock::View<point::Point> velocities,
+                    const bool is_prey) {
+      const double size = is_prey ? style.prey_size : style.predator_size;
+      const sf::Color fill_color =
+          is_prey ? style.prey_fill : style.predator_fill;
+      const sf::Color outline_color =
+          is_prey ? style.prey_outline : style.predator_outline;
+      // a boid reaching over an edge is drawn again one world away, on the
+      // other side, as drawFrame draws its wrapped copies
+      for (std::size_t i = 0; i < positions.size(); ++i) {
+        const double x = positions[i].getX() * sx;
+        const double y = positions[i].getY() * sy;
+        for (int ky = -1; ky <= 1; ++ky) {
+          const double copy_y = y + ky * static_cast<double>(height);
+          if (copy_y + reach < static_cast<double>(first) ||
+              copy_y - reach > static_cast<double>(last)) {
+            continue;
+          }
+          for (int kx = -1; kx <= 1; ++kx) {
+            const double copy_x = x + kx * static_cast<double>(width);
+            if (copy_x + reach < 0. ||
+                copy_x - reach > static_cast<double>(width)) {
+              continue;
+            }
+            const point::Point offset(
+                kx * static_cast<double>(graphics::window_width),
+                ky * static_cast<double>(graphics::window_height));
+            boidTriangles(positions[i] + offset, velocities[i], size,
+                          style.stroke, sx, sy, shape, outline);
+            if (style.stroke > 0.f) {
+              fill(image, first, last, outline, outline_color);
+            }
+            fill(image, first, last, shape, fill_color);
+          }
+        }
+      }
+    };
+    if (!dense) draw(flock.getPreyPositions(), flock.getPreyVelocities(), true);
+    draw(flock.getPredatorPositions(), flock.getPredatorVelocities(), false);
+  });
+}
+
+// ---------- Encoder ----------
+
+Encoder::Encoder(std::string prefix, const Format format,
+                 const std::size_t n_threads, const std::size_t max_queued)
+    : prefix_(std::move(prefix)), format_{format}, max_queued_{max_queued} {
+  assert(n_threads > 0);
+  assert(max_queued > 0);
+  for (std::size_t t = 0; t < n_threads; ++t) {
+    encoders_.emplace_back([this] { encode(); });
+  }
+}
+
+Encoder::~Encoder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& encoder : encoders_) encoder.join();
+}
+
+// scratch holds the RGB rows of a PPM, reused from frame to frame
+bool Encoder::write(const Job& job, std::vector<std::uint8_t>& scratch) const {
+  const Image& image = job.image;
+  const std::string path = framePath(prefix_, job.frame, format_);
+  const std::size_t n = std::size_t{image.width} * image.height;
+
+  if (format_ == Format::png) {
+    sf::Image png;
+    png.create(image.width, image.height, image.pixels.data());
+    return png.saveToFile(path);
+  }
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (format_ == Format::ppm) {
+    file << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+    scratch.resize(3 * n);
+    for (std::size_t k = 0; k < n; ++k) {
+      scratch[3 * k] = image.pixels[4 * k];
+      scratch[3 * k + 1] = image.pixels[4 * k + 1];
+      scratch[3 * k + 2] = image.pixels[4 * k + 2];
+    }
+    file.write(reinterpret_cast<const char*>(scratch.data()),
+               static_cast<std::streamsize>(scratch.size()));
+  } else {
+    file.write(reinterpret_cast<const char*>(image.pixels.data()),
+               static_cast<std::streamsize>(4 * n));
+  }
+  return static_cast<bool>(file);
+}
+
+void Encoder::encode() {
+  std::vector<std::uint8_t> scratch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) break;  // stopping, and nothing left to write
+
+    Job job = std::move(queue_.front());
+    queue_.pop_front();
+    ++busy_;
+    done_.notify_all();
+
+    lock.unlock();
+    const bool ok = write(job, scratch);
+    lock.lock();
+
+    --busy_;
+    ++(ok ? written_ : failed_);
+    free_.push_back(std::move(job.image));
+    done_.notify_all();
+  }
+}
+
+Image Encoder::acquire() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_.empty()) return Image{};
+  Image image = std::move(free_.back());
+  free_.pop_back();
+  return image;
+}
+
+void Encoder::submit(Image&& image) {
+  assert(image.pixels.size() == 4 * std::size_t{image.width} * image.height);
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (queue_.size() >= max_queued_) {
+    ++stalls_;
+    done_.wait(lock, [this] { return queue_.size() < max_queued_; });
+  }
+  queue_.push_back({std::move(image), next_++});
+  wake_.notify_one();
+}
+
+void Encoder::flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return queue_.empty() && busy_ == 0; });
+}
+
+std::uint64_t Encoder::getWritten() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return written_;
+}
+
+std::uint64_t Encoder::getFailed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failed_;
+}
+
+std::size_t Encoder::getStalls() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stalls_;
+}
+
+}  // namespace offscreen
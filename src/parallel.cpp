@@ -0,0 +1,269 @@
+#include "../include/parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace parallel {
+
+namespace {
+// set while the thread is executing pool tasks, to detect nested runs
+thread_local bool in_task = false;
+
+// the CPUs the process may run on, in increasing order
+std::vector<std::size_t> allowedCpus() {
+  std::vector<std::size_t> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (std::size_t cpu = 0; cpu < std::size_t{CPU_SETSIZE}; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+  }
+#endif
+  return cpus;
+}
+
+// binds the calling thread to `cpu`; false where that is not supported
+bool pinTo(const std::size_t cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+}  // namespace
+
+// worker i goes to the i-th allowed CPU, wrapping around if there are more
+// workers than CPUs; the caller, slot 0, keeps the first one to itself as
+// long as there are enough
+ThreadPool::ThreadPool(const std::size_t n_threads, const bool pin)
+    : ranges_(n_threads), busy_time_(n_threads, 0.) {
+  assert(n_threads > 0);
+  const std::vector<std::size_t> cpus =
+      pin ? allowedCpus() : std::vector<std::size_t>{};
+  workers_.reserve(n_threads - 1);
+  for (std::size_t i = 1; i < n_threads; ++i) {
+    const bool pinning = !cpus.empty();
+    const std::size_t cpu = pinning ? cpus[i % cpus.size()] : 0;
+    workers_.emplace_back([this, i, pinning, cpu] {
+      if (pinning && pinTo(cpu)) ++pinned_;
+      work(i);
+    });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::size_t ThreadPool::size() const { return workers_.size() + 1; }
+
+std::size_t ThreadPool::getPinned() const { return pinned_; }
+
+// pops a task from the front of the range, or from its back when stealing
+bool ThreadPool::take(Range& range, const bool from_back, std::size_t& t) {
+  std::lock_guard<std::mutex> lock(range.mutex);
+  if (range.begin == range.end) return false;
+  t = from_back ? --range.end : range.begin++;
+  return true;
+}
+
+void ThreadPool::drain(const std::size_t slot) {
+  using clock = std::chrono::steady_clock;
+  double busy = 0.;
+  auto timed = [&](const std::size_t t) {
+    const auto start = clock::now();
+    (*task_)(t);
+    busy += std::chrono::duration<double>(clock::now() - start).count();
+  };
+
+  if (!costed_) {
+    for (std::size_t t = next_++; t < n_tasks_; t = next_++) timed(t);
+  } else {
+    std::size_t t;
+    while (take(ranges_[slot], false, t)) timed(t);
+    for (std::size_t k = 1; k < ranges_.size(); ++k) {
+      Range& victim = ranges_[(slot + k) % ranges_.size()];
+      while (take(victim, true, t)) {
+        ++steals_;
+        timed(t);
+      }
+    }
+  }
+
+  busy_time_[slot] = busy;
+}
+
+void ThreadPool::work(const std::size_t slot) {
+  in_task = true;
+  std::size_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) return;
+      seen = generation_;
+      ++joined_;
+      ++busy_;
+    }
+    drain(slot);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --busy_;
+    }
+    done_.notify_all();
+  }
+}
+
+// runs the tasks on the calling thread; returns the seconds it took
+double ThreadPool::serial(const std::size_t n_tasks,
+                          const std::function<void(std::size_t)>& task) {
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t t = 0; t < n_tasks; ++t) task(t);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// wakes the workers on the prepared run, takes part in it and waits for it
+// to end; the caller holds run_mutex_
+void ThreadPool::dispatch(const std::function<void(std::size_t)>& task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    next_ = 0;
+    joined_ = 0;
+    steals_ = 0;
+    ++generation_;
+  }
+  wake_.notify_all();
+
+  in_task = true;
+  drain(0);
+  in_task = false;
+
+  // the tasks have all been handed out: wait for the ones still running, and
+  // for every worker to have seen this generation, so that none of them can
+  // wake up late and read the task of the next run
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock,
+             [this] { return joined_ == workers_.size() && busy_ == 0; });
+  task_ = nullptr;
+  n_tasks_ = 0;
+}
+
+void ThreadPool::run(const std::size_t n_tasks,
+                     const std::function<void(std::size_t)>& task) {
+  if (n_tasks == 0) return;
+
+  std::unique_lock<std::mutex> driving(run_mutex_, std::defer_lock);
+  if (workers_.empty() || n_tasks == 1 || in_task || !driving.try_lock()) {
+    serial(n_tasks, task);
+    return;
+  }
+
+  n_tasks_ = n_tasks;
+  costed_ = false;
+  dispatch(task);
+}
+
+RunReport ThreadPool::run(const std::vector<double>& costs,
+                          const std::function<void(std::size_t)>& task) {
+  RunReport report;
+  run(costs, task, report);
+  return report;
+}
+
+// the ranges split the prefix sums of the costs evenly, so each thread
+// starts with about the same estimated work, in task order
+void ThreadPool::run(const std::vector<double>& costs,
+                     const std::function<void(std::size_t)>& task,
+                     RunReport& report) {
+  const std::size_t n_tasks = costs.size();
+
+  std::unique_lock<std::mutex> driving(run_mutex_, std::defer_lock);
+  if (workers_.empty() || n_tasks <= 1 || in_task || !driving.try_lock()) {
+    report.busy.assign(1, serial(n_tasks, task));
+    report.steals = 0;
+    return;
+  }
+
+  double total = 0.;
+  for (const double cost : costs) {
+    assert(cost >= 0);
+    total += cost;
+  }
+  // with no estimate at all, every task counts the same
+  auto cost = [&](const std::size_t t) { return total > 0 ? costs[t] : 1.; };
+  if (total == 0) total = static_cast<double>(n_tasks);
+
+  const std::size_t n_threads = ranges_.size();
+  double sum = 0.;
+  std::size_t t = 0;
+  for (std::size_t slot = 0; slot < n_threads; ++slot) {
+    const double share =
+        total * static_cast<double>(slot + 1) / static_cast<double>(n_threads);
+    ranges_[slot].begin = t;
+    // a task goes to the thread whose share holds its midpoint
+    while (t < n_tasks &&
+           (slot + 1 == n_threads || sum + cost(t) / 2 <= share)) {
+      sum += cost(t);
+      ++t;
+    }
+    ranges_[slot].end = t;
+  }
+
+  n_tasks_ = n_tasks;
+  costed_ = true;
+  dispatch(task);
+  report.busy = busy_time_;
+  report.steals = steals_;
+}
+
+namespace {
+std::mutex default_mutex;
+std::size_t default_threads = 0;  // 0: one per hardware thread
+bool default_pin = false;
+bool default_created = false;
+}  // namespace
+
+ThreadPool& defaultPool() {
+  static ThreadPool pool = [] {
+    std::lock_guard<std::mutex> lock(default_mutex);
+    default_created = true;
+    return ThreadPool(
+        default_threads > 0
+            ? default_threads
+            : std::max<std::size_t>(1, std::thread::hardware_concurrency()),
+        default_pin);
+  }();
+  return pool;
+}
+
+bool configureDefaultPool(const std::size_t n_threads, const bool pin) {
+  std::lock_guard<std::mutex> lock(default_mutex);
+  if (default_created) return false;
+  default_threads = n_threads;
+  default_pin = pin;
+  return true;
+}
+
+}  // namespace parallel
@@ -0,0 +1,231 @@
+#include "../include/recorder.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iomanip>
+#include <utility>
+
+namespace recorder {
+
+namespace {
+
+constexpr char magic[] = "BOIDCOL1";
+constexpr std::size_t magic_size = sizeof(magic) - 1;
+
+void writeU32(std::ofstream& out, const std::uint32_t value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool readU32(std::ifstream& in, std::uint32_t& value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// bytes from the read position to the end of `size` bytes
+std::uint64_t left(std::ifstream& in, const std::uint64_t size) {
+  return size - static_cast<std::uint64_t>(in.tellg());
+}
+
+}  // namespace
+
+Recorder::Recorder(const std::string& path, std::vector<std::string> columns,
+                   const std::size_t chunk_rows, const std::size_t max_queued,
+                   const Overflow overflow)
+    : file_(path, std::ios::binary | std::ios::trunc),
+      columns_(std::move(columns)),
+      chunk_rows_{chunk_rows},
+      max_queued_{max_queued},
+      overflow_{overflow} {
+  assert(!columns_.empty());
+  assert(chunk_rows > 0);
+  assert(max_queued > 0);
+
+  current_.values.resize(columns_.size() * chunk_rows_);
+  if (!file_) return;
+
+  file_.write(magic, magic_size);
+  writeU32(file_, static_cast<std::uint32_t>(columns_.size()));
+  for (const auto& name : columns_) {
+    writeU32(file_, static_cast<std::uint32_t>(name.size()));
+    file_.write(name.data(), static_cast<std::streamsize>(name.size()));
+  }
+  failed_ = !file_.flush();
+
+  writer_ = std::thread([this] { write(); });
+}
+
+Recorder::~Recorder() {
+  if (!writer_.joinable()) return;
+  {
+    // at shutdown the last rows are queued even if the queue is full
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_.rows > 0) queue_.push_back(std::move(current_));
+    stop_ = true;
+  }
+  wake_.notify_all();
+  writer_.join();
+}
+
+bool Recorder::isOpen() const { return writer_.joinable(); }
+
+const std::vector<std::string>& Recorder::getColumns() const {
+  return columns_;
+}
+
+std::size_t Recorder::getDropped() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dropped_;
+}
+
+std::size_t Recorder::getStalls() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stalls_;
+}
+
+std::uint64_t Recorder::getWritten() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return written_;
+}
+
+bool Recorder::hasFailed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failed_;
+}
+
+// flushed, so that a failing disk shows up at the chunk it fails
+bool Recorder::writeChunk(const Chunk& chunk) {
+  writeU32(file_, static_cast<std::uint32_t>(chunk.rows));
+  for (std::size_t c = 0; c < columns_.size(); ++c) {
+    file_.write(reinterpret_cast<const char*>(chunk.values.data() +
+                                              c * chunk_rows_),
+                static_cast<std::streamsize>(chunk.rows * sizeof(double)));
+  }
+  return static_cast<bool>(file_.flush());
+}
+
+void Recorder::write() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) break;  // stopping, and nothing left to write
+
+    Chunk chunk = std::move(queue_.front());
+    queue_.pop_front();
+    writing_ = true;
+    const bool failed = failed_;
+
+    lock.unlock();
+    const bool ok = !failed && writeChunk(chunk);
+    lock.lock();
+
+    writing_ = false;
+    if (ok) {
+      written_ += chunk.rows;
+    } else {
+      failed_ = true;
+    }
+    chunk.rows = 0;
+    free_.push_back(std::move(chunk));
+    wake_.notify_all();
+  }
+}
+
+// hands the current chunk to the writer. With the queue full it waits for
+// the writer, unless the recorder drops chunks and this one may be dropped
+void Recorder::submit(const bool lossless) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const bool full = queue_.size() >= max_queued_;
+  if (full && !lossless && overflow_ == Overflow::drop) {
+    dropped_ += current_.rows;
+  } else {
+    if (full) {
+      ++stalls_;
+      wake_.wait(lock, [this] { return queue_.size() < max_queued_; });
+    }
+    queue_.push_back(std::move(current_));
+    wake_.notify_all();
+  }
+
+  if (!free_.empty()) {
+    current_ = std::move(free_.back());
+    free_.pop_back();
+  } else {
+    current_ = Chunk{};
+    current_.values.resize(columns_.size() * chunk_rows_);
+  }
+  current_.rows = 0;
+}
+
+void Recorder::record(const std::vector<double>& row) {
+  assert(row.size() == columns_.size());
+  if (!isOpen()) return;
+
+  for (std::size_t c = 0; c < columns_.size(); ++c) {
+    current_.values[c * chunk_rows_ + current_.rows] = row[c];
+  }
+  if (++current_.rows == chunk_rows_) submit(false);
+}
+
+// submits the rows gathered so far, whatever the overflow policy, and
+// waits for the writer to catch up
+void Recorder::flush() {
+  if (!isOpen()) return;
+  if (current_.rows > 0) submit(true);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  wake_.wait(lock, [this] { return queue_.empty() && !writing_; });
+}
+
+bool toCsv(const std::string& binary_path, const std::string& csv_path) {
+  std::ifstream in(binary_path, std::ios::binary | std::ios::ate);
+  if (!in) return false;
+  const auto size = static_cast<std::uint64_t>(in.tellg());
+  in.seekg(0);
+  char header[magic_size];
+  if (!in.read(header, magic_size) ||
+      std::memcmp(header, magic, magic_size) != 0) {
+    return false;
+  }
+
+  std::uint32_t n_columns;
+  if (!readU32(in, n_columns) || n_columns == 0 ||
+      n_columns > left(in, size) / sizeof(std::uint32_t)) {
+    return false;
+  }
+  std::vector<std::string> columns(n_columns);
+  for (auto& name : columns) {
+    std::uint32_t length;
+    if (!readU32(in, length) || length > left(in, size)) return false;
+    name.resize(length);
+    if (!in.read(name.data(), length)) return false;
+  }
+
+  std::ofstream out(csv_path, std::ios::trunc);
+  if (!out) return false;
+  for (std::size_t c = 0; c < columns.size(); ++c) {
+    out << (c > 0 ? "," : "") << columns[c];
+  }
+  out << '\n' << std::setprecision(17);
+
+  std::vector<double> values;
+  std::uint32_t rows;
+  while (readU32(in, rows)) {
+    if (rows > left(in, size) / sizeof(double) / n_columns) return false;
+    values.resize(std::size_t{rows} * n_columns);
+    if (!in.read(reinterpret_cast<char*>(values.data()),
+                 static_cast<std::streamsize>(values.size() *
+                                              sizeof(double)))) {
+      return false;
+    }
+    for (std::size_t r = 0; r < rows; ++r) {
+      for (std::size_t c = 0; c < n_columns; ++c) {
+        out << (c > 0 ? "," : "") << values[c * rows + r];
+      }
+      out << '\n';
+    }
+  }
+
+  return static_cast<bool>(out);
+}
+
+}  // namespace recorder
@@ -0,0 +1,178 @@
+#include "../include/settings.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace settings {
+
+namespace {
+
+std::string trim(const std::string& s) {
+  const auto first = s.find_first_not_of(" \t\r");
+  if (first == std::string::npos) return "";
+  const auto last = s.find_last_not_of(" \t\r");
+  return s.substr(first, last - first + 1);
+}
+
+double number(const std::string& key, const std::string& text) {
+  std::size_t used = 0;
+  double value = 0.;
+  try {
+    value = std::stod(text, &used);
+  } catch (const std::exception&) {
+    used = 0;
+  }
+  if (used == 0 || used != text.size() || !std::isfinite(value)) {
+    throw std::invalid_argument(key + ": '" + text + "' is not a number");
+  }
+  return value;
+}
+
+std::uint64_t count(const std::string& key, const std::string& text,
+                    const std::uint64_t max) {
+  const double value = number(key, text);
+  if (value < 0 || value != std::floor(value) ||
+      value > static_cast<double>(max)) {
+    throw std::invalid_argument(key + ": '" + text + "' is out of range");
+  }
+  return static_cast<std::uint64_t>(value);
+}
+
+}  // namespace
+
+void apply(Settings& settings, const std::string& key,
+           const std::string& value) {
+  if (key == "seed") {
+    settings.seed = static_cast<std::uint32_t>(
+        count(key, value, std::numeric_limits<std::uint32_t>::max()));
+  } else if (key == "coast_tolerance") {
+    const double tolerance = number(key, value);
+    if (tolerance < 0) {
+      throw std::invalid_argument(key + ": '" + value + "' is out of range");
+    }
+    settings.coast_tolerance = tolerance;
+  } else if (key == "threads") {
+    settings.threads = static_cast<std::size_t>(count(key, value, 1024));
+  } else if (key == "pin") {
+    settings.pin = count(key, value, 1) == 1;
+  } else if (key == "tiles") {
+    try {
+      settings.tiles = tiles::parseLayout(value);
+    } catch (const std::invalid_argument& e) {
+      throw std::invalid_argument(key + ": " + e.what());
+    }
+  } else if (key == "record") {
+    settings.record = value;
+  } else if (key == "background") {
+    settings.background = value;
+  } else if (key == "obstacles") {
+    settings.obstacles = value;
+  } else if (key == "lod_density") {
+    const double density = number(key, value);
+    if (density < 0) {
+      throw std::invalid_argument(key + ": '" + value + "' is out of range");
+    }
+    settings.lod_density = density;
+  } else if (key == "frames") {
+    settings.frames = value;
+  } else if (key == "frame_format") {
+    try {
+      settings.frame_format = offscreen::parseFormat(value);
+    } catch (const std::invalid_argument& e) {
+      throw std::invalid_argument(key + ": " + e.what());
+    }
+  } else if (key == "frame_count") {
+    settings.frame_count = static_cast<std::size_t>(
+        count(key, value, std::numeric_limits<std::uint32_t>::max()));
+  } else {
+    const auto& names = ensemble::parameterNames();
+    if (std::find(names.begin(), names.end(), key) == names.end()) {
+      throw std::invalid_argument("unknown setting '" + key + "'");
+    }
+    if (key == "n_prey" || key == "n_predators") {
+      count(key, value, std::numeric_limits<std::uint32_t>::max());
+    }
+    ensemble::set(settings.flock, key, number(key, value));
+    if (key == "repulsion") settings.derive_repulsion = false;
+    if (key == "chase") settings.derive_chase = false;
+    settings.interactive = false;
+  }
+}
+
+void read(Settings& settings, std::istream& in, const std::string& source) {
+  std::string text;
+  std::size_t line = 0;
+  while (std::getline(in, text)) {
+    ++line;
+    text = trim(text.substr(0, text.find('#')));
+    if (text.empty()) continue;
+
+    const std::string where = source + ":" + std::to_string(line) + ": ";
+    const auto equal = text.find('=');
+    if (equal == std::string::npos) {
+      throw std::runtime_error(where + "expected key = value");
+    }
+    try {
+      apply(settings, trim(text.substr(0, equal)),
+            trim(text.substr(equal + 1)));
+    } catch (const std::invalid_argument& e) {
+      throw std::runtime_error(where + e.what());
+    }
+  }
+}
+
+Settings load(const std::vector<std::string>& args) {
+  Settings settings;
+
+  std::vector<std::pair<std::string, std::string>> overrides;
+  for (std::size_t i = 0; i < args.size(); ++i) {
+    const std::string& arg = args[i];
+    if (arg.rfind("--", 0) != 0 || arg.size() == 2) {
+      throw std::runtime_error("unexpected argument '" + arg + "'");
+    }
+    std::string key = arg.substr(2);
+    std::string value;
+    const auto equal = key.find('=');
+    if (equal != std::string::npos) {
+      value = key.substr(equal + 1);
+      key = key.substr(0, equal);
+    } else if (i + 1 < args.size()) {
+      value = args[++i];
+    } else {
+      throw std::runtime_error(arg + " needs a value");
+    }
+
+    if (key == "config") {
+      std::ifstream file(value);
+      if (!file) throw std::runtime_error("cannot open " + value);
+      read(settings, file, value);
+    } else {
+      overrides.emplace_back(key, value);
+    }
+  }
+
+  for (const auto& [key, value] : overrides) {
+    try {
+      apply(settings, key, value);
+    } catch (const std::invalid_argument& e) {
+      throw std::runtime_error(std::string("command line: ") + e.what());
+    }
+  }
+
+  auto& flight = settings.flock.flight_parameters;
+  if (settings.derive_repulsion) flight.repulsion = 6 * flight.separation;
+  if (settings.derive_chase) flight.chase = 2 * flight.cohesion;
+  try {
+    ensemble::validate(settings.flock);
+  } catch (const std::invalid_argument& e) {
+    throw std::runtime_error(e.what());
+  }
+
+  return settings;
+}
+
+}  // namespace settings
@@ -1,12 +1,27 @@
 #include "../include/statistics.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <utility>
+
+#include "../include/grid.hpp"
+#include "../include/parallel.hpp"
+#include "../include/point.hpp"
+
 namespace statistics {
 
 Statistics::Statistics()
     : mean_distance{0.},
       dev_distance{0.},
       mean_velocity{0.},
-      dev_velocity{0.} {}
+      dev_velocity{0.},
+      n_clusters{0},
+      largest_cluster{0} {}
 
 Statistics::Statistics(const double mean_dist, const double dev_dist,
                        const double mean_vel, const double dev_vel)
@@ -14,5 +29,395 @@ Statistics::Statistics(const double mean_dist, const double dev_dist,
     : mean_distance{mean_dist},
       dev_distance{dev_dist},
       mean_velocity{mean_vel},
-      dev_velocity{dev_vel} {}
+      dev_velocity{dev_vel},
+      n_clusters{0},
+      largest_cluster{0} {}
+
+// ---------- Accumulator ----------
+
+std::size_t Accumulator::getCount() const { return count_; }
+double Accumulator::getMean() const { return mean_; }
+
+double Accumulator::getVariance() const {
+  return count_ == 0 ? 0. : m2_ / static_cast<double>(count_);
+}
+
+double Accumulator::getDeviation() const { return std::sqrt(getVariance()); }
+
+void Accumulator::add(const double x) {
+  ++count_;
+  const double delta = x - mean_;
+  mean_ += delta / static_cast<double>(count_);
+  m2_ += delta * (x - mean_);
+}
+
+// two passes over the block (mean, then squared deviations) and a single
+// merge: no division per value and both loops vectorize
+void Accumulator::addBlock(const double* values, const std::size_t n) {
+  if (n == 0) return;
+
+  double sum = 0.;
+  for (std::size_t k = 0; k < n; ++k) sum += values[k];
+  Accumulator block;
+  block.count_ = n;
+  block.mean_ = sum / static_cast<double>(n);
+  for (std::size_t k = 0; k < n; ++k) {
+    const double delta = values[k] - block.mean_;
+    block.m2_ += delta * delta;
+  }
+
+  merge(block);
+}
+
+void Accumulator::merge(const Accumulator& other) {
+  if (other.count_ == 0) return;
+  if (count_ == 0) {
+    *this = other;
+    return;
+  }
+
+  const auto n_a = static_cast<double>(count_);
+  const auto n_b = static_cast<double>(other.count_);
+  const double n = n_a + n_b;
+  const double delta = other.mean_ - mean_;
+
+  mean_ += delta * n_b / n;
+  m2_ += other.m2_ + delta * delta * n_a * n_b / n;
+  count_ += other.count_;
+}
+
+// ---------- Summary ----------
+
+void Summary::add(const Statistics& stats) {
+  mean_distance.add(stats.mean_distance);
+  dev_distance.add(stats.dev_distance);
+  mean_velocity.add(stats.mean_velocity);
+  dev_velocity.add(stats.dev_velocity);
+  n_clusters.add(static_cast<double>(stats.n_clusters));
+  largest_cluster.add(static_cast<double>(stats.largest_cluster));
+}
+
+void Summary::merge(const Summary& other) {
+  mean_distance.merge(other.mean_distance);
+  dev_distance.merge(other.dev_distance);
+  mean_velocity.merge(other.mean_velocity);
+  dev_velocity.merge(other.dev_velocity);
+  n_clusters.merge(other.n_clusters);
+  largest_cluster.merge(other.largest_cluster);
+}
+
+// ---------- Series ----------
+
+Series::Series(const std::size_t capacity) : frames_(capacity) {
+  assert(capacity > 0);
+}
+
+std::size_t Series::size() const { return size_; }
+std::size_t Series::capacity() const { return frames_.size(); }
+
+const Statistics& Series::operator[](const std::size_t i) const {
+  assert(i < size_);
+  return frames_[(head_ + frames_.size() - size_ + i) % frames_.size()];
+}
+
+void Series::push(const Statistics& stats) {
+  frames_[head_] = stats;
+  head_ = (head_ + 1) % frames_.size();
+  size_ = std::min(size_ + 1, frames_.size());
+  total_.add(stats);
+}
+
+Summary Series::window() const {
+  Summary summary;
+  for (std::size_t i = 0; i < size_; ++i) {
+    summary.add((*this)[i]);
+  }
+  return summary;
+}
+
+const Summary& Series::total() const { return total_; }
+
+// ---------- Histogram ----------
+
+Histogram::Histogram(const double max, const std::size_t n_bins)
+    : max_{max}, counts_(n_bins, 0) {
+  assert(max > 0);
+  assert(n_bins > 0);
+}
+
+double Histogram::getMax() const { return max_; }
+
+double Histogram::getBinWidth() const {
+  return max_ / static_cast<double>(counts_.size());
+}
+
+const std::vector<std::size_t>& Histogram::getCounts() const {
+  return counts_;
+}
+
+std::size_t Histogram::getOverflow() const { return overflow_; }
+
+std::size_t Histogram::getTotal() const {
+  return std::accumulate(counts_.begin(), counts_.end(), overflow_);
+}
+
+void Histogram::add(const double x) {
+  assert(x >= 0);
+  if (x >= max_) {
+    ++overflow_;
+    return;
+  }
+  const auto bin = static_cast<std::size_t>(x / getBinWidth());
+  ++counts_[std::min(bin, counts_.size() - 1)];
+}
+
+void Histogram::merge(const Histogram& other) {
+  assert(other.counts_.size() == counts_.size());
+  for (std::size_t k = 0; k < counts_.size(); ++k) {
+    counts_[k] += other.counts_[k];
+  }
+  overflow_ += other.overflow_;
+}
+
+Structure::Structure(const double cutoff, const std::size_t n_bins)
+    : pair_distances{cutoff, n_bins},
+      rdf(n_bins, 0.),
+      nearest{cutoff, n_bins},
+      polarization{0.} {}
+
+namespace {
+
+// two tiles of x and y fit comfortably in L1
+constexpr std::size_t tile_size = 256;
+
+// union-find safe to share between threads: roots are only ever linked to a
+// smaller root with a compare-and-swap, and finds halve the paths they walk
+class DisjointSets {
+ private:
+  std::vector<std::atomic<std::size_t>> parent_;
+
+ public:
+  explicit DisjointSets(const std::size_t n) : parent_(n) {
+    for (std::size_t i = 0; i < n; ++i) parent_[i] = i;
+  }
+
+  std::size_t find(std::size_t x) {
+    while (true) {
+      std::size_t p = parent_[x];
+      if (p == x) return x;
+      const std::size_t gp = parent_[p];
+      parent_[x].compare_exchange_weak(p, gp);
+      x = gp;
+    }
+  }
+
+  void unite(std::size_t a, std::size_t b) {
+    while (true) {
+      a = find(a);
+      b = find(b);
+      if (a == b) return;
+      if (a < b) std::swap(a, b);
+      std::size_t expected = a;
+      if (parent_[a].compare_exchange_strong(expected, b)) return;
+    }
+  }
+};
+
+Accumulator tileDistances(const std::vector<double>& x,
+                          const std::vector<double>& y, const std::size_t i0,
+                          const std::size_t i1, const std::size_t j0,
+                          const std::size_t j1, const double width,
+                          const double height) {
+  std::array<double, tile_size> dist;
+  Accumulator tile;
+
+  for (std::size_t i = i0; i < i1; ++i) {
+    const std::size_t first = std::max(j0, i + 1);
+    if (first >= j1) continue;
+    const std::size_t m = j1 - first;
+    const double xi = x[i];
+    const double yi = y[i];
+    const double* xj = x.data() + first;
+    const double* yj = y.data() + first;
+
+    for (std::size_t k = 0; k < m; ++k) {
+      const double dx = point::wrap(xj[k] - xi, width);
+      const double dy = point::wrap(yj[k] - yi, height);
+      dist[k] = std::sqrt(dx * dx + dy * dy);
+    }
+    tile.addBlock(dist.data(), m);
+  }
+
+  return tile;
+}
+
+}  // namespace
+
+template <class Points>
+std::vector<std::size_t> clusters(const Points& positions,
+                                  const grid::Index& index, const double radius,
+                                  parallel::ThreadPool& pool) {
+  const std::size_t n = positions.size();
+  DisjointSets sets(n);
+  constexpr std::size_t chunk_size = 1024;
+  pool.run((n + chunk_size - 1) / chunk_size, [&](const std::size_t c) {
+    std::vector<std::size_t> candidates;
+    const std::size_t last = std::min(n, (c + 1) * chunk_size);
+    for (std::size_t i = c * chunk_size; i < last; ++i) {
+      index.queryAround(positions[i], radius, candidates);
+      for (const std::size_t j : candidates) {
+        if (j > i &&
+            point::toroidalDistance(positions[i], positions[j]) < radius) {
+          sets.unite(i, j);
+        }
+      }
+    }
+  });
+
+  std::vector<std::size_t> size(n, 0);
+  for (std::size_t i = 0; i < n; ++i) {
+    ++size[sets.find(i)];
+  }
+  size.erase(std::remove(size.begin(), size.end(), 0), size.end());
+  std::sort(size.begin(), size.end(), std::greater<>());
+  return size;
+}
+
+std::vector<std::size_t> clusters(const std::vector<point::Point>& positions,
+                                  const double width, const double height,
+                                  const double radius,
+                                  parallel::ThreadPool& pool) {
+  grid::Index index(width, height);
+  index.tune(radius, positions.size());
+  index.build(positions);
+  return clusters(positions, index, radius, pool);
+}
+
+Accumulator pairDistances(const std::vector<double>& x,
+                          const std::vector<double>& y, const double width,
+                          const double height, parallel::ThreadPool& pool) {
+  assert(x.size() == y.size());
+  const std::size_t n = x.size();
+  const std::size_t n_blocks = (n + tile_size - 1) / tile_size;
+
+  std::vector<std::pair<std::size_t, std::size_t>> tiles;
+  tiles.reserve(n_blocks * (n_blocks + 1) / 2);
+  for (std::size_t bi = 0; bi < n_blocks; ++bi) {
+    for (std::size_t bj = bi; bj < n_blocks; ++bj) {
+      tiles.emplace_back(bi, bj);
+    }
+  }
+
+  std::vector<Accumulator> partial(tiles.size());
+  pool.run(tiles.size(), [&](const std::size_t t) {
+    const auto [bi, bj] = tiles[t];
+    partial[t] = tileDistances(
+        x, y, bi * tile_size, std::min(n, (bi + 1) * tile_size),
+        bj * tile_size, std::min(n, (bj + 1) * tile_size), width, height);
+  });
+
+  Accumulator pairs;
+  for (const auto& p : partial) {
+    pairs.merge(p);
+  }
+  return pairs;
+}
+
+template <class Points>
+Structure structure(const Points& positions, const Points& velocities,
+                    const grid::Index& index, const double cutoff,
+                    const std::size_t n_bins, parallel::ThreadPool& pool) {
+  const double width = index.getGrid().getWidth();
+  const double height = index.getGrid().getHeight();
+  assert(positions.size() == velocities.size());
+  assert(cutoff > 0 && cutoff <= std::min(width, height) / 2.);
+  const std::size_t n = positions.size();
+
+  // per chunk: pair and nearest-neighbour histograms, sum of the headings
+  struct Partial {
+    Structure structure;
+    point::Point heading;
+  };
+  constexpr std::size_t chunk_size = 512;
+  const std::size_t n_chunks = (n + chunk_size - 1) / chunk_size;
+  std::vector<Partial> partial(
+      n_chunks, Partial{Structure(cutoff, n_bins), point::Point(0., 0.)});
+
+  pool.run(n_chunks, [&](const std::size_t c) {
+    Partial& part = partial[c];
+    std::vector<std::size_t> candidates;
+
+    const std::size_t last = std::min(n, (c + 1) * chunk_size);
+    for (std::size_t i = c * chunk_size; i < last; ++i) {
+      index.queryAround(positions[i], cutoff, candidates);
+      double nearest = cutoff;
+      for (const std::size_t j : candidates) {
+        if (j == i) continue;
+        const double dist = point::toroidalDistance(positions[i], positions[j]);
+        if (dist >= cutoff) continue;
+        nearest = std::min(nearest, dist);
+        if (j > i) part.structure.pair_distances.add(dist);
+      }
+      part.structure.nearest.add(nearest);
+
+      const double speed = velocities[i].distance();
+      if (speed > 0.) part.heading += velocities[i] / speed;
+    }
+  });
+
+  Structure result(cutoff, n_bins);
+  point::Point heading;
+  for (const auto& part : partial) {
+    result.pair_distances.merge(part.structure.pair_distances);
+    result.nearest.merge(part.structure.nearest);
+    heading += part.heading;
+  }
+  if (n > 0) result.polarization = heading.distance() / static_cast<double>(n);
+
+  // g(r): pairs found in each shell over the pairs an ideal gas of the same
+  // density would put there
+  const auto n_boids = static_cast<double>(n);
+  const double n_pairs = n_boids * (n_boids - 1.) / 2.;
+  const double bin = result.pair_distances.getBinWidth();
+  for (std::size_t k = 0; k < n_bins; ++k) {
+    const double r0 = bin * static_cast<double>(k);
+    const double r1 = r0 + bin;
+    const double expected =
+        n_pairs * M_PI * (r1 * r1 - r0 * r0) / (width * height);
+    result.rdf[k] =
+        expected > 0.
+            ? static_cast<double>(result.pair_distances.getCounts()[k]) /
+                  expected
+            : 0.;
+  }
+
+  return result;
+}
+
+Structure structure(const std::vector<point::Point>& positions,
+                    const std::vector<point::Point>& velocities,
+                    const double width, const double height,
+                    const double cutoff, const std::size_t n_bins,
+                    parallel::ThreadPool& pool) {
+  grid::Index index(width, height);
+  index.tune(cutoff, positions.size());
+  index.build(positions);
+  return structure(positions, velocities, index, cutoff, n_bins, pool);
+}
+
+template std::vector<std::size_t> clusters(const std::vector<point::Point>&,
+                                           const grid::Index&, double,
+                                           parallel::ThreadPool&);
+template std::vector<std::size_t> clusters(
+    const parallel::FirstTouchVector<point::Point>&, const grid::Index&,
+    double, parallel::ThreadPool&);
+template Structure structure(const std::vector<point::Point>&,
+                             const std::vector<point::Point>&,
+                             const grid::Index&, double, std::size_t,
+                             parallel::ThreadPool&);
+template Structure structure(const parallel::FirstTouchVector<point::Point>&,
+                             const parallel::FirstTouchVector<point::Point>&,
+                             const grid::Index&, double, std::size_t,
+                             parallel::ThreadPool&);
+
 }  // namespace statistics
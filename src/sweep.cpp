@@ -0,0 +1,386 @@
+#include "../include/sweep.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "../include/statistics.hpp"
+
+namespace sweep {
+
+namespace {
+
+std::string trim(const std::string& s) {
+  const auto first = s.find_first_not_of(" \t\r");
+  if (first == std::string::npos) return "";
+  const auto last = s.find_last_not_of(" \t\r");
+  return s.substr(first, last - first + 1);
+}
+
+std::runtime_error lineError(const std::size_t line, const std::string& what) {
+  return std::runtime_error("line " + std::to_string(line) + ": " + what);
+}
+
+double number(const std::string& text, const std::size_t line) {
+  std::size_t used = 0;
+  double value = 0.;
+  try {
+    value = std::stod(text, &used);
+  } catch (const std::exception&) {
+    used = 0;
+  }
+  if (used == 0 || used != text.size() || !std::isfinite(value)) {
+    throw lineError(line, "'" + text + "' is not a number");
+  }
+  return value;
+}
+
+std::size_t count(const std::string& text, const std::size_t line) {
+  const double value = number(text, line);
+  if (value < 0 || value != std::floor(value) ||
+      value >= static_cast<double>(std::numeric_limits<std::size_t>::max())) {
+    throw lineError(line, "'" + text + "' is not a count");
+  }
+  return static_cast<std::size_t>(value);
+}
+
+// configuration c runs with seed spec.seed + c, which must not wrap around
+void checkSeeds(const Spec& spec, const std::size_t n_configs) {
+  const std::uint32_t max = std::numeric_limits<std::uint32_t>::max();
+  if (n_configs > 0 && n_configs - 1 > max - spec.seed) {
+    throw std::runtime_error(
+        "seed " + std::to_string(spec.seed) + " leaves room for " +
+        std::to_string(std::size_t{max - spec.seed} + 1) +
+        " configurations, not " + std::to_string(n_configs));
+  }
+}
+
+void validate(const ensemble::Config& config, const std::size_t index) {
+  try {
+    ensemble::validate(config);
+  } catch (const std::invalid_argument& e) {
+    throw std::runtime_error("configuration " + std::to_string(index) + ": " +
+                             e.what());
+  }
+}
+
+const std::vector<std::string>& statisticNames() {
+  static const std::vector<std::string> names{
+      "mean_distance", "dev_distance", "mean_velocity",
+      "dev_velocity",  "n_clusters",   "largest_cluster"};
+  return names;
+}
+
+std::string header(const Spec& spec) {
+  std::string line = "config";
+  for (const auto& axis : spec.axes) line += "," + axis.name;
+  for (const auto& name : statisticNames()) {
+    line += "," + name + "_mean," + name + "_dev";
+  }
+  return line;
+}
+
+// everything that decides the rows of a sweep, as text, hashed (64-bit
+// FNV-1a): results are only resumed by the spec that wrote them
+std::string fingerprint(const Spec& spec) {
+  std::ostringstream text;
+  text << std::setprecision(17);
+  for (const auto& name : ensemble::parameterNames()) {
+    text << name << '=' << ensemble::get(spec.base, name) << ';';
+  }
+  for (const auto& axis : spec.axes) {
+    text << axis.name << ':' << axis.lo << ':' << axis.hi << ':'
+         << axis.levels << ';';
+  }
+  text << static_cast<int>(spec.design) << ';' << spec.samples << ';'
+       << spec.seed << ';' << spec.steps << ';' << spec.warmup << ';'
+       << spec.sample_every << ';' << spec.dt << ';' << spec.derive_repulsion
+       << spec.derive_chase;
+
+  std::uint64_t hash = 14695981039346656037ull;
+  for (const char c : text.str()) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  std::ostringstream line;
+  line << "# sweep " << std::hex << std::setw(16) << std::setfill('0')
+       << hash;
+  return line.str();
+}
+
+// the configuration of a row of results, if every one of its n_fields
+// fields is a number and the first one a configuration below n_configs
+bool parseRow(const std::string& line, const std::size_t n_fields,
+              const std::size_t n_configs, std::size_t& config) {
+  std::stringstream fields(line);
+  std::size_t n = 0;
+  for (std::string field; std::getline(fields, field, ',');) {
+    std::size_t used = 0;
+    double value = 0.;
+    try {
+      value = std::stod(field, &used);
+    } catch (const std::exception&) {
+      return false;
+    }
+    if (used != field.size()) return false;
+    if (n == 0) {
+      if (value < 0 || value != std::floor(value) ||
+          value >= static_cast<double>(n_configs)) {
+        return false;
+      }
+      config = static_cast<std::size_t>(value);
+    }
+    ++n;
+  }
+  return n == n_fields && !line.empty() && line.back() != ',';
+}
+
+}  // namespace
+
+Spec parseSpec(std::istream& in) {
+  Spec spec;
+  std::string text;
+  std::size_t line = 0;
+  while (std::getline(in, text)) {
+    ++line;
+    text = trim(text.substr(0, text.find('#')));
+    if (text.empty()) continue;
+
+    const auto equal = text.find('=');
+    if (equal == std::string::npos) {
+      throw lineError(line, "expected key = value");
+    }
+    const std::string key = trim(text.substr(0, equal));
+    const std::string value = trim(text.substr(equal + 1));
+
+    if (key == "design") {
+      if (value == "grid") {
+        spec.design = Design::grid;
+      } else if (value == "lhs") {
+        spec.design = Design::latin_hypercube;
+      } else {
+        throw lineError(line, "design must be grid or lhs");
+      }
+    } else if (key == "samples") {
+      spec.samples = count(value, line);
+    } else if (key == "seed") {
+      const std::size_t seed = count(value, line);
+      if (seed > std::numeric_limits<std::uint32_t>::max()) {
+        throw lineError(line, "seed '" + value + "' does not fit in 32 bits");
+      }
+      spec.seed = static_cast<std::uint32_t>(seed);
+    } else if (key == "steps") {
+      spec.steps = count(value, line);
+    } else if (key == "warmup") {
+      spec.warmup = count(value, line);
+    } else if (key == "sample_every") {
+      spec.sample_every = count(value, line);
+    } else if (key == "dt") {
+      spec.dt = number(value, line);
+    } else {
+      const auto& names = ensemble::parameterNames();
+      if (std::find(names.begin(), names.end(), key) == names.end()) {
+        throw lineError(line, "unknown key '" + key + "'");
+      }
+      if (key == "repulsion") spec.derive_repulsion = false;
+      if (key == "chase") spec.derive_chase = false;
+
+      std::vector<std::string> parts;
+      std::stringstream fields(value);
+      for (std::string part; std::getline(fields, part, ':');) {
+        parts.push_back(trim(part));
+      }
+      if (parts.size() == 1) {
+        ensemble::set(spec.base, key, number(parts[0], line));
+      } else if (parts.size() == 2 || parts.size() == 3) {
+        Axis axis{key, number(parts[0], line), number(parts[1], line),
+                  parts.size() == 3 ? count(parts[2], line) : 0};
+        if (axis.lo > axis.hi) throw lineError(line, "lo is above hi");
+        spec.axes.push_back(axis);
+      } else {
+        throw lineError(line, "expected a value or lo:hi[:levels]");
+      }
+    }
+  }
+
+  if (spec.dt <= 0) throw std::runtime_error("dt must be positive");
+  if (spec.sample_every == 0) {
+    throw std::runtime_error("sample_every must be positive");
+  }
+  if (spec.steps < spec.warmup + spec.sample_every) {
+    throw std::runtime_error("no statistics would be sampled after warmup");
+  }
+  if (spec.design == Design::grid) {
+    for (const auto& axis : spec.axes) {
+      if (axis.levels == 0) {
+        throw std::runtime_error("axis " + axis.name +
+                                 " needs lo:hi:levels in a grid");
+      }
+    }
+  } else if (spec.samples == 0) {
+    throw std::runtime_error("a Latin hypercube needs samples");
+  }
+  return spec;
+}
+
+// the grid varies the last axis fastest; the Latin hypercube splits every
+// axis in `samples` strata and draws one value in each, pairing the strata
+// of the axes at random
+std::vector<ensemble::Config> configurations(const Spec& spec) {
+  std::vector<ensemble::Config> configs;
+
+  if (spec.design == Design::grid) {
+    std::size_t total = 1;
+    for (const auto& axis : spec.axes) total *= axis.levels;
+    checkSeeds(spec, total);
+    configs.assign(total, spec.base);
+
+    std::size_t stride = total;
+    for (const auto& axis : spec.axes) {
+      stride /= axis.levels;
+      for (std::size_t c = 0; c < total; ++c) {
+        const std::size_t level = c / stride % axis.levels;
+        const double t =
+            axis.levels == 1 ? 0.
+                             : static_cast<double>(level) /
+                                   static_cast<double>(axis.levels - 1);
+        ensemble::set(configs[c], axis.name, axis.lo + t * (axis.hi - axis.lo));
+      }
+    }
+  } else {
+    checkSeeds(spec, spec.samples);
+    configs.assign(spec.samples, spec.base);
+    std::mt19937 mt{spec.seed};
+    std::uniform_real_distribution<> unit(0., 1.);
+    std::vector<std::size_t> strata(spec.samples);
+    for (const auto& axis : spec.axes) {
+      std::iota(strata.begin(), strata.end(), 0);
+      std::shuffle(strata.begin(), strata.end(), mt);
+      for (std::size_t c = 0; c < spec.samples; ++c) {
+        const double t = (static_cast<double>(strata[c]) + unit(mt)) /
+                         static_cast<double>(spec.samples);
+        ensemble::set(configs[c], axis.name, axis.lo + t * (axis.hi - axis.lo));
+      }
+    }
+  }
+
+  for (std::size_t c = 0; c < configs.size(); ++c) {
+    auto& flight = configs[c].flight_parameters;
+    if (spec.derive_repulsion) flight.repulsion = 6 * flight.separation;
+    if (spec.derive_chase) flight.chase = 2 * flight.cohesion;
+    validate(configs[c], c);
+  }
+  return configs;
+}
+
+std::size_t run(const Spec& spec, const std::string& results_path,
+                parallel::ThreadPool& pool, const std::size_t batch,
+                std::ostream& progress) {
+  assert(batch > 0);
+  const std::vector<ensemble::Config> configs = configurations(spec);
+  const std::string columns = header(spec);
+  const std::size_t n_fields =
+      1 + spec.axes.size() + 2 * statisticNames().size();
+
+  // configurations already in the results. A line without its newline was
+  // cut short by an interrupted run: the file is truncated to the end of
+  // the last complete line, and only rows whose fields all parse count
+  std::vector<bool> done(configs.size(), false);
+  const std::string signature = fingerprint(spec);
+  std::size_t n_lines = 0;
+  {
+    std::ifstream in(results_path, std::ios::binary);
+    const std::string text((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+    const std::size_t complete = text.rfind('\n') + 1;  // 0 if none
+    if (complete < text.size()) {
+      std::filesystem::resize_file(results_path, complete);
+    }
+
+    std::istringstream lines(text.substr(0, complete));
+    for (std::string line; std::getline(lines, line); ++n_lines) {
+      if (n_lines == 0 && line != signature) {
+        throw std::runtime_error(results_path +
+                                 " holds the results of another sweep");
+      }
+      if (n_lines == 1 && line != columns) {
+        throw std::runtime_error(results_path +
+                                 " holds the results of another sweep");
+      }
+      std::size_t c = 0;
+      if (n_lines > 1 && parseRow(line, n_fields, configs.size(), c)) {
+        done[c] = true;
+      }
+    }
+  }
+
+  std::vector<std::size_t> pending;
+  for (std::size_t c = 0; c < configs.size(); ++c) {
+    if (!done[c]) pending.push_back(c);
+  }
+
+  std::ofstream out(results_path, std::ios::app);
+  if (!out) throw std::runtime_error("cannot write " + results_path);
+  if (n_lines == 0) out << signature << '\n';
+  if (n_lines <= 1) out << columns << '\n';
+  out << std::setprecision(17);
+
+  // the ensemble is cleared, not rebuilt, between batches: its arena and the
+  // pool's threads stay warm for the whole sweep
+  ensemble::Ensemble members;
+  std::size_t finished = configs.size() - pending.size();
+  for (std::size_t first = 0; first < pending.size(); first += batch) {
+    const std::size_t last = std::min(pending.size(), first + batch);
+
+    members.clear();
+    for (std::size_t k = first; k < last; ++k) {
+      const std::size_t c = pending[k];
+      members.add(configs[c], spec.seed + static_cast<std::uint32_t>(c));
+    }
+
+    std::vector<statistics::Summary> summaries(last - first);
+    for (std::size_t step = 1; step <= spec.steps; ++step) {
+      members.step(spec.dt, pool);
+      if (step > spec.warmup && (step - spec.warmup) % spec.sample_every == 0) {
+        const auto stats = members.statistics(pool);
+        for (std::size_t m = 0; m < stats.size(); ++m) {
+          summaries[m].add(stats[m]);
+        }
+      }
+    }
+
+    for (std::size_t k = first; k < last; ++k) {
+      const std::size_t c = pending[k];
+      const statistics::Summary& summary = summaries[k - first];
+      out << c;
+      for (const auto& axis : spec.axes) {
+        out << ',' << ensemble::get(configs[c], axis.name);
+      }
+      for (const statistics::Accumulator* acc :
+           {&summary.mean_distance, &summary.dev_distance,
+            &summary.mean_velocity, &summary.dev_velocity,
+            &summary.n_clusters, &summary.largest_cluster}) {
+        out << ',' << acc->getMean() << ',' << acc->getDeviation();
+      }
+      out << '\n';
+    }
+    out.flush();
+
+    finished += last - first;
+    progress << "sweep: " << finished << '/' << configs.size()
+             << " configurations\n";
+  }
+
+  return pending.size();
+}
+
+}  // namespace sweep
@@ -1,15 +1,38 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 #include "../doctest.h"
+#include "../include/arena.hpp"
 #include "../include/boid.hpp"
+#include "../include/ensemble.hpp"
 #include "../include/flock.hpp"
 #include "../include/graphics.hpp"
+#include "../include/grid.hpp"
+#include "../include/obstacles.hpp"
+#include "../include/offscreen.hpp"
+#include "../include/parallel.hpp"
 #include "../include/point.hpp"
+#include "../include/recorder.hpp"
+#include "../include/rules.hpp"
+#include "../include/settings.hpp"
+#include "../include/statistics.hpp"
+#include "../include/sweep.hpp"
+#include "../include/tiles.hpp"
 
 const std::array<double, 3> distance_parameters =
-    flock::Flock::getDistanceParameters();
+    flock::Flock(0, 0).getDistanceParameters();
 const double d_{distance_parameters[0]};
 const double prey_ds_{distance_parameters[1]};
 const double predator_ds_{distance_parameters[2]};
@@ -280,6 +303,34 @@ TEST_CASE("Testing Prey class") {
     CHECK(b1.repulsion(r, near_b1).getY() == doctest::Approx(rep1_y));
   }
 
+  SUBCASE("Testing repulsion over predator lanes") {
+    // the same boids as predators, one of them beyond the sight angle: the
+    // lanes kernel selects them as nearPredators would
+    boid::PredatorLanes lanes;
+    CHECK(lanes.size == 0);
+    CHECK(lanes.padded() == 0);
+    for (const auto& b : near_b1) lanes.push(b->getPosition());
+    const point::Point behind = pos1 - 10. * vel1 / vel1.distance();
+    lanes.push(behind);
+    lanes.push(pos1 + point::Point(1000., 0.));  // out of range
+    CHECK(lanes.size == 6);
+    CHECK(lanes.padded() == 8);
+
+    const double sight = 2. / 3 * M_PI;
+    const point::Point expected = b1.repulsion(r, near_b1);
+    const point::Point rep = b1.repulsion(r, d_, sight, lanes);
+    CHECK(rep.getX() == doctest::Approx(expected.getX()));
+    CHECK(rep.getY() == doctest::Approx(expected.getY()));
+
+    // a boid at rest sees all around
+    const point::Point all = b0.repulsion(r, d_, sight, lanes);
+    CHECK(std::isfinite(all.getX()));
+    CHECK(std::isfinite(all.getY()));
+
+    lanes.clear();
+    CHECK(b1.repulsion(r, d_, sight, lanes) == point::Point(0., 0.));
+  }
+
   SUBCASE("Testing clamp method") {
     b0.clamp(prey_min_speed, prey_max_speed, v0);
     b1.clamp(prey_min_speed, prey_max_speed, v1);
@@ -311,6 +362,56 @@ TEST_CASE("Testing Prey class") {
     CHECK(v5.getY() ==
           doctest::Approx(prey_max_speed * vel5.getY() / vel5.distance()));
   }
+  SUBCASE("Testing the batched clamp") {
+    // against the clamp as written with a square root and divisions
+    auto reference = [](const double min, const double max, double& vx,
+                        double& vy) {
+      const double speed = std::sqrt(vx * vx + vy * vy);
+      if (speed == 0.) {
+        vx = min;
+        vy = 0.;
+      } else if (speed > max) {
+        vx = max * (vx / speed);
+        vy = max * (vy / speed);
+      } else if (speed < min) {
+        vx = min * (vx / speed);
+        vy = min * (vy / speed);
+      }
+    };
+    std::mt19937 mt{11};
+    std::uniform_real_distribution<> component(-20., 20.);
+    std::vector<double> vx{0., 0., -0., 3., 1e-3, 2.5, -1e5};
+    std::vector<double> vy{0., 1e-150, 0., 4., 0., -2.5, 2.};
+    for (int k = 0; k < 1000; ++k) {
+      vx.push_back(component(mt));
+      vy.push_back(component(mt));
+    }
+    vx.push_back(-6.);
+    vy.push_back(8.);
+    std::vector<double> expected_x = vx;
+    std::vector<double> expected_y = vy;
+    for (std::size_t k = 0; k < vx.size(); ++k) {
+      reference(prey_min_speed, prey_max_speed, expected_x[k], expected_y[k]);
+    }
+
+    boid::clamp(prey_min_speed, prey_max_speed, vx.data(), vy.data(),
+                vx.size());
+    for (std::size_t k = 0; k < vx.size(); ++k) {
+      CHECK(vx[k] == doctest::Approx(expected_x[k]).epsilon(1e-14));
+      CHECK(vy[k] == doctest::Approx(expected_y[k]).epsilon(1e-14));
+    }
+    // zero as today, and a velocity within the limits exactly as it was
+    CHECK(vx[0] == prey_min_speed);
+    CHECK(vy[0] == 0.);
+    CHECK(vx[2] == prey_min_speed);
+    CHECK(vx[5] == 2.5);
+    CHECK(vy[5] == -2.5);
+
+    // which is the clamp of a single velocity
+    point::Point v(-6., 8.);
+    b1.clamp(prey_min_speed, prey_max_speed, v);
+    CHECK(v == point::Point(vx[vx.size() - 1], vy[vy.size() - 1]));
+  }
 }
 
 TEST_CASE("Testing Predator class") {
@@ -410,6 +511,176 @@ TEST_CASE("Testing Predator class") {
   }
 }
 
+/////////////// TESTING RULES /////////////////
+
+TEST_CASE("Testing rules") {
+  const rules::Self self{point::Point(100., 100.), point::Point(2., 1.)};
+  const std::vector<point::Point> positions{
+      point::Point(110., 100.), point::Point(95., 104.),
+      point::Point(100., 130.), point::Point(1195., 99.)};
+  const std::vector<point::Point> velocities{
+      point::Point(1., 1.), point::Point(-2., 0.5), point::Point(0., 3.),
+      point::Point(4., -1.)};
+  const boid::Neighbors near(positions.data(), velocities.data(),
+                             positions.size());
+  auto neighbour = [&](const std::size_t k) {
+    const point::Point offset =
+        point::relativePosition(self.position, positions[k]);
+    return rules::Neighbour{offset, offset.distance(), velocities[k]};
+  };
+
+  SUBCASE("each rule matches its function in boid") {
+    rules::Pipeline<rules::Separation<rules::Set::prey>> separation(
+        rules::Separation<rules::Set::prey>(0.1, 20.));
+    rules::Pipeline<rules::Alignment> alignment(rules::Alignment(0.1));
+    rules::Pipeline<rules::Cohesion> cohesion(rules::Cohesion(0.004));
+    rules::Pipeline<rules::Repulsion> repulsion(rules::Repulsion(0.6));
+    rules::Pipeline<rules::Chase> chase(rules::Chase(0.008));
+    for (std::size_t k = 0; k < positions.size(); ++k) {
+      separation.add<rules::Set::prey>(neighbour(k));
+      alignment.add<rules::Set::prey>(neighbour(k));
+      cohesion.add<rules::Set::prey>(neighbour(k));
+      repulsion.add<rules::Set::predators>(neighbour(k));
+      chase.add<rules::Set::prey>(neighbour(k));
+    }
+    CHECK(separation.steer(self) ==
+          boid::separation(self.position, 0.1, 20., near));
+    CHECK(alignment.steer(self) ==
+          boid::alignment(self.velocity, 0.1, near));
+    CHECK(cohesion.steer(self) == boid::cohesion(self.position, 0.004, near));
+    CHECK(repulsion.steer(self) == boid::repulsion(self.position, 0.6, near));
+    CHECK(chase.steer(self) == boid::chase(self.position, 0.008, near));
+    CHECK(chase.size() == 4);
+  }
+
+  SUBCASE("a pipeline feeds each rule the species it reads") {
+    using Rules = rules::Pipeline<rules::Repulsion,
+                                  rules::Separation<rules::Set::prey>,
+                                  rules::Alignment, rules::Goal>;
+    static_assert(Rules::reads(rules::Set::prey));
+    static_assert(Rules::reads(rules::Set::predators));
+    static_assert(
+        !rules::Pipeline<rules::Chase, rules::Goal>::reads(
+            rules::Set::predators));
+
+    Rules rules(rules::Repulsion(0.6),
+                rules::Separation<rules::Set::prey>(0.1, 20.),
+                rules::Alignment(0.1),
+                rules::Goal(point::Point(100., 200.), 0.01));
+    // the first two are prey, the others predators
+    rules.add<rules::Set::prey>(neighbour(0));
+    rules.add<rules::Set::prey>(neighbour(1));
+    rules.add<rules::Set::predators>(neighbour(2));
+    rules.add<rules::Set::predators>(neighbour(3));
+    CHECK(rules.size() == 4);
+
+    const boid::Neighbors prey(positions.data(), velocities.data(), 2);
+    const boid::Neighbors predators(positions.data() + 2,
+                                    velocities.data() + 2, 2);
+    const point::Point expected =
+        boid::repulsion(self.position, 0.6, predators) +
+        boid::separation(self.position, 0.1, 20., prey) +
+        boid::alignment(self.velocity, 0.1, prey) + point::Point(0., 1.);
+    CHECK(rules.steer(self).getX() == doctest::Approx(expected.getX()));
+    CHECK(rules.steer(self).getY() == doctest::Approx(expected.getY()));
+  }
+
+  SUBCASE("with nobody in sight the rules add nothing") {
+    rules::Pipeline<rules::Separation<rules::Set::predators>, rules::Chase>
+        rules(rules::Separation<rules::Set::predators>(0.1, 37.5),
+              rules::Chase(0.008));
+    CHECK(rules.steer(self) == point::Point(0., 0.));
+    CHECK(rules.size() == 0);
+  }
+
+  SUBCASE("avoidance pushes out of the margin, along the field") {
+    obstacles::Field field(1200., 800.);
+    field.add(obstacles::Circle{point::Point(100., 60.), 20.});
+    field.build();
+    // 40 from the centre, 20 from the border: 10 inside a margin of 30
+    const rules::Avoid avoid(&field, 0.5, 30.);
+    const point::Point push = avoid.result(self, 0);
+    CHECK(push.getX() == doctest::Approx(0.).epsilon(0.05));
+    CHECK(push.getY() == doctest::Approx(5.).epsilon(0.05));
+
+    CHECK(rules::Avoid(&field, 0.5, 15.).result(self, 0) ==
+          point::Point(0., 0.));
+    CHECK(rules::Avoid(nullptr, 0.5, 30.).result(self, 0) ==
+          point::Point(0., 0.));
+  }
+}
+
+/////////////// TESTING OBSTACLES /////////////////
+
+TEST_CASE("Testing obstacles") {
+  SUBCASE("a circle is exact at the samples, close between them") {
+    obstacles::Field field(1200., 800., 5.);
+    CHECK(field.getCols() == 240);
+    CHECK(field.getRows() == 160);
+    field.add(obstacles::Circle{point::Point(602.5, 402.5), 50.});
+    CHECK_FALSE(field.empty());
+    field.build();
+
+    CHECK(field.sample(120, 80) == doctest::Approx(-50.));
+    CHECK(field.distance(point::Point(602.5, 402.5)) == doctest::Approx(-50.));
+    CHECK(field.distance(point::Point(702.5, 402.5)) == doctest::Approx(50.));
+    CHECK(field.distance(point::Point(640., 380.)) ==
+          doctest::Approx(std::hypot(37.5, 22.5) - 50.).epsilon(0.01));
+    CHECK(field.inside(point::Point(630., 420.)));
+    CHECK_FALSE(field.inside(point::Point(660., 420.)));
+
+    const point::Point out = field.gradient(point::Point(602.5, 482.5));
+    CHECK(out.getX() == doctest::Approx(0.).epsilon(0.01));
+    CHECK(out.getY() == doctest::Approx(1.).epsilon(0.01));
+  }
+
+  SUBCASE("obstacles wrap around the edges of the world") {
+    obstacles::Field field(1200., 800., 4.);
+    field.add(obstacles::Circle{point::Point(2., 400.), 30.});
+    field.add(obstacles::Polygon{{point::Point(1180., 780.),
+                                  point::Point(1220., 780.),
+                                  point::Point(1220., 820.),
+                                  point::Point(1180., 820.)}});
+    field.build();
+    CHECK(field.distance(point::Point(1190., 400.)) ==
+          doctest::Approx(-18.).epsilon(0.01));
+    CHECK(field.gradient(point::Point(1180., 400.)).getX() < -0.9);
+    CHECK(field.inside(point::Point(10., 10.)));
+    CHECK(field.inside(point::Point(1190., 790.)));
+    CHECK(field.distance(point::Point(10., 40.)) ==
+          doctest::Approx(20.).epsilon(0.01));
+  }
+
+  SUBCASE("a mask is within a cell of the exact distance") {
+    // the left half of the right half of the world, in a 4x2 bitmap
+    obstacles::Mask mask{4, 2, {0, 0, 1, 0, 0, 0, 1, 0}};
+    obstacles::Field field(1200., 800., 10.);
+    field.add(mask);
+    field.build();
+    auto exact = [](const double x) {
+      if (x < 600.) return std::min(600. - x, x + 300.);
+      if (x > 900.) return std::min(x - 900., 1800. - x);
+      return -std::min(x - 600., 900. - x);
+    };
+    for (const double x : {100., 500., 580., 650., 800., 1000., 1150.}) {
+      const double expected = exact(x);
+      CHECK(std::abs(field.distance(point::Point(x, 333.)) - expected) <=
+            10.);
+    }
+    // half of the world on either side: across the edge as well
+    CHECK(field.distance(point::Point(20., 100.)) ==
+          doctest::Approx(320.).epsilon(0.05));
+  }
+
+  SUBCASE("an empty field is far from everything") {
+    obstacles::Field field(1200., 800.);
+    CHECK(field.empty());
+    field.build();
+    CHECK(field.distance(point::Point(33., 44.)) >= 800.);
+    CHECK(field.gradient(point::Point(33., 44.)) == point::Point(0., 0.));
+  }
+}
+
 /////////////// TESTING FLOCK CLASS /////////////////
 
 TEST_CASE("Testing Flock class") {
@@ -505,13 +776,73 @@ TEST_CASE("Testing Flock class") {
 
   SUBCASE("Testing getDistanceParameters method") {
     const std::array<double, 3> distance_parameters_f0 =
-        flock::Flock::getDistanceParameters();
+        f0.getDistanceParameters();
 
     CHECK(distance_parameters_f0[0] == doctest::Approx(75.0));
     CHECK(distance_parameters_f0[1] == doctest::Approx(20.0));
     CHECK(distance_parameters_f0[2] == doctest::Approx(37.5));
   }
 
+  SUBCASE("Testing setDistanceParameters method") {
+    f1.setDistanceParameters(2., 1., 1.5);
+    const std::array<double, 3> distance_parameters_f1 =
+        f1.getDistanceParameters();
+
+    CHECK(distance_parameters_f1[0] == doctest::Approx(2.0));
+    CHECK(distance_parameters_f1[1] == doctest::Approx(1.0));
+    CHECK(distance_parameters_f1[2] == doctest::Approx(1.5));
+
+    // with d = 2 the second prey only sees the third one, at distance sqrt(2)
+    const auto prey2_near_prey = f1.nearPrey(1, true);
+    REQUIRE(prey2_near_prey.size() == 1);
+    CHECK(prey2_near_prey[0]->getPosition().getX() == doctest::Approx(3.));
+    CHECK(f1.nearPredators(1, true).size() == 0);
+
+    f1.setDistanceParameters(75., 20., 37.5);
+    CHECK(f1.nearPrey(1, true).size() == 2);
+  }
+
+  SUBCASE("Testing nearPredators against a full scan on a generated flock") {
+    // more predators than the small-array threshold, so both populations are
+    // indexed by a grid
+    flock::Flock f5(100, 60);
+    f5.generateBoids();
+    const auto prey = f5.getPreyFlock();
+    const auto predators = f5.getPredatorFlock();
+
+    for (std::size_t i = 0; i < prey.size(); i += 3) {
+      std::size_t expected = 0;
+      for (const auto& predator : predators) {
+        if (point::toroidalDistance(prey[i]->getPosition(),
+                                    predator->getPosition()) < d_ &&
+            std::abs(prey[i]->angle(*predator)) < 2. / 3 * M_PI) {
+          ++expected;
+        }
+      }
+      CHECK(f5.nearPredators(i, true).size() == expected);
+    }
+  }
+
+  SUBCASE("Testing nearPrey against a full scan on a generated flock") {
+    flock::Flock f4(300, 0);
+    f4.generateBoids();
+    f4.setDistanceParameters(40., 10., 20.);
+    const auto prey = f4.getPreyFlock();
+
+    for (std::size_t i = 0; i < prey.size(); i += 7) {
+      std::size_t expected = 0;
+      for (std::size_t j = 0; j < prey.size(); ++j) {
+        if (i != j &&
+            point::toroidalDistance(prey[i]->getPosition(),
+                                    prey[j]->getPosition()) < 40. &&
+            std::abs(prey[i]->angle(*prey[j])) < 2. / 3 * M_PI) {
+          ++expected;
+        }
+      }
+      CHECK(f4.nearPrey(i, true).size() == expected);
+    }
+  }
+
   SUBCASE("Testing nearPrey, nearPredators methods") {
     auto prey5 = std::make_shared<boid::Prey>(point::Point(2, 100),
                                               point::Point(0., -1.));
@@ -695,6 +1026,10 @@ TEST_CASE("Testing Flock class") {
     }
 
     f1.updateFlock(dt);
+    // a step leaves the boids behind the state of the flock: getPreyFlock
+    // and getPredatorFlock bring them, shared with preys and preds, up to date
+    CHECK(f1.getPreyFlock() == preys);
+    CHECK(f1.getPredatorFlock() == preds);
 
     for (std::size_t i = 0; i < n_prey; ++i) {
       CHECK(preys[i]->getPosition().getX() ==
@@ -718,6 +1053,334 @@ TEST_CASE("Testing Flock class") {
             doctest::Approx(expected_pred_vel[i].getY()));
     }
   }
+  SUBCASE("Testing maxStep and advance") {
+    flock::Flock f6(0, 0);
+    const flock::StepLimits limits = f6.getStepLimits();
+    CHECK(limits.min_dt == doctest::Approx(0.1));
+    CHECK(limits.max_dt == doctest::Approx(1.));
+    CHECK(limits.courant == doctest::Approx(1.));
+
+    // prey_ds_ = 20 closed at twice the top speed of 12
+    CHECK(f6.maxStep() == doctest::Approx(20. / 24.));
+    f6.setStepLimits({0.1, 0.5, 1.});
+    CHECK(f6.maxStep() == doctest::Approx(0.5));
+    f6.setStepLimits({0.1, 1., 1.});
+
+    // short frames are merged
+    flock::StepReport report = f6.advance(0.06);
+    CHECK(report.substeps == 0);
+    report = f6.advance(0.06);
+    CHECK(report.substeps == 1);
+    CHECK(report.dt == doctest::Approx(0.12));
+    CHECK_FALSE(report.busy.empty());
+
+    // a plan merges them the same way, and leaves the stepping to the caller
+    report = f6.plan(0.06);
+    CHECK(report.substeps == 0);
+    report = f6.plan(2.);
+    CHECK(report.substeps == 3);
+    CHECK(report.dt == doctest::Approx(2.06 / 3.));
+    CHECK(report.busy.empty());
+
+    // long frames are split
+    report = f6.advance(2.);
+    CHECK(report.substeps == 3);
+    CHECK(report.dt == doctest::Approx(2. / 3.));
+    CHECK(report.max_dt == doctest::Approx(20. / 24.));
+
+    // and the substeps are plain updateFlock steps
+    std::vector<std::shared_ptr<boid::Prey>> prey_a;
+    std::vector<std::shared_ptr<boid::Prey>> prey_b;
+    for (const auto& p : prey_flock) {
+      prey_a.push_back(std::make_shared<boid::Prey>(*p));
+      prey_b.push_back(std::make_shared<boid::Prey>(*p));
+    }
+    std::vector<std::shared_ptr<boid::Predator>> predators_a;
+    std::vector<std::shared_ptr<boid::Predator>> predators_b;
+    for (const auto& p : predator_flock) {
+      predators_a.push_back(std::make_shared<boid::Predator>(*p));
+      predators_b.push_back(std::make_shared<boid::Predator>(*p));
+    }
+    flock::Flock stepped(prey_a, predators_a, custom_speed_limits);
+    flock::Flock advanced(prey_b, predators_b, custom_speed_limits);
+    const double dt = advanced.maxStep() * 2.5;
+    report = advanced.advance(dt);
+    REQUIRE(report.substeps == 3);
+    for (int k = 0; k < 3; ++k) stepped.updateFlock(dt / 3.);
+    for (std::size_t i = 0; i < prey_flock.size(); ++i) {
+      CHECK(advanced.getPreyFlock()[i]->getPosition() ==
+            stepped.getPreyFlock()[i]->getPosition());
+    }
+  }
+  SUBCASE("Testing the parallel update of a clustered flock") {
+    // a dense group, a looser one and strays: the cells differ widely in cost
+    std::mt19937 mt{11};
+    std::normal_distribution<> tight(0., 30.);
+    std::normal_distribution<> loose(0., 150.);
+    std::uniform_real_distribution<> dist_v(-5., 5.);
+    std::vector<std::shared_ptr<boid::Prey>> prey_a;
+    std::vector<std::shared_ptr<boid::Prey>> prey_b;
+    for (int i = 0; i < 600; ++i) {
+      const double spread = i < 400 ? tight(mt) : loose(mt);
+      const point::Point pos(std::fmod(700. + spread + 1400., 1400.),
+                             std::fmod(400. + tight(mt) + 800., 800.));
+      const point::Point vel(dist_v(mt), dist_v(mt));
+      prey_a.push_back(std::make_shared<boid::Prey>(pos, vel));
+      prey_b.push_back(std::make_shared<boid::Prey>(pos, vel));
+    }
+    std::vector<std::shared_ptr<boid::Predator>> predators_a;
+    std::vector<std::shared_ptr<boid::Predator>> predators_b;
+    for (int i = 0; i < 20; ++i) {
+      const point::Point pos(700. + tight(mt), 400. + tight(mt));
+      const point::Point vel(dist_v(mt), dist_v(mt));
+      predators_a.push_back(std::make_shared<boid::Predator>(pos, vel));
+      predators_b.push_back(std::make_shared<boid::Predator>(pos, vel));
+    }
+    flock::Flock parallel_flock(prey_a, predators_a, custom_speed_limits);
+    flock::Flock serial_flock(prey_b, predators_b, custom_speed_limits);
+
+    for (int k = 0; k < 5; ++k) {
+      parallel_flock.updateFlock(0.5);
+      // from inside a task of the default pool the update runs serially
+      parallel::defaultPool().run(2, [&](std::size_t t) {
+        if (t == 0) serial_flock.updateFlock(0.5);
+      });
+    }
+    CHECK(parallel_flock.getBusyTime().size() ==
+          parallel::defaultPool().size());
+    parallel_flock.getPreyFlock();  // the boids catch up with the state
+    serial_flock.getPreyFlock();
+    for (std::size_t i = 0; i < prey_a.size(); ++i) {
+      CHECK(prey_a[i]->getPosition() == prey_b[i]->getPosition());
+      CHECK(prey_a[i]->getVelocity() == prey_b[i]->getVelocity());
+    }
+    for (std::size_t i = 0; i < predators_a.size(); ++i) {
+      CHECK(predators_a[i]->getPosition() == predators_b[i]->getPosition());
+    }
+  }
+  SUBCASE("Testing place") {
+    flock::Flock placed(300, 10);
+    flock::Flock kept(300, 10);
+    placed.setSeed(5);
+    kept.setSeed(5);
+    placed.generateBoids();
+    kept.generateBoids();
+
+    // the boids are renumbered cell by cell, and keep their state
+    const auto before = placed.getPreyFlock();
+    placed.place();
+    const auto& after = placed.getPreyFlock();
+    for (std::size_t i = 0; i < 300; ++i) {
+      CHECK(before[i]->getPosition() == kept.getPreyFlock()[i]->getPosition());
+    }
+    CHECK(std::is_permutation(before.begin(), before.end(), after.begin()));
+    const grid::Grid& cells = placed.getPreyIndex().getGrid();
+    std::vector<std::size_t> cell;
+    for (std::size_t c = 0; c < cells.getCellCount(); ++c) {
+      cells.cell(c, cell);
+      for (std::size_t k = 1; k < cell.size(); ++k) {
+        CHECK(cell[k] == cell[k - 1] + 1);
+      }
+    }
+
+    // the sums over the neighbours run in another order
+    for (int k = 0; k < 3; ++k) {
+      placed.updateFlock(1.);
+      kept.updateFlock(1.);
+    }
+    placed.getPreyFlock();
+    for (std::size_t i = 0; i < 300; ++i) {
+      const auto p = before[i]->getPosition();
+      const auto q = kept.getPreyFlock()[i]->getPosition();
+      CHECK(p.getX() == doctest::Approx(q.getX()));
+      CHECK(p.getY() == doctest::Approx(q.getY()));
+    }
+    for (std::size_t i = 0; i < 10; ++i) {
+      CHECK(placed.getPredatorFlock()[i]->getVelocity().getX() ==
+            doctest::Approx(kept.getPredatorFlock()[i]->getVelocity().getX()));
+    }
+  }
+  SUBCASE("Testing views of the state") {
+    flock::Flock viewed(200, 5);
+    viewed.setSeed(9);
+    viewed.generateBoids();
+    viewed.updateFlock(1.);
+
+    // the same array every time, not a copy
+    CHECK(&viewed.getPreyFlock() == &viewed.getPreyFlock());
+    const auto positions = viewed.getPreyPositions();
+    const auto velocities = viewed.getPreyVelocities();
+    REQUIRE(positions.size() == 200);
+    REQUIRE(velocities.size() == 200);
+    for (std::size_t i = 0; i < 200; ++i) {
+      CHECK(positions[i] == viewed.getPreyFlock()[i]->getPosition());
+      CHECK(velocities[i] == viewed.getPreyFlock()[i]->getVelocity());
+    }
+    REQUIRE(viewed.getPredatorPositions().size() == 5);
+    std::size_t i = 0;
+    for (const point::Point& v : viewed.getPredatorVelocities()) {
+      CHECK(v == viewed.getPredatorFlock()[i++]->getVelocity());
+    }
+
+    // a step swaps the arrays: views taken before it see the state before it
+    const point::Point before = positions[0];
+    viewed.updateFlock(1.);
+    CHECK(positions[0] == before);
+    CHECK(viewed.getPreyPositions()[0] ==
+          viewed.getPreyFlock()[0]->getPosition());
+    CHECK(viewed.getPredatorPositions()[4] ==
+          viewed.getPredatorFlock()[4]->getPosition());
+
+    // the boids are a copy of the state: setBoids changes it
+    viewed.getPreyFlock()[0]->setBoid(point::Point(1., 1.),
+                                      point::Point(1., 0.));
+    CHECK_FALSE(viewed.getPreyPositions()[0] == point::Point(1., 1.));
+    std::vector<std::array<point::Point, 2>> prey_states(200);
+    std::vector<std::array<point::Point, 2>> predator_states(5);
+    for (std::size_t k = 0; k < 200; ++k) {
+      prey_states[k] = {point::Point(2., 3.), point::Point(4., 5.)};
+    }
+    viewed.setBoids(prey_states, predator_states);
+    CHECK(viewed.getPreyPositions()[199] == point::Point(2., 3.));
+    CHECK(viewed.getPreyFlock()[199]->getVelocity() == point::Point(4., 5.));
+
+    // and the number of boids, which the next step follows
+    prey_states.resize(150);
+    predator_states.resize(7, {point::Point(9., 9.), point::Point(1., 1.)});
+    viewed.setBoids(prey_states, predator_states);
+    CHECK(viewed.getPreyNum() == 150);
+    CHECK(viewed.getPredatorsNum() == 7);
+    CHECK(viewed.getPredatorFlock().size() == 7);
+    CHECK(viewed.getPredatorFlock()[6]->getPosition() == point::Point(9., 9.));
+    viewed.updateFlock(1.);
+    CHECK(viewed.getPreyPositions().size() == 150);
+    CHECK(viewed.getPredatorVelocities().size() == 7);
+  }
+  SUBCASE("Testing allocations per step") {
+    arena::CountingResource memory;
+    flock::Flock steady(600, 12, &memory);
+    steady.setSeed(3);
+    steady.generateBoids();
+    CHECK(memory.getAllocations() == 612);
+
+    // the first steps grow the frame arena and the buffers of the flock
+    for (int k = 0; k < 3; ++k) steady.updateFlock(1.);
+    CHECK(steady.getFrameBytes() > 0);
+
+    // the frame arena draws on the same resource as the boids: from then
+    // on neither the boids nor the scratch of a step go to it
+    const std::size_t allocations = memory.getAllocations();
+    for (int k = 0; k < 10; ++k) {
+      steady.updateFlock(1.);
+      CHECK(steady.getFrameAllocations() == 0);
+    }
+    CHECK(memory.getAllocations() == allocations);
+  }
+  SUBCASE("Testing coasting of isolated boids") {
+    // a sparse flock: most boids spend most steps with nobody in sight
+    std::mt19937 mt{7};
+    std::uniform_real_distribution<> dist_x(0., graphics::window_width);
+    std::uniform_real_distribution<> dist_y(0., graphics::window_height);
+    std::uniform_real_distribution<> dist_v(-5., 5.);
+    std::vector<std::shared_ptr<boid::Prey>> prey_a;
+    std::vector<std::shared_ptr<boid::Prey>> prey_b;
+    for (int i = 0; i < 40; ++i) {
+      const point::Point pos(dist_x(mt), dist_y(mt));
+      const point::Point vel(dist_v(mt), dist_v(mt));
+      prey_a.push_back(std::make_shared<boid::Prey>(pos, vel));
+      prey_b.push_back(std::make_shared<boid::Prey>(pos, vel));
+    }
+    std::vector<std::shared_ptr<boid::Predator>> predators_a;
+    std::vector<std::shared_ptr<boid::Predator>> predators_b;
+    for (int i = 0; i < 3; ++i) {
+      const point::Point pos(dist_x(mt), dist_y(mt));
+      const point::Point vel(dist_v(mt), dist_v(mt));
+      predators_a.push_back(std::make_shared<boid::Predator>(pos, vel));
+      predators_b.push_back(std::make_shared<boid::Predator>(pos, vel));
+    }
+    flock::Flock coasted(prey_a, predators_a, custom_speed_limits);
+    flock::Flock full(prey_b, predators_b, custom_speed_limits);
+    CHECK(coasted.getCoastTolerance() == doctest::Approx(0.));
+
+    std::size_t coasting = 0;
+    for (int k = 0; k < 200; ++k) {
+      coasted.updateFlock(0.5);
+      coasting += coasted.getCoasting();
+      // setting the radii again forgets the slack: every boid is evaluated
+      const auto d = full.getDistanceParameters();
+      full.setDistanceParameters(d[0], d[1], d[2]);
+      full.updateFlock(0.5);
+      CHECK(full.getCoasting() == 0);
+    }
+    CHECK(coasting > 0);
+
+    // with no tolerance coasting is exact
+    coasted.getPreyFlock();  // the boids catch up with the state
+    full.getPreyFlock();
+    for (std::size_t i = 0; i < prey_a.size(); ++i) {
+      CHECK(prey_a[i]->getPosition() == prey_b[i]->getPosition());
+      CHECK(prey_a[i]->getVelocity() == prey_b[i]->getVelocity());
+    }
+    for (std::size_t i = 0; i < predators_a.size(); ++i) {
+      CHECK(predators_a[i]->getPosition() == predators_b[i]->getPosition());
+    }
+  }
+
+  SUBCASE("Testing obstacles") {
+    auto field = std::make_shared<obstacles::Field>(
+        static_cast<double>(graphics::window_width),
+        static_cast<double>(graphics::window_height));
+    field->add(obstacles::Circle{point::Point(700., 400.), 120.});
+    field->add(obstacles::Polygon{
+        {point::Point(100., 100.), point::Point(300., 100.),
+         point::Point(300., 250.), point::Point(100., 250.)}});
+    field->build();
+
+    flock::Flock coasted(300, 6);
+    flock::Flock full(300, 6);
+    for (flock::Flock* f : {&coasted, &full}) {
+      f->setObstacles(field, 0.3, 30.);
+      f->setSeed(5);
+      f->generateBoids();
+    }
+    CHECK(coasted.getObstacles() == field);
+    CHECK(coasted.getObstacleParameters()[1] == doctest::Approx(30.));
+    for (const auto& p : coasted.getPreyPositions()) {
+      CHECK_FALSE(field->inside(p));
+    }
+
+    // boids near an obstacle never coast, so coasting stays exact
+    for (int k = 0; k < 150; ++k) {
+      coasted.updateFlock(1.);
+      const auto d = full.getDistanceParameters();
+      full.setDistanceParameters(d[0], d[1], d[2]);
+      full.updateFlock(1.);
+      for (const auto& p : coasted.getPreyPositions()) {
+        CHECK(field->distance(p) > -0.5);
+      }
+      for (const auto& p : coasted.getPredatorPositions()) {
+        CHECK(field->distance(p) > -0.5);
+      }
+    }
+    for (std::size_t i = 0; i < 300; ++i) {
+      CHECK(coasted.getPreyPositions()[i] == full.getPreyPositions()[i]);
+    }
+
+    // and taking them away leaves the flock as it was
+    flock::Flock plain(50, 2);
+    flock::Flock cleared(50, 2);
+    cleared.setObstacles(field);
+    cleared.setObstacles(nullptr);
+    for (flock::Flock* f : {&plain, &cleared}) {
+      f->setSeed(3);
+      f->generateBoids();
+      for (int k = 0; k < 10; ++k) f->updateFlock(1.);
+    }
+    for (std::size_t i = 0; i < 50; ++i) {
+      CHECK(plain.getPreyPositions()[i] == cleared.getPreyPositions()[i]);
+    }
+  }
+
   SUBCASE("statistics computes mean and stddev of prey distances and speeds") {
     const auto preys = prey_flock;
     const std::size_t n = preys.size();
@@ -767,6 +1430,297 @@ TEST_CASE("Testing Flock class") {
     CHECK(stats.dev_distance == doctest::Approx(dev_dist));
     CHECK(stats.mean_velocity == doctest::Approx(mean_speed));
     CHECK(stats.dev_velocity == doctest::Approx(dev_speed));
+
+    // the four prey are within d_ of each other
+    CHECK(stats.n_clusters == 1);
+    CHECK(stats.largest_cluster == 4);
+    CHECK(f1.clusters() == std::vector<std::size_t>{4});
+  }
+}
+
+/////////////// TESTING GRID CLASS /////////////////
+
+TEST_CASE("Testing Grid class") {
+  grid::Grid g(1400., 800.);
+
+  SUBCASE("Testing tune method") {
+    g.tune(75., 1000);
+    CHECK(g.getCols() == 18);
+    CHECK(g.getRows() == 10);
+    CHECK(g.getCellWidth() >= 75.);
+    CHECK(g.getCellHeight() >= 75.);
+
+    // few boids: no more cells than boids
+    g.tune(75., 20);
+    CHECK(g.getCols() * g.getRows() <= 20);
+    CHECK(g.getCellWidth() >= 75.);
+    CHECK(g.getCellHeight() >= 75.);
+
+    // radius larger than the world: a single cell
+    g.tune(2000., 1000);
+    CHECK(g.getCols() == 1);
+    CHECK(g.getRows() == 1);
+  }
+
+  SUBCASE("Testing query method") {
+    const std::vector<point::Point> positions{
+        point::Point(10., 10.), point::Point(1390., 790.),
+        point::Point(700., 400.), point::Point(60., 10.),
+        point::Point(1400., 0.)};
+    g.tune(75., 1000);
+    g.build(positions);
+
+    std::vector<std::size_t> near;
+    g.query(point::Point(5., 5.), near);
+
+    // every boid within the radius is found, across the borders too
+    CHECK(near == std::vector<std::size_t>{0, 1, 3, 4});
+
+    g.query(point::Point(700., 400.), near);
+    CHECK(near == std::vector<std::size_t>{2});
+
+    // with fewer than three cells per axis no cell is returned twice
+    g.tune(500., 1000);
+    g.build(positions);
+    g.query(point::Point(5., 5.), near);
+    CHECK(near == std::vector<std::size_t>{0, 1, 2, 3, 4});
+  }
+}
+
+TEST_CASE("Testing Index class") {
+  grid::Index index(1400., 800.);
+
+  std::mt19937 mt{42};
+  std::uniform_real_distribution<> dist_x(0., 1400.);
+  std::uniform_real_distribution<> dist_y(0., 800.);
+
+  auto brute_force = [](const std::vector<point::Point>& positions,
+                        const point::Point& p, double radius) {
+    std::vector<std::size_t> near;
+    for (std::size_t j = 0; j < positions.size(); ++j) {
+      if (point::toroidalDistance(p, positions[j]) < radius) near.push_back(j);
+    }
+    return near;
+  };
+
+  // the candidates must be a superset of the boids within the radius
+  auto covers = [](const std::vector<std::size_t>& candidates,
+                   const std::vector<std::size_t>& near) {
+    return std::includes(candidates.begin(), candidates.end(), near.begin(),
+                         near.end());
+  };
+
+  SUBCASE("Testing the small-array path") {
+    std::vector<point::Point> positions;
+    for (std::size_t i = 0; i < 10; ++i) {
+      positions.emplace_back(dist_x(mt), dist_y(mt));
+    }
+    positions.emplace_back(1399., 400.);
+    positions.emplace_back(0., 400.);
+
+    index.tune(75., positions.size());
+    CHECK(index.isSmall());
+    index.build(positions);
+
+    std::vector<std::size_t> candidates;
+    for (const auto& p : positions) {
+      index.query(p, candidates);
+      CHECK(std::is_sorted(candidates.begin(), candidates.end()));
+      CHECK(covers(candidates, brute_force(positions, p, 75.)));
+    }
+
+    // window crossing the left and the right border
+    index.query(point::Point(10., 400.), candidates);
+    CHECK(covers(candidates, {10, 11}));
+    index.query(point::Point(1390., 400.), candidates);
+    CHECK(covers(candidates, {10, 11}));
+  }
+
+  SUBCASE("Testing the grid path") {
+    std::vector<point::Point> positions;
+    for (std::size_t i = 0; i < 500; ++i) {
+      positions.emplace_back(dist_x(mt), dist_y(mt));
+    }
+
+    index.tune(75., positions.size());
+    CHECK_FALSE(index.isSmall());
+    CHECK(index.getGrid().getCols() == 18);
+    index.build(positions);
+
+    std::vector<std::size_t> candidates;
+    for (const auto& p : positions) {
+      index.query(p, candidates);
+      CHECK(covers(candidates, brute_force(positions, p, 75.)));
+      index.queryAround(p, 225., candidates);
+      CHECK(std::is_sorted(candidates.begin(), candidates.end()));
+      CHECK(covers(candidates, brute_force(positions, p, 225.)));
+    }
+  }
+
+  SUBCASE("Testing region method") {
+    for (const std::size_t n : {std::size_t{20}, std::size_t{500}}) {
+      std::vector<point::Point> positions;
+      for (std::size_t i = 0; i < n; ++i) {
+        positions.emplace_back(dist_x(mt), dist_y(mt));
+      }
+      index.tune(75., n);
+      index.build(positions);
+
+      // every boid in the rectangle, none twice, few outside of it
+      for (const auto& [lo, hi] :
+           {std::pair{point::Point(0., 0.), point::Point(1400., 800.)},
+            std::pair{point::Point(300., 200.), point::Point(500., 260.)},
+            std::pair{point::Point(1300., 0.), point::Point(1400., 90.)}}) {
+        std::vector<std::size_t> candidates;
+        index.region(lo, hi, candidates);
+        std::sort(candidates.begin(), candidates.end());
+        CHECK(std::adjacent_find(candidates.begin(), candidates.end()) ==
+              candidates.end());
+        std::vector<std::size_t> inside;
+        for (std::size_t i = 0; i < n; ++i) {
+          const point::Point& p = positions[i];
+          if (p.getX() >= lo.getX() && p.getX() < hi.getX() &&
+              p.getY() >= lo.getY() && p.getY() < hi.getY()) {
+            inside.push_back(i);
+          }
+        }
+        CHECK(covers(candidates, inside));
+        if (n == 500) CHECK(candidates.size() < inside.size() + n / 4);
+      }
+    }
+  }
+}
+
+/////////////// TESTING FRAME ARENA /////////////////
+
+TEST_CASE("Testing FrameArena class") {
+  arena::CountingResource upstream;
+  arena::FrameArena frame(&upstream);
+  CHECK(frame.getCapacity() == 0);
+
+  // an empty arena hands everything out from upstream
+  std::pmr::vector<double> a(100, 1., &frame);
+  std::pmr::vector<char> b(3, 'b', &frame);
+  CHECK(frame.getUpstreamAllocations() == 2);
+  CHECK(upstream.getAllocations() == 2);
+  CHECK(frame.getUsed() >= 803);
+
+  // the reset makes room for the whole of it in a single buffer
+  a = std::pmr::vector<double>(&frame);
+  b = std::pmr::vector<char>(&frame);
+  frame.reset();
+  CHECK(frame.getUpstreamAllocations() == 1);
+  CHECK(frame.getUsed() == 0);
+  const std::size_t capacity = frame.getCapacity();
+  CHECK(capacity >= 803);
+  CHECK(upstream.getBytes() == capacity);
+
+  SUBCASE("a step that fits makes no upstream allocation") {
+    for (int k = 0; k < 3; ++k) {
+      frame.reset();
+      std::pmr::vector<char> c(3, 'c', &frame);
+      std::pmr::vector<double> d(100, 2., &frame);
+      CHECK(reinterpret_cast<std::uintptr_t>(d.data()) % alignof(double) == 0);
+      CHECK(d[99] == 2.);
+      CHECK(frame.getUpstreamAllocations() == 0);
+    }
+    CHECK(frame.getCapacity() == capacity);
+    CHECK(upstream.getAllocations() == 3);
+  }
+
+  SUBCASE("threads allocate at once") {
+    parallel::ThreadPool pool(4);
+    frame.reset();
+    std::vector<double*> blocks(64);
+    pool.run(blocks.size(), [&](std::size_t t) {
+      blocks[t] = static_cast<double*>(frame.allocate(8, alignof(double)));
+      *blocks[t] = static_cast<double>(t);
+    });
+    for (std::size_t t = 0; t < blocks.size(); ++t) {
+      CHECK(*blocks[t] == static_cast<double>(t));
+    }
+    CHECK(frame.getUsed() == 64 * 8);
+  }
+
+  SUBCASE("a copy starts empty") {
+    const arena::FrameArena copy(frame);
+    CHECK(copy.getCapacity() == 0);
+    CHECK(copy.getUsed() == 0);
+  }
+}
+
+/////////////// TESTING THREAD POOL /////////////////
+
+TEST_CASE("Testing ThreadPool class") {
+  parallel::ThreadPool pool(4);
+  CHECK(pool.size() == 4);
+
+  SUBCASE("every task runs exactly once") {
+    std::vector<int> runs(1000, 0);
+    pool.run(runs.size(), [&](std::size_t t) { ++runs[t]; });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 1; }));
+
+    // the pool is reusable
+    pool.run(runs.size(), [&](std::size_t t) { ++runs[t]; });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 2; }));
+  }
+
+  SUBCASE("nested runs are executed serially") {
+    std::vector<int> runs(16 * 16, 0);
+    pool.run(16, [&](std::size_t i) {
+      pool.run(16, [&](std::size_t j) { ++runs[i * 16 + j]; });
+    });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 1; }));
+  }
+
+  SUBCASE("costed runs deal ranges and steal from them") {
+    std::vector<int> runs(64, 0);
+    const std::vector<double> costs(runs.size(), 1.);
+    // the first task takes far longer than estimated: the others steal the
+    // rest of the caller's range
+    const parallel::RunReport report = pool.run(costs, [&](std::size_t t) {
+      if (t == 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      ++runs[t];
+    });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 1; }));
+    REQUIRE(report.busy.size() == 4);
+    CHECK(*std::max_element(report.busy.begin(), report.busy.end()) >= 0.04);
+    CHECK(report.steals > 0);
+
+    // uneven costs, and no estimate at all
+    std::vector<double> skewed(runs.size(), 0.);
+    skewed[5] = 100.;
+    pool.run(skewed, [&](std::size_t t) { ++runs[t]; });
+    std::vector<double> uneven(runs.size());
+    for (std::size_t t = 0; t < uneven.size(); ++t) {
+      uneven[t] = static_cast<double>(t * t % 7);
+    }
+    pool.run(uneven, [&](std::size_t t) { ++runs[t]; });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 3; }));
+
+    // a nested run is serial and reports the calling thread only
+    pool.run(2, [&](std::size_t) {
+      CHECK(pool.run(costs, [](std::size_t) {}).busy.size() == 1);
+    });
+  }
+
+  SUBCASE("the default pool can only be sized before it exists") {
+    const std::size_t size = parallel::defaultPool().size();
+    CHECK_FALSE(parallel::configureDefaultPool(size + 1, true));
+    CHECK(parallel::defaultPool().size() == size);
+    CHECK(parallel::defaultPool().getPinned() == 0);
+  }
+
+  SUBCASE("workers can be pinned") {
+    parallel::ThreadPool pinned(3, true);
+    std::vector<int> runs(50, 0);
+    pinned.run(runs.size(), [&](std::size_t t) { ++runs[t]; });
+    CHECK(std::all_of(runs.begin(), runs.end(), [](int r) { return r == 1; }));
+#ifdef __linux__
+    // every worker has joined the run, so it has pinned itself by now
+    CHECK(pinned.getPinned() == 2);
+#endif
+    CHECK(parallel::ThreadPool(3).getPinned() == 0);
   }
 }
 
@@ -780,6 +1734,8 @@ TEST_CASE("Testing Statistics struct") {
   CHECK(stats0.dev_distance == 0.);
   CHECK(stats0.mean_velocity == 0.);
   CHECK(stats0.dev_velocity == 0.);
+  CHECK(stats0.n_clusters == 0);
+  CHECK(stats0.largest_cluster == 0);
 
   CHECK(stats1.mean_distance == 15.);
   CHECK(stats1.dev_distance == 11.);
@@ -787,6 +1743,913 @@ TEST_CASE("Testing Statistics struct") {
   CHECK(stats1.dev_velocity == 5.);
 }
 
+TEST_CASE("Testing Accumulator class") {
+  SUBCASE("mean and deviation of a few values") {
+    statistics::Accumulator acc;
+    CHECK(acc.getCount() == 0);
+    CHECK(acc.getMean() == 0.);
+    CHECK(acc.getDeviation() == 0.);
+
+    for (double v : {2., 4., 4., 4., 5., 5., 7., 9.}) acc.add(v);
+    CHECK(acc.getCount() == 8);
+    CHECK(acc.getMean() == doctest::Approx(5.));
+    CHECK(acc.getVariance() == doctest::Approx(4.));
+    CHECK(acc.getDeviation() == doctest::Approx(2.));
+  }
+
+  SUBCASE("no cancellation on a large offset") {
+    // sqrt(mean2 - mean * mean) gives garbage here, being the difference of
+    // two numbers around 1e18 that agree to the last digit
+    statistics::Accumulator acc;
+    const std::vector<double> values{1e9 + 4., 1e9 + 7., 1e9 + 13., 1e9 + 16.};
+    acc.addBlock(values.data(), values.size());
+    CHECK(acc.getMean() == doctest::Approx(1e9 + 10.));
+    CHECK(acc.getVariance() == doctest::Approx(22.5));
+  }
+
+  SUBCASE("merge, add and addBlock agree") {
+    std::mt19937 mt{3};
+    std::uniform_real_distribution<> dist(-50., 150.);
+    std::vector<double> values(1000);
+    for (auto& v : values) v = dist(mt);
+
+    statistics::Accumulator one_by_one;
+    for (double v : values) one_by_one.add(v);
+
+    statistics::Accumulator blocks;
+    blocks.addBlock(values.data(), 300);
+    blocks.addBlock(values.data() + 300, 700);
+
+    statistics::Accumulator first;
+    statistics::Accumulator second;
+    first.addBlock(values.data(), 10);
+    second.addBlock(values.data() + 10, 990);
+    first.merge(second);
+    first.merge(statistics::Accumulator{});
+
+    for (const auto& acc : {blocks, first}) {
+      CHECK(acc.getCount() == 1000);
+      CHECK(acc.getMean() == doctest::Approx(one_by_one.getMean()));
+      CHECK(acc.getVariance() == doctest::Approx(one_by_one.getVariance()));
+    }
+  }
+}
+
+TEST_CASE("Testing Series class") {
+  statistics::Series series(3);
+  CHECK(series.capacity() == 3);
+  CHECK(series.size() == 0);
+
+  for (int i = 1; i <= 5; ++i) {
+    const double v = i;
+    series.push(statistics::Statistics(v, 2. * v, 3. * v, 4. * v));
+  }
+
+  // only the last three frames are kept, oldest first
+  REQUIRE(series.size() == 3);
+  CHECK(series[0].mean_distance == 3.);
+  CHECK(series[1].mean_distance == 4.);
+  CHECK(series[2].mean_distance == 5.);
+
+  const statistics::Summary window = series.window();
+  CHECK(window.mean_distance.getCount() == 3);
+  CHECK(window.mean_distance.getMean() == doctest::Approx(4.));
+  CHECK(window.dev_velocity.getMean() == doctest::Approx(16.));
+  CHECK(window.mean_velocity.getVariance() == doctest::Approx(6.));
+
+  // while the total covers every frame pushed
+  CHECK(series.total().mean_distance.getCount() == 5);
+  CHECK(series.total().mean_distance.getMean() == doctest::Approx(3.));
+  CHECK(series.total().dev_distance.getVariance() == doctest::Approx(8.));
+}
+
+TEST_CASE("Testing pairDistances") {
+  std::mt19937 mt{7};
+  std::uniform_real_distribution<> dist_x(0., 1400.);
+  std::uniform_real_distribution<> dist_y(0., 800.);
+
+  // more points than a tile, and not a multiple of its size
+  std::vector<double> x(700);
+  std::vector<double> y(700);
+  for (std::size_t i = 0; i < x.size(); ++i) {
+    x[i] = dist_x(mt);
+    y[i] = dist_y(mt);
+  }
+
+  double sum = 0.;
+  double sum2 = 0.;
+  for (std::size_t i = 0; i < x.size(); ++i) {
+    for (std::size_t j = i + 1; j < x.size(); ++j) {
+      const double d = point::toroidalDistance(point::Point(x[i], y[i]),
+                                               point::Point(x[j], y[j]));
+      sum += d;
+      sum2 += d * d;
+    }
+  }
+  const double n_pairs = 700. * 699. / 2.;
+  const double mean = sum / n_pairs;
+  const double dev = std::sqrt(sum2 / n_pairs - mean * mean);
+
+  parallel::ThreadPool serial(1);
+  parallel::ThreadPool threads(4);
+  const auto pairs1 = statistics::pairDistances(x, y, 1400., 800., serial);
+  const auto pairs4 = statistics::pairDistances(x, y, 1400., 800., threads);
+
+  CHECK(pairs1.getCount() == 700 * 699 / 2);
+  CHECK(pairs1.getMean() == doctest::Approx(mean));
+  CHECK(pairs1.getDeviation() == doctest::Approx(dev));
+
+  // same reduction order whatever the number of threads, and run to run
+  const auto pairs4_again =
+      statistics::pairDistances(x, y, 1400., 800., threads);
+  CHECK(pairs1.getMean() == pairs4.getMean());
+  CHECK(pairs1.getVariance() == pairs4.getVariance());
+  CHECK(pairs4_again.getMean() == pairs4.getMean());
+  CHECK(pairs4_again.getVariance() == pairs4.getVariance());
+
+  // fewer than two points: no pairs
+  const std::vector<double> one{1.};
+  CHECK(statistics::pairDistances(one, one, 1400., 800., threads)
+            .getCount() == 0);
+}
+
+TEST_CASE("Testing Histogram class") {
+  statistics::Histogram h(10., 5);
+  CHECK(h.getBinWidth() == doctest::Approx(2.));
+
+  for (double v : {0., 1.9, 2., 5., 9.99, 10., 42.}) h.add(v);
+  CHECK(h.getCounts() == std::vector<std::size_t>{2, 1, 1, 0, 1});
+  CHECK(h.getOverflow() == 2);
+  CHECK(h.getTotal() == 7);
+
+  statistics::Histogram other(10., 5);
+  other.add(3.);
+  h.merge(other);
+  CHECK(h.getCounts()[1] == 2);
+  CHECK(h.getTotal() == 8);
+}
+
+TEST_CASE("Testing structure") {
+  std::mt19937 mt{11};
+  std::uniform_real_distribution<> dist_x(0., 1400.);
+  std::uniform_real_distribution<> dist_y(0., 800.);
+  std::uniform_real_distribution<> dist_angle(0., 2 * M_PI);
+
+  const std::size_t n = 1500;
+  const double cutoff = 100.;
+  std::vector<point::Point> positions(n);
+  std::vector<point::Point> velocities(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    positions[i] = point::Point(dist_x(mt), dist_y(mt));
+    const double angle = dist_angle(mt);
+    velocities[i] = point::Point(3. * std::cos(angle), 3. * std::sin(angle));
+  }
+
+  parallel::ThreadPool pool(4);
+  const auto s = statistics::structure(positions, velocities, 1400., 800.,
+                                       cutoff, 10, pool);
+
+  SUBCASE("pair and nearest-neighbour histograms match a full scan") {
+    statistics::Histogram pairs(cutoff, 10);
+    statistics::Histogram nearest(cutoff, 10);
+    for (std::size_t i = 0; i < n; ++i) {
+      double min = cutoff;
+      for (std::size_t j = 0; j < n; ++j) {
+        if (i == j) continue;
+        const double d = point::toroidalDistance(positions[i], positions[j]);
+        if (d < cutoff) {
+          min = std::min(min, d);
+          if (j > i) pairs.add(d);
+        }
+      }
+      nearest.add(min);
+    }
+    CHECK(s.pair_distances.getCounts() == pairs.getCounts());
+    CHECK(s.pair_distances.getOverflow() == 0);
+    CHECK(s.nearest.getCounts() == nearest.getCounts());
+    CHECK(s.nearest.getOverflow() == nearest.getOverflow());
+    CHECK(s.nearest.getTotal() == n);
+  }
+
+  SUBCASE("an index with cells smaller than the cutoff gives the same") {
+    grid::Index index(1400., 800.);
+    index.tune(cutoff / 3., n);
+    index.build(positions);
+    const auto t = statistics::structure(positions, velocities, index, cutoff,
+                                         10, pool);
+    CHECK(t.pair_distances.getCounts() == s.pair_distances.getCounts());
+    CHECK(t.nearest.getCounts() == s.nearest.getCounts());
+    CHECK(t.rdf == s.rdf);
+  }
+
+  SUBCASE("uniform random boids look like an ideal gas") {
+    // g(r) close to 1 away from the first, sparsely populated, bins
+    for (std::size_t k = 3; k < s.rdf.size(); ++k) {
+      CHECK(s.rdf[k] == doctest::Approx(1.).epsilon(0.15));
+    }
+    // random headings: the polarization is of order 1/sqrt(n)
+    CHECK(s.polarization < 0.1);
+  }
+
+  SUBCASE("aligned boids are fully polarized") {
+    std::vector<point::Point> aligned(n, point::Point(2., 1.));
+    const auto t = statistics::structure(positions, aligned, 1400., 800.,
+                                         cutoff, 10, pool);
+    CHECK(t.polarization == doctest::Approx(1.));
+  }
+}
+
+TEST_CASE("Testing clusters") {
+  parallel::ThreadPool pool(4);
+
+  SUBCASE("chains, isolated boids and groups across the border") {
+    const std::vector<point::Point> positions{
+        // a chain: consecutive boids closer than the radius
+        point::Point(100., 100.), point::Point(140., 100.),
+        point::Point(180., 100.), point::Point(220., 100.),
+        // an isolated boid
+        point::Point(700., 400.),
+        // a pair across the left/right border
+        point::Point(1390., 600.), point::Point(20., 600.)};
+
+    const auto sizes =
+        statistics::clusters(positions, 1400., 800., 50., pool);
+    CHECK(sizes == std::vector<std::size_t>{4, 2, 1});
+
+    // a smaller radius breaks the chain, the pair is 30 apart
+    const auto smaller =
+        statistics::clusters(positions, 1400., 800., 35., pool);
+    CHECK(smaller == std::vector<std::size_t>{2, 1, 1, 1, 1, 1});
+  }
+
+  SUBCASE("same groups as a serial flood fill") {
+    std::mt19937 mt{5};
+    std::uniform_real_distribution<> dist_x(0., 1400.);
+    std::uniform_real_distribution<> dist_y(0., 800.);
+    std::vector<point::Point> positions(3000);
+    for (auto& p : positions) p = point::Point(dist_x(mt), dist_y(mt));
+
+    std::vector<std::size_t> label(positions.size(), positions.size());
+    std::vector<std::size_t> expected;
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+      if (label[i] != positions.size()) continue;
+      std::vector<std::size_t> stack{i};
+      label[i] = i;
+      std::size_t size = 0;
+      while (!stack.empty()) {
+        const std::size_t k = stack.back();
+        stack.pop_back();
+        ++size;
+        for (std::size_t j = 0; j < positions.size(); ++j) {
+          if (label[j] == positions.size() &&
+              point::toroidalDistance(positions[k], positions[j]) < 20.) {
+            label[j] = i;
+            stack.push_back(j);
+          }
+        }
+      }
+      expected.push_back(size);
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<>());
+
+    CHECK(statistics::clusters(positions, 1400., 800., 20., pool) == expected);
+
+    // an index tuned for another radius serves as well, as a flock's does
+    grid::Index index(1400., 800.);
+    index.tune(75., positions.size());
+    index.build(positions);
+    CHECK(statistics::clusters(positions, index, 20., pool) == expected);
+    index.tune(8., positions.size());
+    index.build(positions);
+    CHECK(statistics::clusters(positions, index, 20., pool) == expected);
+  }
+
+  SUBCASE("no boids, no groups") {
+    CHECK(statistics::clusters({}, 1400., 800., 20., pool).empty());
+  }
+}
+
+/////////////// TESTING RECORDER /////////////////
+
+TEST_CASE("Testing Recorder class") {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string binary = (dir / "boids_recorder_test.bin").string();
+  const std::string csv = (dir / "boids_recorder_test.csv").string();
+
+  SUBCASE("rows survive the round trip through the CSV converter") {
+    {
+      // small chunks, so that several chunks and a partial one are written
+      recorder::Recorder rec(binary, {"frame", "value"}, 16, 1000);
+      REQUIRE(rec.isOpen());
+      std::vector<double> row(2);
+      for (int i = 0; i < 100; ++i) {
+        row = {static_cast<double>(i), 0.5 * i};
+        rec.record(row);
+      }
+      rec.flush();
+      CHECK(rec.getWritten() == 100);
+      CHECK(rec.getDropped() == 0);
+    }
+
+    REQUIRE(recorder::toCsv(binary, csv));
+    std::ifstream in(csv);
+    std::string line;
+    std::getline(in, line);
+    CHECK(line == "frame,value");
+    int n_lines = 0;
+    while (std::getline(in, line)) {
+      const auto comma = line.find(',');
+      CHECK(std::stod(line.substr(0, comma)) == n_lines);
+      CHECK(std::stod(line.substr(comma + 1)) == 0.5 * n_lines);
+      ++n_lines;
+    }
+    CHECK(n_lines == 100);
+  }
+
+  SUBCASE("the last partial chunk is written on destruction") {
+    {
+      recorder::Recorder rec(binary, {"x"}, 64, 4);
+      rec.record({1.});
+      rec.record({2.});
+    }
+    REQUIRE(recorder::toCsv(binary, csv));
+    std::ifstream in(csv);
+    std::string line;
+    int n_lines = 0;
+    while (std::getline(in, line)) ++n_lines;
+    CHECK(n_lines == 3);
+  }
+
+  SUBCASE("a full queue holds the caller up, or drops if asked to") {
+    {
+      // a single chunk of a single row in flight: nearly every row waits
+      recorder::Recorder rec(binary, {"x"}, 1, 1);
+      for (int i = 0; i < 500; ++i) rec.record({static_cast<double>(i)});
+      rec.flush();
+      CHECK(rec.getWritten() == 500);
+      CHECK(rec.getDropped() == 0);
+    }
+    {
+      recorder::Recorder rec(binary, {"x"}, 1, 1, recorder::Overflow::drop);
+      for (int i = 0; i < 500; ++i) rec.record({static_cast<double>(i)});
+      rec.flush();
+      CHECK(rec.getStalls() == 0);
+      CHECK(rec.getWritten() + rec.getDropped() == 500);
+    }
+  }
+
+  SUBCASE("a failed write is kept, and its rows are not counted") {
+    if (std::filesystem::exists("/dev/full")) {
+      recorder::Recorder rec("/dev/full", {"x"}, 4, 4);
+      REQUIRE(rec.isOpen());
+      for (int i = 0; i < 40; ++i) rec.record({static_cast<double>(i)});
+      rec.flush();
+      CHECK(rec.hasFailed());
+      CHECK(rec.getWritten() == 0);
+    }
+    recorder::Recorder rec(binary, {"x"}, 4, 4);
+    rec.record({1.});
+    rec.flush();
+    CHECK_FALSE(rec.hasFailed());
+  }
+
+  SUBCASE("malformed input is rejected") {
+    std::ofstream(binary) << "not a recording";
+    CHECK_FALSE(recorder::toCsv(binary, csv));
+    CHECK_FALSE(recorder::toCsv((dir / "boids_missing.bin").string(), csv));
+
+    // counts past the end of the file, a name and then a chunk
+    auto write = [&](const std::vector<std::uint32_t>& words) {
+      std::ofstream out(binary, std::ios::binary | std::ios::trunc);
+      out.write("BOIDCOL1", 8);
+      for (const std::uint32_t word : words) {
+        out.write(reinterpret_cast<const char*>(&word), sizeof(word));
+      }
+      out.write("x", 1);
+    };
+    write({1, 0xffffffffu});
+    CHECK_FALSE(recorder::toCsv(binary, csv));
+    write({0xffffffffu, 1});
+    CHECK_FALSE(recorder::toCsv(binary, csv));
+    write({1, 1});
+    std::ofstream(binary, std::ios::binary | std::ios::app)
+        .write("\xff\xff\xff\x0f", 4);
+    CHECK_FALSE(recorder::toCsv(binary, csv));
+  }
+
+  std::filesystem::remove(binary);
+  std::filesystem::remove(csv);
+}
+
+/////////////// TESTING ENSEMBLE /////////////////
+
+TEST_CASE("Testing Ensemble class") {
+  ensemble::Ensemble members;
+  ensemble::Config small;
+  small.n_prey = 60;
+  small.n_predators = 2;
+  ensemble::Config large;
+  large.n_prey = 300;
+  large.n_predators = 6;
+  large.speed_limits = {5., 10., 4., 9.};
+
+  CHECK(members.add(small, 1) == 0);
+  CHECK(members.add(large, 2) == 1);
+  CHECK(members.add(small, 3) == 2);
+  CHECK(members.size() == 3);
+  CHECK(members.getBoidCount() == 2 * 62 + 306);
+  CHECK(members.getConfig(1).n_prey == 300);
+
+  // a flock with the same boids, to compare against
+  auto copy = [&members](const std::size_t m) {
+    std::vector<std::shared_ptr<boid::Prey>> prey;
+    const auto prey_pos = members.getPreyPositions(m);
+    const auto prey_vel = members.getPreyVelocities(m);
+    for (std::size_t i = 0; i < prey_pos.size(); ++i) {
+      prey.push_back(std::make_shared<boid::Prey>(prey_pos[i], prey_vel[i]));
+    }
+    std::vector<std::shared_ptr<boid::Predator>> predators;
+    const auto pred_pos = members.getPredatorPositions(m);
+    const auto pred_vel = members.getPredatorVelocities(m);
+    for (std::size_t i = 0; i < pred_pos.size(); ++i) {
+      predators.push_back(
+          std::make_shared<boid::Predator>(pred_pos[i], pred_vel[i]));
+    }
+    return flock::Flock(prey, predators, members.getConfig(m).speed_limits);
+  };
+
+  SUBCASE("members follow the rules of Flock") {
+    std::vector<flock::Flock> flocks;
+    for (std::size_t m = 0; m < members.size(); ++m) {
+      flocks.push_back(copy(m));
+    }
+
+    parallel::ThreadPool pool(4);
+    for (int k = 0; k < 10; ++k) {
+      members.step(1., pool);
+      for (auto& f : flocks) f.updateFlock(1.);
+    }
+
+    for (std::size_t m = 0; m < members.size(); ++m) {
+      const auto prey_pos = members.getPreyPositions(m);
+      const auto prey_vel = members.getPreyVelocities(m);
+      const auto prey = flocks[m].getPreyFlock();
+      for (std::size_t i = 0; i < prey.size(); ++i) {
+        CHECK(prey_pos[i] == prey[i]->getPosition());
+        CHECK(prey_vel[i] == prey[i]->getVelocity());
+      }
+      const auto pred_pos = members.getPredatorPositions(m);
+      const auto predators = flocks[m].getPredatorFlock();
+      for (std::size_t i = 0; i < predators.size(); ++i) {
+        CHECK(pred_pos[i] == predators[i]->getPosition());
+      }
+    }
+
+    const auto stats = members.statistics(pool);
+    REQUIRE(stats.size() == 3);
+    for (std::size_t m = 0; m < members.size(); ++m) {
+      const auto expected = flocks[m].statistics();
+      CHECK(stats[m].mean_distance ==
+            doctest::Approx(expected.mean_distance));
+      CHECK(stats[m].dev_velocity == doctest::Approx(expected.dev_velocity));
+      CHECK(stats[m].n_clusters == expected.n_clusters);
+    }
+  }
+
+  SUBCASE("a member steps to the same state as a flock of the same seed") {
+    // past boid::PredatorLanes::capacity the prey see the predators through
+    // the rules, as the flock's prey do
+    for (const std::size_t n_predators : {std::size_t{4}, std::size_t{120}}) {
+      ensemble::Config config;
+      config.n_prey = 250;
+      config.n_predators = n_predators;
+      config.d = 60.;
+      ensemble::Ensemble one;
+      one.add(config, 11);
+
+      flock::Flock flock(250, n_predators);
+      flock.setDistanceParameters(60., config.prey_ds, config.predator_ds);
+      flock.setSeed(11);
+      flock.generateBoids();
+
+      parallel::ThreadPool pool(2);
+      for (int k = 0; k < 15; ++k) {
+        one.step(1.5, pool);
+        flock.updateFlock(1.5);
+      }
+      const auto prey = flock.getPreyPositions();
+      const auto prey_pos = one.getPreyPositions(0);
+      const auto prey_vel = one.getPreyVelocities(0);
+      for (std::size_t i = 0; i < prey.size(); ++i) {
+        CHECK(prey_pos[i] == prey[i]);
+        CHECK(prey_vel[i] == flock.getPreyVelocities()[i]);
+      }
+      const auto pred_pos = one.getPredatorPositions(0);
+      const auto pred_vel = one.getPredatorVelocities(0);
+      for (std::size_t i = 0; i < n_predators; ++i) {
+        CHECK(pred_pos[i] == flock.getPredatorPositions()[i]);
+        CHECK(pred_vel[i] == flock.getPredatorVelocities()[i]);
+      }
+    }
+  }
+
+  SUBCASE("members avoid the obstacles of their config") {
+    auto field = std::make_shared<obstacles::Field>(
+        static_cast<double>(graphics::window_width),
+        static_cast<double>(graphics::window_height));
+    field->add(obstacles::Circle{point::Point(600., 350.), 160.});
+    field->build();
+    flock::Flock flock(300, 6);
+    flock.setObstacles(field, 0.3, 25.);
+    flock.setSeed(8);
+    flock.generateBoids();
+
+    // one member copied from the flock, one drawn from the same seed
+    ensemble::Ensemble two;
+    two.add(flock);
+    CHECK(two.getConfig(0).obstacles == field);
+    CHECK(two.getConfig(0).obstacle_margin == 25.);
+    ensemble::Config config = two.getConfig(0);
+    two.add(config, 8);
+    CHECK(two.getPreyPositions(1) == two.getPreyPositions(0));
+
+    parallel::ThreadPool pool(2);
+    for (int k = 0; k < 20; ++k) {
+      two.step(2., pool);
+      flock.updateFlock(2.);
+    }
+    for (std::size_t m = 0; m < 2; ++m) {
+      const auto prey_pos = two.getPreyPositions(m);
+      for (std::size_t i = 0; i < prey_pos.size(); ++i) {
+        CHECK(prey_pos[i] == flock.getPreyPositions()[i]);
+        CHECK_FALSE(field->inside(prey_pos[i]));
+      }
+      CHECK(two.getPredatorVelocities(m)[5] ==
+            flock.getPredatorVelocities()[5]);
+    }
+
+    config.obstacle_margin = -1.;
+    CHECK_THROWS_AS(ensemble::validate(config), std::invalid_argument);
+  }
+
+  SUBCASE("the result does not depend on the number of threads") {
+    ensemble::Ensemble serial;
+    serial.add(small, 1);
+    serial.add(large, 2);
+    serial.add(small, 3);
+
+    // nor on where the arenas are placed
+    parallel::ThreadPool one(1);
+    parallel::ThreadPool four(4, true);
+    members.place(four);
+    for (int k = 0; k < 5; ++k) {
+      serial.step(0.5, one);
+      members.step(0.5, four);
+    }
+    for (std::size_t m = 0; m < members.size(); ++m) {
+      CHECK(serial.getPreyPositions(m) == members.getPreyPositions(m));
+      CHECK(serial.getPredatorVelocities(m) ==
+            members.getPredatorVelocities(m));
+    }
+  }
+}
+
+/////////////// TESTING TILES /////////////////
+
+TEST_CASE("Testing tiles") {
+  SUBCASE("a tiled flock steps as the whole flock") {
+    for (const auto& layout : {tiles::Layout{1, 1}, tiles::Layout{2, 2},
+                               tiles::Layout{5, 1}, tiles::Layout{3, 4}}) {
+      flock::Flock whole(400, 12);
+      flock::Flock tiled(400, 12);
+      whole.setSeed(9);
+      tiled.setSeed(9);
+      whole.generateBoids();
+      tiled.generateBoids();
+
+      tiles::World world(tiled, layout);
+      CHECK(world.size() == layout.columns * layout.rows);
+      for (int k = 0; k < 20; ++k) whole.updateFlock(2.);
+      const std::vector<double> busy = world.step(2., 20);
+      CHECK(busy.size() == world.size());
+      for (const double seconds : busy) CHECK(seconds > 0.);
+      world.gather(tiled);
+
+      const auto prey = whole.getPreyFlock();
+      const auto tiled_prey = tiled.getPreyFlock();
+      for (std::size_t i = 0; i < prey.size(); ++i) {
+        CHECK(prey[i]->getPosition() == tiled_prey[i]->getPosition());
+        CHECK(prey[i]->getVelocity() == tiled_prey[i]->getVelocity());
+      }
+      const auto predators = whole.getPredatorFlock();
+      const auto tiled_predators = tiled.getPredatorFlock();
+      for (std::size_t i = 0; i < predators.size(); ++i) {
+        CHECK(predators[i]->getPosition() ==
+              tiled_predators[i]->getPosition());
+      }
+    }
+  }
+
+  SUBCASE("tiles avoid the obstacles of the flock") {
+    auto field = std::make_shared<obstacles::Field>(
+        static_cast<double>(graphics::window_width),
+        static_cast<double>(graphics::window_height));
+    field->add(obstacles::Circle{point::Point(700., 400.), 150.});
+    field->build();
+    flock::Flock whole(300, 6);
+    flock::Flock tiled(300, 6);
+    for (flock::Flock* f : {&whole, &tiled}) {
+      f->setObstacles(field);
+      f->setSeed(4);
+      f->generateBoids();
+    }
+    tiles::World world(tiled, tiles::Layout{2, 2});
+    for (int k = 0; k < 20; ++k) whole.updateFlock(2.);
+    world.step(2., 20);
+    world.gather(tiled);
+    for (std::size_t i = 0; i < 300; ++i) {
+      CHECK(whole.getPreyPositions()[i] == tiled.getPreyPositions()[i]);
+    }
+  }
+
+  SUBCASE("layouts are parsed") {
+    const tiles::Layout layout = tiles::parseLayout("3x2");
+    CHECK(layout.columns == 3);
+    CHECK(layout.rows == 2);
+    CHECK_THROWS_AS(tiles::parseLayout("3"), std::invalid_argument);
+    CHECK_THROWS_AS(tiles::parseLayout("0x2"), std::invalid_argument);
+    CHECK_THROWS_AS(tiles::parseLayout("2x2x"), std::invalid_argument);
+  }
+}
+
+/////////////// TESTING SWEEP /////////////////
+
+TEST_CASE("Testing sweep") {
+  SUBCASE("parameters are read and written by name") {
+    ensemble::Config config;
+    for (const auto& name : ensemble::parameterNames()) {
+      ensemble::set(config, name, 3.);
+      CHECK(ensemble::get(config, name) == doctest::Approx(3.));
+    }
+    ensemble::set(config, "n_prey", 199.6);
+    CHECK(config.n_prey == 200);
+    CHECK_THROWS_AS(ensemble::set(config, "speed", 1.), std::invalid_argument);
+  }
+
+  SUBCASE("a spec is parsed into base values and axes") {
+    std::istringstream in(
+        "# two axes\n"
+        "steps = 40\n"
+        "warmup = 10\n"
+        "sample_every = 5\n"
+        "n_prey = 50   # base value\n"
+        "separation = 0.05:0.2:4\n"
+        "d = 50:100:3\n");
+    const sweep::Spec spec = sweep::parseSpec(in);
+    CHECK(spec.base.n_prey == 50);
+    CHECK(spec.steps == 40);
+    REQUIRE(spec.axes.size() == 2);
+    CHECK(spec.axes[1].name == "d");
+    CHECK(spec.axes[1].levels == 3);
+
+    const auto configs = sweep::configurations(spec);
+    REQUIRE(configs.size() == 12);
+    // the last axis varies fastest
+    CHECK(configs[0].d == doctest::Approx(50.));
+    CHECK(configs[1].d == doctest::Approx(75.));
+    CHECK(configs[3].flight_parameters.separation == doctest::Approx(0.1));
+    // repulsion is derived from separation, as in setFlightParameters
+    CHECK(configs[11].flight_parameters.repulsion == doctest::Approx(1.2));
+  }
+
+  SUBCASE("malformed specs are rejected") {
+    auto parse = [](const std::string& text) {
+      std::istringstream in(text);
+      return sweep::parseSpec(in);
+    };
+    CHECK_THROWS_AS(parse("speed = 3\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("d = abc\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("d = 100:50:2\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("d = 50:100\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("design = lhs\nd = 50:100\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("steps = 5\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("seed = 4294967296\n"), std::runtime_error);
+    CHECK_THROWS_AS(parse("seed = 1e30\n"), std::runtime_error);
+    try {
+      parse("d = 60\nseed = 4294967296\n");
+      FAIL("no error");
+    } catch (const std::runtime_error& e) {
+      CHECK(std::string(e.what()).find("line 2:") == 0);
+    }
+
+    const sweep::Spec spec = parse("prey_min = 5:20:2\n");
+    CHECK_THROWS_AS(sweep::configurations(spec), std::runtime_error);
+
+    // the seeds of the configurations, from seed up, do not wrap around
+    CHECK(sweep::configurations(parse("seed = 4294967294\nd = 50:100:2\n"))
+              .size() == 2);
+    CHECK_THROWS_AS(
+        sweep::configurations(parse("seed = 4294967295\nd = 50:100:2\n")),
+        std::runtime_error);
+  }
+
+  SUBCASE("a Latin hypercube puts one sample in every stratum") {
+    std::istringstream in(
+        "design = lhs\nsamples = 10\nd = 50:100\nalignment = 0:1\n");
+    const auto configs = sweep::configurations(sweep::parseSpec(in));
+    REQUIRE(configs.size() == 10);
+    std::vector<int> d_strata(10, 0);
+    std::vector<int> alignment_strata(10, 0);
+    for (const auto& config : configs) {
+      ++d_strata[static_cast<std::size_t>((config.d - 50.) / 5.)];
+      ++alignment_strata[static_cast<std::size_t>(
+          config.flight_parameters.alignment * 10.)];
+    }
+    CHECK(d_strata == std::vector<int>(10, 1));
+    CHECK(alignment_strata == std::vector<int>(10, 1));
+  }
+
+  SUBCASE("an interrupted sweep resumes where it stopped") {
+    const std::string results =
+        (std::filesystem::temp_directory_path() / "boids_sweep_test.csv")
+            .string();
+    std::filesystem::remove(results);
+
+    std::istringstream in(
+        "steps = 6\nwarmup = 2\nsample_every = 2\nn_prey = 30\n"
+        "n_predators = 1:2:2\ncohesion = 0.002:0.004:2\n");
+    const sweep::Spec spec = sweep::parseSpec(in);
+    parallel::ThreadPool pool(2);
+    std::ostringstream progress;
+
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 4);
+    auto read = [&] {
+      std::vector<std::string> lines;
+      std::ifstream file(results);
+      for (std::string line; std::getline(file, line);) {
+        lines.push_back(line);
+      }
+      return lines;
+    };
+    const std::vector<std::string> complete = read();
+    REQUIRE(complete.size() == 6);
+    CHECK(complete[0].rfind("# sweep ", 0) == 0);
+    CHECK(complete[1].rfind("config,n_predators,cohesion,", 0) == 0);
+
+    // nothing left to do
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 0);
+
+    // keep the first two rows and half of the third, as a killed run would
+    {
+      std::ofstream file(results, std::ios::trunc);
+      file << complete[0] << '\n' << complete[1] << '\n' << complete[2]
+           << '\n' << complete[3] << '\n' << complete[4].substr(0, 10);
+    }
+    // the cut row is dropped and run again
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 2);
+    CHECK(read() == complete);
+
+    // cut inside its last number, a row still has all of its fields
+    {
+      std::ofstream file(results, std::ios::trunc);
+      for (std::size_t k = 0; k < 5; ++k) file << complete[k] << '\n';
+      file << complete[5].substr(0, complete[5].size() - 3);
+    }
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 1);
+    CHECK(read() == complete);
+
+    // a row with a field that is not a number does not count
+    {
+      std::ofstream file(results, std::ios::trunc);
+      for (std::size_t k = 0; k < 5; ++k) file << complete[k] << '\n';
+      std::string broken = complete[5];
+      broken.replace(broken.rfind(','), 1, ",x");
+      file << broken << '\n';
+    }
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 1);
+    CHECK(sweep::run(spec, results, pool, 3, progress) == 0);
+
+    // the results of another spec are not resumed
+    for (const std::string change :
+         {"steps = 8\n", "n_prey = 31\n", "seed = 2\n", "dt = 0.5\n",
+          "n_predators = 1:3:2\n"}) {
+      std::istringstream other_in(
+          "steps = 6\nwarmup = 2\nsample_every = 2\nn_prey = 30\n"
+          "n_predators = 1:2:2\ncohesion = 0.002:0.004:2\n" +
+          change);
+      const sweep::Spec other = sweep::parseSpec(other_in);
+      CHECK_THROWS_AS(sweep::run(other, results, pool, 3, progress),
+                      std::runtime_error);
+    }
+
+    std::filesystem::remove(results);
+  }
+}
+
+/////////////// TESTING SETTINGS /////////////////
+
+TEST_CASE("Testing settings") {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string file = (dir / "boids_settings_test.cfg").string();
+
+  SUBCASE("without arguments the flock is asked for") {
+    const settings::Settings options = settings::load({});
+    CHECK(options.interactive);
+    CHECK_FALSE(options.seed.has_value());
+    CHECK(options.threads == 0);
+    CHECK(options.record.empty());
+  }
+
+  SUBCASE("the command line overrides the file") {
+    std::ofstream(file) << "# a small flock\n"
+                           "n_prey = 150\n"
+                           "n_predators = 3   # a few\n"
+                           "separation = 0.2\n"
+                           "chase = 0.05\n"
+                           "seed = 42\n"
+                           "coast_tolerance = 5\n"
+                           "\n"
+                           "record = frames.bin\n";
+    const settings::Settings options = settings::load(
+        {"--config", file, "--n_prey=300", "--threads", "2", "--pin=1", "--d",
+         "60", "--tiles=2x3", "--obstacles=mask.png"});
+    CHECK_FALSE(options.interactive);
+    CHECK(options.flock.n_prey == 300);
+    CHECK(options.flock.n_predators == 3);
+    CHECK(options.flock.d == doctest::Approx(60.));
+    CHECK(options.seed == 42u);
+    CHECK(options.coast_tolerance == 5.);
+    CHECK(settings::load({"--config", file, "--coast_tolerance=8"})
+              .coast_tolerance == 8.);
+    CHECK(options.threads == 2);
+    CHECK(options.pin);
+    CHECK(options.tiles.columns == 2);
+    CHECK(options.tiles.rows == 3);
+    CHECK(options.record == "frames.bin");
+    CHECK(options.obstacles == "mask.png");
+    CHECK_FALSE(options.lod_density.has_value());
+    CHECK(settings::load({"--lod_density=0.5"}).lod_density == 0.5);
+    CHECK(options.frames.empty());
+    const settings::Settings frames = settings::load(
+        {"--frames=out/f", "--frame_format=png", "--frame_count=12"});
+    CHECK(frames.frames == "out/f");
+    CHECK(frames.frame_format == offscreen::Format::png);
+    CHECK(frames.frame_count == 12);
+    // repulsion follows separation, chase was set
+    CHECK(options.flock.flight_parameters.repulsion == doctest::Approx(1.2));
+    CHECK(options.flock.flight_parameters.chase == doctest::Approx(0.05));
+
+    // output options alone still leave the flock to stdin
+    CHECK(settings::load({"--record", "frames.bin"}).interactive);
+  }
+
+  SUBCASE("errors are reported up front") {
+    CHECK_THROWS_AS(settings::load({"--speed=3"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--n_prey=many"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--n_prey=2.5"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--seed=-1"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--prey_min=20"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--d"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--tiles=4"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--lod_density=-1"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--coast_tolerance=-2"}),
+                    std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--coast_tolerance=far"}),
+                    std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--frame_format=gif"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--frame_count=-2"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"n_prey=3"}), std::runtime_error);
+    CHECK_THROWS_AS(settings::load({"--config", (dir / "missing").string()}),
+                    std::runtime_error);
+
+    std::ofstream(file) << "n_prey = 100\nalignment 0.3\n";
+    try {
+      settings::load({"--config", file});
+      FAIL("no error");
+    } catch (const std::runtime_error& e) {
+      CHECK(std::string(e.what()).find(file + ":2:") == 0);
+    }
+  }
+
+  SUBCASE("a seed makes the flock repeatable") {
+    flock::Flock a(0, 0);
+    flock::Flock b(0, 0);
+    for (flock::Flock* f : {&a, &b}) {
+      f->setFlockSize(20, 2);
+      f->setSeed(7);
+      f->generateBoids();
+    }
+    REQUIRE(a.getPreyNum() == 20);
+    REQUIRE(b.getPredatorsNum() == 2);
+    for (std::size_t i = 0; i < 20; ++i) {
+      CHECK(a.getPreyFlock()[i]->getPosition() ==
+            b.getPreyFlock()[i]->getPosition());
+    }
+  }
+
+  std::filesystem::remove(file);
+}
+
 ///////////// TESTING GRAPHICS ///////////////////
 
 TEST_CASE("Graphics and Main functionality") {
@@ -818,7 +2681,9 @@ TEST_CASE("Graphics and Main functionality") {
     flock::Flock flock(0, 0);
     auto window = graphics::makeWindow(200, 200, "Frame Test");
     REQUIRE(window);
-    CHECK_NOTHROW(graphics::drawFrame(*window, flock, graphics::Style()));
+    graphics::Scratch scratch;
+    CHECK_NOTHROW(
+        graphics::drawFrame(*window, flock, graphics::Style(), scratch));
     window->display();
   }
   SUBCASE("drawFrame with some boids") {
@@ -826,12 +2691,171 @@ TEST_CASE("Graphics and Main functionality") {
     flock.generateBoids();
     auto window = graphics::makeWindow(400, 400, "Frame Test 2");
     REQUIRE(window);
-    CHECK_NOTHROW(graphics::drawFrame(*window, flock, graphics::Style()));
+    graphics::Scratch scratch;
+    CHECK_NOTHROW(
+        graphics::drawFrame(*window, flock, graphics::Style(), scratch));
     window->display();
   }
   SUBCASE("loadBackground") {
     CHECK(graphics::loadBackground("non_existing_file.png") == false);
   }
+  SUBCASE("obstacles") {
+    obstacles::Mask mask;
+    CHECK_FALSE(graphics::loadMask("non_existing_file.png", mask));
+
+    obstacles::Field field(400., 400., 10.);
+    field.add(obstacles::Circle{point::Point(200., 200.), 20.});
+    field.build();
+    // a quad for each cell with its centre inside the circle
+    std::size_t inside = 0;
+    for (std::size_t r = 0; r < field.getRows(); ++r) {
+      for (std::size_t c = 0; c < field.getCols(); ++c) {
+        if (field.sample(c, r) < 0.) ++inside;
+      }
+    }
+    CHECK(inside > 0);
+    CHECK(graphics::makeObstacleMesh(field, sf::Color::Black)
+              .getVertexCount() == 4 * inside);
+
+    flock::Flock flock(5, 1);
+    flock.setObstacles(std::make_shared<obstacles::Field>(field));
+    flock.generateBoids();
+    auto window = graphics::makeWindow(400, 400, "Obstacles Test");
+    graphics::Scratch scratch;
+    CHECK_NOTHROW(
+        graphics::drawFrame(*window, flock, graphics::Style(), scratch));
+  }
+  SUBCASE("heatmap") {
+    auto window = graphics::makeWindow(graphics::window_width,
+                                       graphics::window_height, "LOD Test");
+    CHECK(graphics::screenDensity(*window, 11200) == doctest::Approx(0.01));
+
+    graphics::Style style;
+    style.heatmap_texel = 10;
+    for (const std::size_t n : {std::size_t{20}, std::size_t{3000}}) {
+      flock::Flock flock(n, 3);
+      flock.setSeed(8);
+      flock.generateBoids();
+      flock.updateFlock(1.);
+      graphics::Heatmap heatmap;
+      graphics::splatHeatmap(flock, style, heatmap);
+      CHECK(heatmap.width == 140);
+      CHECK(heatmap.height == 80);
+
+      // every prey in the texel under it, and nowhere else
+      std::vector<float> expected(heatmap.density.size(), 0.f);
+      for (const auto& p : flock.getPreyPositions()) {
+        const auto column = std::min<std::size_t>(
+            139, static_cast<std::size_t>(p.getX() / 10.));
+        const auto row =
+            std::min<std::size_t>(79, static_cast<std::size_t>(p.getY() / 10.));
+        expected[row * 140 + column] += 1.f;
+      }
+      CHECK(heatmap.density == expected);
+      for (std::size_t k = 0; k < expected.size(); ++k) {
+        CHECK((heatmap.pixels[4 * k + 3] > 0) == (expected[k] > 0.f));
+      }
+
+      // on the flock's pool, whatever its size
+      parallel::ThreadPool single(1);
+      flock.setPool(&single);
+      graphics::Heatmap serial;
+      graphics::splatHeatmap(flock, style, serial);
+      CHECK(serial.density == heatmap.density);
+      CHECK(serial.pixels == heatmap.pixels);
+    }
+
+    // dense enough, the prey go through the heatmap
+    flock::Flock flock(500, 2);
+    flock.generateBoids();
+    style.lod_density = 0.;
+    graphics::Scratch scratch;
+    CHECK_NOTHROW(graphics::drawFrame(*window, flock, style, scratch));
+  }
+  SUBCASE("camera and culling") {
+    auto window = graphics::makeWindow(graphics::window_width,
+                                       graphics::window_height, "Camera Test");
+    sf::View camera = window->getDefaultView();
+    sf::FloatRect rect = graphics::visibleRect(*window);
+    CHECK(rect.left == 0.f);
+    CHECK(rect.top == 0.f);
+    CHECK(rect.width == 1400.f);
+    CHECK(rect.height == 800.f);
+
+    // no further out than the world, no closer than max_zoom, same aspect
+    graphics::zoom(camera, 0.5f);
+    CHECK(camera.getSize().x == 1400.f);
+    graphics::zoom(camera, 4.f);
+    CHECK(camera.getSize().x == doctest::Approx(350.));
+    CHECK(camera.getSize().y == doctest::Approx(200.));
+    graphics::zoom(camera, 100.f);
+    CHECK(camera.getSize().x ==
+          doctest::Approx(1400. / graphics::max_zoom));
+
+    // the centre wraps around the world
+    graphics::zoom(camera, 0.01f);
+    graphics::zoom(camera, 2.f);
+    graphics::pan(camera, -1.5f, 0.f);
+    CHECK(camera.getCenter().x == doctest::Approx(700. - 1050. + 1400.));
+    graphics::pan(camera, 0.f, 2.25f);
+    CHECK(camera.getCenter().y == doctest::Approx(400. + 900. - 800.));
+
+    flock::Flock flock(3000, 5);
+    flock.setSeed(9);
+    flock.generateBoids();
+    flock.updateFlock(1.);
+    const auto positions = flock.getPreyPositions();
+    std::vector<graphics::Visible> visible;
+    std::vector<std::size_t> candidates;
+
+    // the whole world: every boid once, where it is
+    graphics::cull(flock.getPreyIndex(), positions,
+                   sf::FloatRect(0.f, 0.f, 1400.f, 800.f), visible,
+                   candidates);
+    REQUIRE(visible.size() == 3000);
+    std::sort(visible.begin(), visible.end(),
+              [](const auto& a, const auto& b) { return a.i < b.i; });
+    for (std::size_t i = 0; i < visible.size(); ++i) {
+      CHECK(visible[i].i == i);
+      CHECK(visible[i].position == positions[i]);
+    }
+
+    // across a corner of the world: the boids of the opposite side too,
+    // moved by a world
+    for (const bool prey : {true, false}) {
+      const auto& index =
+          prey ? flock.getPreyIndex() : flock.getPredatorIndex();
+      const auto boids = prey ? positions : flock.getPredatorPositions();
+      const sf::FloatRect corner(-200.f, 700.f, 400.f, 300.f);
+      graphics::cull(index, boids, corner, visible, candidates);
+      std::size_t expected = 0;
+      for (std::size_t i = 0; i < boids.size(); ++i) {
+        for (const double dx : {-1400., 0.}) {
+          for (const double dy : {0., 800.}) {
+            const point::Point p = boids[i] + point::Point(dx, dy);
+            if (p.getX() >= -200. && p.getX() < 200. && p.getY() >= 700. &&
+                p.getY() < 1000.) {
+              ++expected;
+              CHECK(std::count_if(visible.begin(), visible.end(),
+                                  [&](const graphics::Visible& v) {
+                                    return v.i == i && v.position == p;
+                                  }) == 1);
+            }
+          }
+        }
+      }
+      CHECK(visible.size() == expected);
+    }
+
+    // zoomed in, the boids are drawn instead of the heatmap
+    graphics::Style style;
+    style.lod_density = 0.001;
+    CHECK(graphics::screenDensity(*window, 3000) > style.lod_density);
+    window->setView(camera);
+    CHECK(graphics::screenDensity(*window, 3000) < style.lod_density);
+    graphics::Scratch scratch;
+    CHECK_NOTHROW(graphics::drawFrame(*window, flock, style, scratch));
+  }
   SUBCASE("makeWindow returns valid unique_ptr") {
     auto window = graphics::makeWindow(300, 300, "Window Test");
     REQUIRE(window);
@@ -844,3 +2868,168 @@ TEST_CASE("Graphics and Main functionality") {
     CHECK_NOTHROW(window->pollEvent(event));
   }
 }
+
+/////////////// TESTING OFFSCREEN /////////////////
+
+TEST_CASE("Testing offscreen") {
+  graphics::Style style;
+  auto at = [](const offscreen::Image& image, const unsigned x,
+               const unsigned y) {
+    const std::uint8_t* p = &image.pixels[4 * (y * image.width + x)];
+    return sf::Color(p[0], p[1], p[2], p[3]);
+  };
+  auto count = [&](const offscreen::Image& image, const sf::Color color) {
+    std::size_t n = 0;
+    for (unsigned y = 0; y < image.height; ++y) {
+      for (unsigned x = 0; x < image.width; ++x) {
+        if (at(image, x, y) == color) ++n;
+      }
+    }
+    return n;
+  };
+
+  SUBCASE("formats and paths") {
+    CHECK(offscreen::parseFormat("raw") == offscreen::Format::raw);
+    CHECK(offscreen::parseFormat("ppm") == offscreen::Format::ppm);
+    CHECK(offscreen::parseFormat("png") == offscreen::Format::png);
+    CHECK_THROWS_AS(offscreen::parseFormat("PNG"), std::invalid_argument);
+    CHECK(offscreen::framePath("out/f", 42, offscreen::Format::ppm) ==
+          "out/f000042.ppm");
+    CHECK(offscreen::framePath("f", 1234567, offscreen::Format::raw) ==
+          "f1234567.rgba");
+  }
+
+  SUBCASE("boids") {
+    offscreen::Rasterizer rasterizer;
+    offscreen::Image image;
+    image.width = 140;
+    image.height = 80;
+    rasterizer.draw(flock::Flock(0, 0), style, image);
+    CHECK(count(image, style.background) == 140 * 80);
+
+    flock::Flock flock(1, 1);
+    flock.generateBoids();
+    flock.setBoids({{point::Point(700., 400.), point::Point(1., 0.)}},
+                   {{point::Point(100., 100.), point::Point(0., 1.)}});
+    image.width = graphics::window_width;
+    image.height = graphics::window_height;
+    rasterizer.draw(flock, style, image);
+    // the prey spans 697 to 703, its outline from 695 to past 709
+    CHECK(at(image, 698, 400) == style.prey_fill);
+    CHECK(at(image, 700, 400) == style.prey_fill);
+    CHECK(at(image, 696, 400) == style.prey_outline);
+    CHECK(at(image, 707, 400) == style.prey_outline);
+    CHECK(at(image, 694, 400) == style.background);
+    CHECK(at(image, 712, 400) == style.background);
+    CHECK(at(image, 700, 390) == style.background);
+    CHECK(at(image, 100, 101) == style.predator_fill);
+    CHECK(at(image, 100, 108) == style.predator_outline);
+    CHECK(at(image, 108, 100) == style.background);
+
+    // half the size, the same picture
+    image.width = graphics::window_width / 2;
+    image.height = graphics::window_height / 2;
+    rasterizer.draw(flock, style, image);
+    CHECK(at(image, 349, 200) == style.prey_fill);
+    CHECK(at(image, 50, 49) == style.predator_fill);
+    CHECK(count(image, style.background) > image.width * image.height - 100);
+  }
+
+  SUBCASE("boids on the seams") {
+    offscreen::Rasterizer rasterizer;
+    offscreen::Image image;
+    image.width = graphics::window_width;
+    image.height = graphics::window_height;
+    flock::Flock flock(1, 1);
+    flock.generateBoids();
+    auto draw = [&](const point::Point& prey, const point::Point& predator) {
+      flock.setBoids({{prey, point::Point(1., 1.)}},
+                     {{predator, point::Point(0., 1.)}});
+      rasterizer.draw(flock, style, image);
+      return std::array<std::size_t, 4>{
+          count(image, style.prey_fill), count(image, style.prey_outline),
+          count(image, style.predator_fill),
+          count(image, style.predator_outline)};
+    };
+
+    // whole pixels away from the middle, the same boids: split over the
+    // four corners, and the predator over the top and bottom edges
+    const auto middle =
+        draw(point::Point(700.5, 400.5), point::Point(300.5, 400.5));
+    CHECK(middle[0] > 0);
+    CHECK(middle[2] > 0);
+    const auto seams = draw(point::Point(0.5, 0.5), point::Point(300.5, 0.5));
+    CHECK(seams == middle);
+    CHECK(at(image, 1399, 799) == style.prey_fill);
+    CHECK(at(image, 300, 799) == style.predator_fill);
+    CHECK(at(image, 300, 2) == style.predator_fill);
+  }
+
+  SUBCASE("obstacles and heatmap") {
+    auto field = std::make_shared<obstacles::Field>(1400., 800., 10.);
+    field->add(obstacles::Circle{point::Point(300., 300.), 40.});
+    field->build();
+    flock::Flock flock(3000, 2);
+    flock.setObstacles(field);
+    flock.setSeed(4);
+    flock.generateBoids();
+
+    offscreen::Rasterizer rasterizer;
+    offscreen::Image image;
+    image.width = 700;
+    image.height = 400;
+    style.lod_density = 1.;
+    rasterizer.draw(flock, style, image);
+    // the obstacle colour over the background
+    CHECK(at(image, 150, 150) == sf::Color(110, 110, 99));
+    CHECK(count(image, style.prey_fill) > 0);
+    CHECK(count(image, style.predator_fill) > 0);
+
+    // as a heatmap, but for the predators
+    style.lod_density = 0.;
+    rasterizer.draw(flock, style, image);
+    CHECK(at(image, 150, 150) == sf::Color(110, 110, 99));
+    CHECK(count(image, style.prey_fill) == 0);
+    CHECK(count(image, style.predator_fill) > 0);
+    CHECK(count(image, style.background) < 700 * 400 - 3000);
+  }
+
+  SUBCASE("encoder") {
+    const std::string prefix =
+        (std::filesystem::temp_directory_path() / "boids_frame_").string();
+    for (const auto format :
+         {offscreen::Format::raw, offscreen::Format::ppm,
+          offscreen::Format::png}) {
+      offscreen::Encoder encoder(prefix, format, 2, 2);
+      for (std::uint8_t frame = 0; frame < 10; ++frame) {
+        offscreen::Image image = encoder.acquire();
+        image.width = 16;
+        image.height = 8;
+        image.pixels.assign(4 * 16 * 8, frame);
+        encoder.submit(std::move(image));
+      }
+      encoder.flush();
+      CHECK(encoder.getWritten() + encoder.getFailed() == 10);
+      // the images come back to be drawn into again
+      CHECK(encoder.acquire().pixels.size() == 4 * 16 * 8);
+
+      if (format == offscreen::Format::png) continue;
+      CHECK(encoder.getFailed() == 0);
+      for (std::uint64_t frame = 0; frame < 10; ++frame) {
+        const std::string path = offscreen::framePath(prefix, frame, format);
+        std::ifstream in(path, std::ios::binary);
+        const std::string bytes((std::istreambuf_iterator<char>(in)),
+                                std::istreambuf_iterator<char>());
+        const std::string header =
+            format == offscreen::Format::ppm ? "P6\n16 8\n255\n" : "";
+        CHECK(bytes.size() ==
+              header.size() +
+                  (format == offscreen::Format::ppm ? 3u : 4u) * 16 * 8);
+        CHECK(bytes.substr(0, header.size()) == header);
+        CHECK(static_cast<std::uint64_t>(bytes.back()) == frame);
+        in.close();
+        std::filesystem::remove(path);
+      }
+    }
+  }
+}
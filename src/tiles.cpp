@@ -0,0 +1,434 @@
+#include "../include/tiles.hpp"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "../include/graphics.hpp"
+#include "../include/parallel.hpp"
+#include "../include/point.hpp"
+
+namespace tiles {
+
+namespace {
+
+constexpr auto width = static_cast<double>(graphics::window_width);
+constexpr auto height = static_cast<double>(graphics::window_height);
+
+// a boid as sent between processes: its index in the flock and its state
+struct Record {
+  std::uint64_t id;
+  double x;
+  double y;
+  double vx;
+  double vy;
+};
+
+// what the parent asks of the tile processes
+struct Order {
+  std::uint64_t what;
+  std::uint64_t n_steps;
+  double dt;
+};
+constexpr std::uint64_t step_order = 0;
+constexpr std::uint64_t gather_order = 1;
+constexpr std::uint64_t quit_order = 2;
+
+// blocking transfers of `size` bytes; a peer that is gone is an error
+void sendAll(const int fd, const void* data, std::size_t size) {
+  const auto* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) throw std::runtime_error("a tile process is gone");
+    bytes += sent;
+    size -= static_cast<std::size_t>(sent);
+  }
+}
+
+void receiveAll(const int fd, void* data, std::size_t size) {
+  auto* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t received = ::recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) throw std::runtime_error("a tile process is gone");
+    bytes += received;
+    size -= static_cast<std::size_t>(received);
+  }
+}
+
+void sendRecords(const int fd, const std::vector<Record>& records) {
+  const std::uint64_t n = records.size();
+  sendAll(fd, &n, sizeof n);
+  sendAll(fd, records.data(), n * sizeof(Record));
+}
+
+// appends the records to `records`
+void receiveRecords(const int fd, std::vector<Record>& records) {
+  std::uint64_t n;
+  receiveAll(fd, &n, sizeof n);
+  const std::size_t old = records.size();
+  records.resize(old + n);
+  receiveAll(fd, records.data() + old, n * sizeof(Record));
+}
+
+// the tile of coordinate v along an axis of `size` cut in n
+std::size_t slot(const double v, const double size, const std::size_t n) {
+  const double k = std::floor(v / size * static_cast<double>(n));
+  if (k < 0) return 0;
+  return std::min(n - 1, static_cast<std::size_t>(k));
+}
+
+// distance from v to [lo, hi) along a circle of length `size`
+double gap(const double v, const double lo, const double hi,
+           const double size) {
+  if (v >= lo && v < hi) return 0.;
+  return std::min(std::abs(point::wrap(v - lo, size)),
+                  std::abs(point::wrap(v - hi, size)));
+}
+
+void closeAll(std::vector<int>& fds) {
+  for (int& fd : fds) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+  }
+}
+
+// the processes quit on request, or on finding their link closed
+void stop(std::vector<int>& links, std::vector<int>& processes) {
+  const Order order{quit_order, 0, 0.};
+  for (const int link : links) {
+    if (link >= 0) ::send(link, &order, sizeof order, MSG_NOSIGNAL);
+  }
+  closeAll(links);
+  for (const int process : processes) ::waitpid(process, nullptr, 0);
+  processes.clear();
+}
+
+// the state and the work of one tile process
+class Tile {
+ private:
+  Layout layout_;
+  std::size_t me_;
+  std::vector<int> peers_;  // socket to every other tile, -1 for this one
+
+  double reach_;  // depth of the halo
+
+  // the tile's own: a process started by fork has none of the parent's
+  // threads, those of the default pool among them
+  parallel::ThreadPool pool_{1};
+  // owned boids, halo and predators, in flock order; set anew every step
+  flock::Flock local_{0, 0};
+  std::vector<std::array<point::Point, 2>> prey_states_;  // reused
+  std::vector<std::array<point::Point, 2>> predator_states_;
+
+  std::vector<Record> prey_;       // owned and halo, by id
+  std::vector<Record> predators_;  // all of them, by id
+
+  std::size_t tileOf(const Record& r) const {
+    return slot(r.y, height, layout_.rows) * layout_.columns +
+           slot(r.x, width, layout_.columns);
+  }
+
+  // whether tile t steps the boid, or one of its boids may see it
+  bool near(const Record& r, const std::size_t t) const {
+    if (tileOf(r) == t) return true;
+    const auto columns = static_cast<double>(layout_.columns);
+    const auto rows = static_cast<double>(layout_.rows);
+    const auto column = static_cast<double>(t % layout_.columns);
+    const auto row = static_cast<double>(t / layout_.columns);
+    const double dx =
+        gap(r.x, column * width / columns, (column + 1) * width / columns,
+            width);
+    const double dy =
+        gap(r.y, row * height / rows, (row + 1) * height / rows, height);
+    return dx * dx + dy * dy <= reach_ * reach_;
+  }
+
+ public:
+  Tile(const flock::Flock& flock, const Layout layout, const std::size_t me,
+       std::vector<int> peers)
+      : layout_{layout},
+        me_{me},
+        peers_{std::move(peers)},
+        // a hair more than d, so that rounding at the borders of the tiles
+        // never leaves a neighbour out
+        reach_{1.0001 * flock.getDistanceParameters()[0]} {
+    const auto distances = flock.getDistanceParameters();
+    const auto avoidance = flock.getObstacleParameters();
+    local_.setPool(&pool_);
+    local_.setFlightParameters(flock.getFlightParameters());
+    local_.setSpeedLimits(flock.getSpeedLimits());
+    local_.setDistanceParameters(distances[0], distances[1], distances[2]);
+    local_.setObstacles(flock.getObstacles(), avoidance[0], avoidance[1]);
+
+    auto record = [](const std::size_t i, const point::Point& position,
+                     const point::Point& velocity) {
+      return Record{i, position.getX(), position.getY(), velocity.getX(),
+                    velocity.getY()};
+    };
+    const auto prey = flock.getPreyPositions();
+    const auto prey_velocities = flock.getPreyVelocities();
+    for (std::size_t i = 0; i < prey.size(); ++i) {
+      const Record r = record(i, prey[i], prey_velocities[i]);
+      if (near(r, me_)) prey_.push_back(r);
+    }
+    const auto predators = flock.getPredatorPositions();
+    const auto predator_velocities = flock.getPredatorVelocities();
+    for (std::size_t i = 0; i < predators.size(); ++i) {
+      predators_.push_back(record(i, predators[i], predator_velocities[i]));
+    }
+  }
+
+  // steps the boids of the tile on its flock, made of them, their halo and
+  // the predators, then sends every tile what it needs of the result. Tiles
+  // talk pair by pair in one global order, the lower one sending first, so
+  // that none waits on another that waits on it. Returns the seconds the
+  // flock's step took
+  double step(const double dt) {
+    auto state = [](const Record& r) {
+      return std::array<point::Point, 2>{point::Point(r.x, r.y),
+                                         point::Point(r.vx, r.vy)};
+    };
+    prey_states_.clear();
+    for (const Record& r : prey_) prey_states_.push_back(state(r));
+    predator_states_.clear();
+    for (const Record& r : predators_) predator_states_.push_back(state(r));
+    local_.setBoids(prey_states_, predator_states_);
+    // the halo is stepped along with the rest, and its result dropped
+    local_.updateFlock(dt);
+    const std::vector<double>& busy = local_.getBusyTime();
+    const double seconds = std::accumulate(busy.begin(), busy.end(), 0.);
+
+    auto moved = [](const Record& r, const std::size_t i,
+                    const flock::View<point::Point> positions,
+                    const flock::View<point::Point> velocities) {
+      return Record{r.id, positions[i].getX(), positions[i].getY(),
+                    velocities[i].getX(), velocities[i].getY()};
+    };
+    std::vector<Record> moved_prey;
+    for (std::size_t i = 0; i < prey_.size(); ++i) {
+      if (tileOf(prey_[i]) == me_) {
+        moved_prey.push_back(moved(prey_[i], i, local_.getPreyPositions(),
+                                   local_.getPreyVelocities()));
+      }
+    }
+    std::vector<Record> moved_predators;
+    for (std::size_t i = 0; i < predators_.size(); ++i) {
+      if (tileOf(predators_[i]) == me_) {
+        moved_predators.push_back(moved(predators_[i], i,
+                                        local_.getPredatorPositions(),
+                                        local_.getPredatorVelocities()));
+      }
+    }
+
+    prey_.clear();
+    for (const Record& r : moved_prey) {
+      if (near(r, me_)) prey_.push_back(r);
+    }
+    for (const Record& r : moved_predators) predators_[r.id] = r;
+
+    std::vector<Record> outgoing;
+    std::vector<Record> incoming;
+    for (std::size_t t = 0; t < peers_.size(); ++t) {
+      if (t == me_) continue;
+      outgoing.clear();
+      for (const Record& r : moved_prey) {
+        if (near(r, t)) outgoing.push_back(r);
+      }
+      auto send = [&] {
+        sendRecords(peers_[t], outgoing);
+        sendRecords(peers_[t], moved_predators);
+      };
+      auto receive = [&] {
+        receiveRecords(peers_[t], prey_);
+        incoming.clear();
+        receiveRecords(peers_[t], incoming);
+        for (const Record& r : incoming) predators_[r.id] = r;
+      };
+      if (me_ < t) {
+        send();
+        receive();
+      } else {
+        receive();
+        send();
+      }
+    }
+
+    std::sort(prey_.begin(), prey_.end(),
+              [](const Record& a, const Record& b) { return a.id < b.id; });
+    return seconds;
+  }
+
+  // sends the parent the boids the tile owns
+  void gather(const int parent) const {
+    std::vector<Record> owned;
+    for (const Record& r : prey_) {
+      if (tileOf(r) == me_) owned.push_back(r);
+    }
+    sendRecords(parent, owned);
+    owned.clear();
+    for (const Record& r : predators_) {
+      if (tileOf(r) == me_) owned.push_back(r);
+    }
+    sendRecords(parent, owned);
+  }
+};
+
+// the loop of a tile process, which never returns: the process ends with
+// _exit, so that it leaves alone what it shares with the parent, such as
+// the buffers of the standard streams and the threads of the default pool
+[[noreturn]] void serve(Tile& tile, const int parent) {
+  try {
+    while (true) {
+      Order order;
+      receiveAll(parent, &order, sizeof order);
+      if (order.what == quit_order) _exit(0);
+      if (order.what == step_order) {
+        double busy = 0.;
+        for (std::size_t k = 0; k < order.n_steps; ++k) {
+          busy += tile.step(order.dt);
+        }
+        sendAll(parent, &busy, sizeof busy);
+      } else {
+        tile.gather(parent);
+      }
+    }
+  } catch (...) {
+    _exit(1);
+  }
+}
+
+}  // namespace
+
+Layout parseLayout(const std::string& text) {
+  const auto x = text.find('x');
+  std::size_t columns = 0;
+  std::size_t rows = 0;
+  try {
+    std::size_t used = 0;
+    columns = std::stoul(text.substr(0, x), &used);
+    if (used != x) columns = 0;
+    rows = std::stoul(text.substr(x + 1), &used);
+    if (used != text.size() - x - 1) rows = 0;
+  } catch (const std::exception&) {
+    columns = 0;
+  }
+  if (x == std::string::npos || columns == 0 || rows == 0) {
+    throw std::invalid_argument("'" + text + "' is no layout like 2x2");
+  }
+  return {columns, rows};
+}
+
+World::World(const flock::Flock& flock, const Layout layout)
+    : layout_{layout},
+      n_prey_{flock.getPreyNum()},
+      n_predators_{flock.getPredatorsNum()} {
+  assert(layout.columns > 0 && layout.rows > 0);
+  const std::size_t n = size();
+
+  // mesh[a][b]: the end held by tile a of the socket between a and b;
+  // ends[t]: the end held by tile t of its link to the parent
+  std::vector<std::vector<int>> mesh(n, std::vector<int>(n, -1));
+  std::vector<int> ends(n, -1);
+  auto cleanUp = [&] {
+    for (auto& row : mesh) closeAll(row);
+    closeAll(ends);
+  };
+  auto connect = [&](int& a, int& b) {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      cleanUp();
+      closeAll(links_);
+      throw std::runtime_error("cannot connect the tile processes");
+    }
+    a = fds[0];
+    b = fds[1];
+  };
+  for (std::size_t a = 0; a < n; ++a) {
+    for (std::size_t b = a + 1; b < n; ++b) connect(mesh[a][b], mesh[b][a]);
+  }
+  links_.assign(n, -1);
+  for (std::size_t t = 0; t < n; ++t) connect(links_[t], ends[t]);
+
+  for (std::size_t t = 0; t < n; ++t) {
+    const pid_t process = ::fork();
+    if (process == 0) {
+      try {
+        closeAll(links_);
+        for (std::size_t a = 0; a < n; ++a) {
+          if (a != t) closeAll(mesh[a]);
+          if (a != t && ends[a] >= 0) ::close(ends[a]);
+        }
+        Tile tile(flock, layout, t, mesh[t]);
+        serve(tile, ends[t]);
+      } catch (...) {
+        _exit(1);
+      }
+    }
+    if (process < 0) {
+      cleanUp();
+      stop(links_, processes_);
+      throw std::runtime_error("cannot start the tile processes");
+    }
+    processes_.push_back(process);
+    ::close(ends[t]);
+    ends[t] = -1;
+  }
+  cleanUp();
+}
+
+World::~World() { stop(links_, processes_); }
+
+std::size_t World::size() const { return layout_.columns * layout_.rows; }
+
+std::vector<double> World::step(const double dt, const std::size_t n_steps) {
+  assert(dt >= 0);
+  std::vector<double> busy(links_.size(), 0.);
+  if (n_steps == 0) return busy;
+  const Order order{step_order, n_steps, dt};
+  for (const int link : links_) sendAll(link, &order, sizeof order);
+  for (std::size_t t = 0; t < links_.size(); ++t) {
+    receiveAll(links_[t], &busy[t], sizeof busy[t]);
+  }
+  return busy;
+}
+
+void World::gather(flock::Flock& flock) const {
+  assert(flock.getPreyNum() == n_prey_);
+  assert(flock.getPredatorsNum() == n_predators_);
+  const Order order{gather_order, 0, 0.};
+  for (const int link : links_) sendAll(link, &order, sizeof order);
+  std::vector<Record> prey;
+  std::vector<Record> predators;
+  for (const int link : links_) {
+    receiveRecords(link, prey);
+    receiveRecords(link, predators);
+  }
+  if (prey.size() != n_prey_ || predators.size() != n_predators_) {
+    throw std::runtime_error("the tiles lost track of some boids");
+  }
+
+  auto states = [](const std::vector<Record>& records) {
+    std::vector<std::array<point::Point, 2>> out(records.size());
+    for (const Record& r : records) {
+      out[r.id] = {point::Point(r.x, r.y), point::Point(r.vx, r.vy)};
+    }
+    return out;
+  };
+  flock.setBoids(states(prey), states(predators));
+}
+
+}  // namespace tiles